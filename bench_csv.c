@@ -0,0 +1,483 @@
+/*
+bench_csv - measure the throughput of the parser and writers on generated
+            data and print the results as CSV, one line per measurement
+
+usage: bench_csv [-s megabytes] [-r repeat] [corpus...]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./csv.h"
+
+/* Hardware counters are read through perf_event where the kernel allows it */
+#if defined(__linux__)
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#  define HAVE_PERF_EVENT 1
+#endif
+
+#define DEFAULT_SIZE 32  /* Megabytes of data per corpus */
+#define DEFAULT_REPEAT 5 /* The best of this many runs is reported */
+
+struct corpus {
+  const char *name;
+  unsigned char delim;
+  unsigned char quote;
+  size_t big;             /* Size of the generated fields, 0 to use pieces */
+  const char *pieces[6];  /* Fields are drawn from these at random */
+};
+
+static const struct corpus corpora[] = {
+  {"narrow",      ',', '"', 0, {"1", "23", "456", "7890", "-12", "3.14"}},
+  {"wide",        ',', '"', 0, {"the quick brown fox jumps over the lazy dog",
+                                "lorem ipsum dolor sit amet consectetur adipiscing elit",
+                                "sed do eiusmod tempor", "incididunt ut labore", "et dolore", "magna"}},
+  {"quoted",      ',', '"', 0, {"\"abc\"", "\"de,f\"", "\"ghij\"", "\"k\"", "\"lmno pq\"", "\"r\""}},
+  {"quote_heavy", ',', '"', 0, {"\"a\"\"b\"", "\"\"\"\"", "\"c\"\"d\"", "\"e\"\"\"", "\" f \"", "\"g,\"\"h\""}},
+  {"newlines",    ',', '"', 0, {"\"first\x0aline\"", "\"a\x0d\x0a" "b\"", "plain", "\"x\x0a\x0ay\"", "42", "\"end\x0a\""}},
+  {"large",       ',', '"', 4 << 20, {NULL}},
+  {"custom",      ';', '\'', 0, {"1", "a;b", "'c;d'", "'e''f'", "g,h", "'i\"j'"}}
+};
+
+/* Chunk sizes csv_parse is measured with, 0 passes all the data at once */
+static const size_t chunk_sizes[] = {4096, 65536, 0};
+
+struct counters {
+  int fd[2];                  /* cycles and branch misses, -1 if unavailable */
+  unsigned long long value[2];
+};
+
+struct result {
+  double secs;
+  unsigned long long cycles;
+  unsigned long long misses;
+  int have_counters;
+};
+
+static unsigned long rows;
+
+static void
+cb1 (void *s, size_t len, void *data)
+{
+  (void)s, (void)len, (void)data;
+}
+
+static void
+cb2 (int c, void *data)
+{
+  (void)c, (void)data;
+  rows++;
+}
+
+static void
+counters_open (struct counters *c)
+{
+#ifdef HAVE_PERF_EVENT
+  static const unsigned long long config[2] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_BRANCH_MISSES};
+  struct perf_event_attr attr;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = config[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    c->fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#else
+  c->fd[0] = c->fd[1] = -1;
+#endif
+}
+
+static void
+counters_start (struct counters *c)
+{
+#ifdef HAVE_PERF_EVENT
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (c->fd[i] >= 0) {
+      ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#else
+  (void)c;
+#endif
+}
+
+static int
+counters_stop (struct counters *c)
+{
+  /* Read the counters, returns 1 if both are available */
+#ifdef HAVE_PERF_EVENT
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (c->fd[i] < 0)
+      return 0;
+    ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(c->fd[i], &c->value[i], sizeof c->value[i]) != sizeof c->value[i])
+      return 0;
+  }
+  return 1;
+#else
+  (void)c;
+  return 0;
+#endif
+}
+
+static char *
+generate (const struct corpus *corpus, size_t size, size_t *len)
+{
+  char *buf = malloc(size + corpus->big * 2 + 256);
+  unsigned long seed = 1;
+  size_t pos = 0, i;
+  int col = 0;
+
+  if (buf == NULL)
+    return NULL;
+
+  while (pos < size) {
+    const char *piece;
+    seed = seed * 1103515245UL + 12345UL;
+    if (corpus->big) {
+      /* A quoted field of text with a doubled quote every 64 bytes */
+      buf[pos++] = corpus->quote;
+      for (i = 0; i < corpus->big; i++) {
+        buf[pos++] = i % 64 ? "abcdefgh ,\x0a"[(seed >> (i % 16)) % 11] : corpus->quote;
+        if (i % 64 == 0)
+          buf[pos++] = corpus->quote;
+      }
+      buf[pos++] = corpus->quote;
+    } else {
+      piece = corpus->pieces[(seed >> 16) % 6];
+      memcpy(buf + pos, piece, strlen(piece));
+      pos += strlen(piece);
+    }
+    buf[pos++] = ++col % 8 ? corpus->delim : '\x0a';
+  }
+
+  *len = pos;
+  return buf;
+}
+
+static void
+report (const char *bench, const struct corpus *corpus, size_t chunk, size_t bytes, unsigned long nrows,
+        const struct result *r)
+{
+  /* Print a line of results, the counters are left empty if unavailable */
+  printf("%s,%s,%lu,%lu,%lu,%.1f,%.0f,", bench, corpus->name, (unsigned long)chunk, (unsigned long)bytes,
+         nrows, r->secs > 0 ? bytes / r->secs / 1e6 : 0.0, r->secs > 0 ? nrows / r->secs : 0.0);
+  if (r->have_counters)
+    printf("%.3f,%.3f\n", (double)r->cycles / bytes, r->misses * 1024.0 / bytes);
+  else
+    printf(",\n");
+  fflush(stdout);
+}
+
+static void
+keep_best (struct result *best, double secs, struct counters *c)
+{
+  int have_counters = counters_stop(c);
+
+  if (best->secs == 0 || secs < best->secs) {
+    best->secs = secs;
+    best->have_counters = have_counters;
+    best->cycles = c->value[0];
+    best->misses = c->value[1];
+  }
+}
+
+static struct result
+bench_parse (const struct corpus *corpus, const char *buf, size_t len, size_t chunk, unsigned char options,
+             int repeat, struct counters *c)
+{
+  struct result best = {0, 0, 0, 0};
+  int i;
+
+  if (chunk == 0)
+    chunk = len;
+
+  for (i = 0; i < repeat; i++) {
+    struct csv_parser p;
+    size_t pos;
+    clock_t start;
+
+    csv_init(&p, options);
+    csv_set_delim(&p, corpus->delim);
+    csv_set_quote(&p, corpus->quote);
+    rows = 0;
+    counters_start(c);
+    start = clock();
+    for (pos = 0; pos < len; pos += chunk)
+      csv_parse(&p, buf + pos, len - pos < chunk ? len - pos : chunk, cb1, cb2, NULL);
+    csv_fini(&p, cb1, cb2, NULL);
+    keep_best(&best, (double)(clock() - start) / CLOCKS_PER_SEC, c);
+    csv_free(&p);
+  }
+
+  return best;
+}
+
+static struct result
+bench_validate (const struct corpus *corpus, const char *buf, size_t len, int repeat, struct counters *c)
+{
+  struct result best = {0, 0, 0, 0};
+  int i;
+
+  for (i = 0; i < repeat; i++) {
+    struct csv_parser p;
+    clock_t start;
+
+    csv_init(&p, CSV_STRICT);
+    csv_set_delim(&p, corpus->delim);
+    csv_set_quote(&p, corpus->quote);
+    counters_start(c);
+    start = clock();
+    csv_validate(&p, buf, len);
+    csv_fini(&p, NULL, NULL, NULL);
+    keep_best(&best, (double)(clock() - start) / CLOCKS_PER_SEC, c);
+    csv_free(&p);
+  }
+
+  return best;
+}
+
+static struct result
+bench_count (const struct corpus *corpus, const char *buf, size_t len, int repeat, struct counters *c)
+{
+  struct result best = {0, 0, 0, 0};
+  int i;
+
+  for (i = 0; i < repeat; i++) {
+    struct csv_parser p;
+    size_t rows = 0, fields = 0;
+    clock_t start;
+
+    csv_init(&p, 0);
+    csv_set_delim(&p, corpus->delim);
+    csv_set_quote(&p, corpus->quote);
+    counters_start(c);
+    start = clock();
+    csv_count(&p, buf, len, &rows, &fields);
+    csv_count_fini(&p, &rows, &fields);
+    keep_best(&best, (double)(clock() - start) / CLOCKS_PER_SEC, c);
+    csv_free(&p);
+  }
+
+  return best;
+}
+
+/* Fields of a corpus, for the write benchmarks */
+struct fields {
+  char *values;
+  size_t used;
+  size_t size;
+  size_t *ends;     /* End offset of each field in values */
+  size_t count;
+  size_t max;
+  unsigned char *last;  /* Non-zero for the last field of a row */
+};
+
+static void
+collect_field (void *s, size_t len, void *data)
+{
+  struct fields *f = data;
+
+  if (f->count == f->max) {
+    f->max = f->max ? f->max * 2 : 1024;
+    if ((f->ends = realloc(f->ends, f->max * sizeof *f->ends)) == NULL
+        || (f->last = realloc(f->last, f->max)) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (f->used + len > f->size) {
+    while (f->used + len > f->size)
+      f->size = f->size ? f->size * 2 : 1 << 20;
+    if ((f->values = realloc(f->values, f->size)) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (len)
+    memcpy(f->values + f->used, s, len);
+  f->used += len;
+  f->last[f->count] = 0;
+  f->ends[f->count++] = f->used;
+}
+
+static void
+collect_row (int c, void *data)
+{
+  struct fields *f = data;
+
+  (void)c;
+  if (f->count)
+    f->last[f->count - 1] = 1;
+}
+
+static int
+collect (const struct corpus *corpus, const char *buf, size_t len, struct fields *f)
+{
+  struct csv_parser p;
+
+  memset(f, 0, sizeof *f);
+  csv_init(&p, 0);
+  csv_set_delim(&p, corpus->delim);
+  csv_set_quote(&p, corpus->quote);
+  csv_parse(&p, buf, len, collect_field, collect_row, f);
+  csv_fini(&p, collect_field, collect_row, f);
+  csv_free(&p);
+  return f->count ? 0 : -1;
+}
+
+static struct result
+bench_write (const struct corpus *corpus, const struct fields *f, int kind, int repeat, struct counters *c)
+{
+  /* kind 0 measures csv_write2 to memory, 1 csv_fwrite2 to a temporary file
+     and 2 a csv_writer to memory */
+  struct result best = {0, 0, 0, 0};
+  size_t out_size = f->used * 2 + f->count * 3;
+  char *out = kind == 0 ? malloc(out_size) : NULL;
+  FILE *fp = kind == 1 ? tmpfile() : NULL;
+  int i;
+
+  if ((kind == 0 && out == NULL) || (kind == 1 && fp == NULL)) {
+    fprintf(stderr, "Failed to set up output\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < repeat; i++) {
+    struct csv_writer w;
+    size_t j, start_off = 0, pos = 0;
+    clock_t start;
+
+    if (kind == 1)
+      rewind(fp);
+    if (kind == 2) {
+      csv_writer_init(&w, 0);
+      csv_writer_set_delim(&w, corpus->delim);
+      csv_writer_set_quote(&w, corpus->quote);
+    }
+    counters_start(c);
+    start = clock();
+    for (j = 0; j < f->count; j++) {
+      const char *s = f->values + start_off;
+      size_t len = f->ends[j] - start_off;
+      start_off = f->ends[j];
+      if (kind == 0) {
+        pos += csv_write2(out + pos, out_size - pos, s, len, corpus->quote);
+        out[pos++] = f->last[j] ? '\x0a' : corpus->delim;
+      } else if (kind == 1) {
+        csv_fwrite2(fp, s, len, corpus->quote);
+        putc(f->last[j] ? '\x0a' : corpus->delim, fp);
+      } else {
+        csv_writer_field(&w, s, len);
+        if (f->last[j])
+          csv_writer_end_row(&w);
+      }
+    }
+    if (kind == 1)
+      fflush(fp);
+    keep_best(&best, (double)(clock() - start) / CLOCKS_PER_SEC, c);
+    if (kind == 2)
+      csv_writer_free(&w);
+  }
+
+  free(out);
+  if (fp)
+    fclose(fp);
+  return best;
+}
+
+int
+main (int argc, char *argv[])
+{
+  size_t size = DEFAULT_SIZE, i, j, len;
+  int repeat = DEFAULT_REPEAT, arg, selected, any = 0;
+  struct counters c;
+
+  for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (!strcmp(argv[arg], "-s") && arg + 1 < argc)
+      size = strtoul(argv[++arg], NULL, 10);
+    else if (!strcmp(argv[arg], "-r") && arg + 1 < argc)
+      repeat = atoi(argv[++arg]);
+    else {
+      fprintf(stderr, "Usage: bench_csv [-s megabytes] [-r repeat] [corpus...]\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (size == 0 || repeat <= 0) {
+    fprintf(stderr, "Size and repeat count must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  counters_open(&c);
+  printf("benchmark,corpus,chunk,bytes,rows,mb_per_s,rows_per_s,cycles_per_byte,branch_misses_per_kb\n");
+
+  for (i = 0; i < sizeof corpora / sizeof *corpora; i++) {
+    const struct corpus *corpus = &corpora[i];
+    struct fields f;
+    struct result r;
+    unsigned long nrows;
+    char *buf;
+
+    selected = arg == argc;
+    for (j = arg; j < (size_t)argc; j++)
+      if (!strcmp(argv[j], corpus->name))
+        selected = 1;
+    if (!selected)
+      continue;
+    any = 1;
+
+    if ((buf = generate(corpus, size << 20, &len)) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return EXIT_FAILURE;
+    }
+
+    for (j = 0; j < sizeof chunk_sizes / sizeof *chunk_sizes; j++) {
+      r = bench_parse(corpus, buf, len, chunk_sizes[j], 0, repeat, &c);
+      report("parse", corpus, chunk_sizes[j], len, rows, &r);
+    }
+    r = bench_parse(corpus, buf, len, 65536, CSV_DFA, repeat, &c);
+    report("parse_dfa", corpus, 65536, len, rows, &r);
+    r = bench_parse(corpus, buf, len, 65536, CSV_ZERO_COPY, repeat, &c);
+    report("parse_zero_copy", corpus, 65536, len, rows, &r);
+    nrows = rows;
+    r = bench_validate(corpus, buf, len, repeat, &c);
+    report("validate", corpus, 0, len, nrows, &r);
+    r = bench_count(corpus, buf, len, repeat, &c);
+    report("count", corpus, 0, len, nrows, &r);
+
+    if (collect(corpus, buf, len, &f) != 0) {
+      fprintf(stderr, "Failed to parse corpus %s\n", corpus->name);
+      return EXIT_FAILURE;
+    }
+    r = bench_write(corpus, &f, 0, repeat, &c);
+    report("write2", corpus, 0, f.used, nrows, &r);
+    r = bench_write(corpus, &f, 1, repeat, &c);
+    report("fwrite2", corpus, 0, f.used, nrows, &r);
+    r = bench_write(corpus, &f, 2, repeat, &c);
+    report("writer", corpus, 0, f.used, nrows, &r);
+
+    free(f.values);
+    free(f.ends);
+    free(f.last);
+    free(buf);
+  }
+
+  if (!any) {
+    fprintf(stderr, "No such corpus\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -21,14 +21,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define LIBCSV_H__
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define CSV_MAJOR 3
+#define CSV_MAJOR 4
 #define CSV_MINOR 0
-#define CSV_RELEASE 3
+#define CSV_RELEASE 0
 
 /* Error Codes */
 #define CSV_SUCCESS 0
@@ -36,6 +37,8 @@ extern "C" {
 #define CSV_ENOMEM 2   /* Out of memory while increasing buffer size */
 #define CSV_ETOOBIG 3  /* Buffer larger than SIZE_MAX needed */
 #define CSV_EINVALID 4 /* Invalid code,should never be received from csv_error*/
+#define CSV_EREAD 5    /* Error opening or reading input, errno tells why */
+#define CSV_EWRITE 6   /* Error writing output, errno tells why */
 
 
 /* parser options */
@@ -47,8 +50,64 @@ extern "C" {
 #define CSV_APPEND_NULL 8 /* Ensure that all fields are null-terminated */
 #define CSV_EMPTY_IS_NULL 16 /* Pass null pointer to cb1 function when
                                 empty, unquoted fields are encountered */
+#define CSV_ZERO_COPY 32 /* Pass cb1 a pointer into the input buffer for
+                            fields that don't need to be copied */
+#define CSV_DFA 64 /* Use the table-driven parser core */
 
 
+/* writer options */
+#define CSV_QUOTE_ALL 1  /* quote every non-null field, not only those that
+                            need it */
+#define CSV_WRITE_CRLF 2 /* end records with CR LF instead of LF */
+
+/* writer outputs */
+#define CSV_OUT_FILE 0  /* stdio stream */
+#define CSV_OUT_FD   1  /* file descriptor */
+#define CSV_OUT_MEM  2  /* growable memory buffer */
+
+/* Buffer growth policies */
+#define CSV_GROW_LINEAR    0 /* grow the entry buffer by blk_size bytes */
+#define CSV_GROW_GEOMETRIC 1 /* double the entry buffer, adding at least
+                                blk_size and at most the growth cap */
+
+/* Statistics options */
+#define CSV_STATS_COUNT  1 /* count what the parser reads and delivers */
+#define CSV_STATS_TIMING 2 /* also time the callbacks, implies CSV_STATS_COUNT */
+
+/* Compression of the input of a reader */
+#define CSV_COMPRESS_NONE 0 /* plain input */
+#define CSV_COMPRESS_AUTO 1 /* gzip, zstd or plain, told apart by the first
+                               bytes of the input */
+#define CSV_COMPRESS_GZIP 2 /* gzip or zlib streams, needs zlib */
+#define CSV_COMPRESS_ZSTD 3 /* zstd frames, needs libzstd */
+
+/* Cache loading options */
+#define CSV_CACHE_VERIFY 1 /* compare the contents of the source with the
+                              cache even if its time is unchanged */
+
+/* Column types of a schema */
+#define CSV_TYPE_SKIP      0 /* fields of the column are not delivered */
+#define CSV_TYPE_STRING    1 /* bytes of the field as they are */
+#define CSV_TYPE_INT64     2 /* decimal integer with an optional sign */
+#define CSV_TYPE_DOUBLE    3 /* decimal number with an optional exponent,
+                                inf or nan */
+#define CSV_TYPE_BOOL      4 /* true/false, yes/no, t/f, y/n or 1/0 */
+#define CSV_TYPE_DATE      5 /* YYYY-MM-DD, as days since 1970-01-01 */
+#define CSV_TYPE_TIMESTAMP 6 /* YYYY-MM-DD[Thh:mm[:ss[.ffffff]]][Z|+hh:mm],
+                                as microseconds since 1970-01-01 UTC */
+
+/* Status of a decoded value */
+#define CSV_VALUE_OK      0
+#define CSV_VALUE_NULL    1 /* empty field, or missing from a short row */
+#define CSV_VALUE_INVALID 2 /* not a value of the column's type */
+
+/* Events returned by csv_next */
+#define CSV_EVENT_ERROR      (-1) /* parsing failed, csv_error tells why */
+#define CSV_EVENT_NEED_INPUT 0    /* the input is used up, csv_feed more */
+#define CSV_EVENT_FIELD      1    /* a field was read */
+#define CSV_EVENT_ROW        2    /* a row ended */
+#define CSV_EVENT_END        3    /* the end of the input was reached */
+
 /* Character values */
 #define CSV_TAB    0x09
 #define CSV_SPACE  0x20
@@ -57,6 +116,46 @@ extern "C" {
 #define CSV_COMMA  0x2c
 #define CSV_QUOTE  0x22
 
+struct csv_allocator {
+  void *(*realloc_func)(void *, void *, size_t);  /* called with ctx, pointer, size */
+  void (*free_func)(void *, void *);              /* called with ctx, pointer */
+  void *ctx;                                      /* passed to both functions */
+};
+
+/* Bump allocator over a caller-provided block of memory */
+struct csv_arena {
+  unsigned char *mem; /* Start of the arena */
+  size_t size;        /* Size of the arena */
+  size_t used;        /* Number of bytes handed out, including headers */
+  size_t last;        /* Offset of the most recent allocation, or size if none */
+};
+
+/* Byte classes of the parser's dialect, maintained by the library */
+struct csv_classes {
+  unsigned char cls[256];   /* Class of every byte value */
+  unsigned char stops[6];   /* Bytes that end a run of an unquoted field */
+  int nstops;               /* Number of stops, -1 if there are too many */
+  unsigned char delim_char; /* Dialect the classes were built for */
+  unsigned char quote_char;
+  int (*is_space)(unsigned char);
+  int (*is_term)(unsigned char);
+};
+
+/* Counters kept by a parser with statistics enabled, see csv_get_stats */
+struct csv_stats {
+  size_t bytes;            /* Bytes of input processed */
+  size_t rows;             /* Rows delivered */
+  size_t fields;           /* Fields delivered */
+  size_t quoted_fields;    /* Fields that were quoted */
+  size_t doubled_quotes;   /* Quotes written doubled inside quoted fields */
+  size_t max_field;        /* Length of the longest field */
+  size_t reallocs;         /* Number of times the entry buffer grew */
+  size_t buffer_size;      /* Current size of the entry buffer */
+  size_t peak_buffer_size; /* Largest size of the entry buffer */
+  size_t strict_errors;    /* Malformed data found in strict mode */
+  double callback_seconds; /* Time spent in callbacks, with CSV_STATS_TIMING */
+};
+
 struct csv_parser {
   int pstate;         /* Parser state */
   int quoted;         /* Is the current field a quoted field? */
@@ -74,6 +173,126 @@ struct csv_parser {
   void *(*malloc_func)(size_t);           /* not used */
   void *(*realloc_func)(void *, size_t);  /* function used to allocate buffer memory */
   void (*free_func)(void *);              /* function used to free buffer memory */
+  struct csv_allocator allocator;  /* used instead of realloc_func/free_func when set */
+  int grow_policy;    /* CSV_GROW_LINEAR or CSV_GROW_GEOMETRIC */
+  size_t grow_cap;    /* Largest single increase for CSV_GROW_GEOMETRIC, 0 for no limit */
+  size_t shrink_size; /* csv_fini shrinks larger buffers to this size, 0 to keep them */
+  struct csv_classes classes;  /* Lookup table for the delimiter, quote, space and term characters */
+  unsigned char *columns;  /* Bit set of the columns delivered, NULL for all */
+  size_t columns_size;     /* Columns from this one on are never delivered */
+  size_t column;           /* Column of the current field */
+  int skip_rest;           /* The rest of the current row is skipped, see csv_skip_rows */
+  struct csv_stats *stats; /* Statistics, NULL unless enabled with csv_set_stats */
+  int stats_options;       /* CSV_STATS_COUNT and CSV_STATS_TIMING */
+  const unsigned char *next_input;  /* Input of csv_next, see csv_feed */
+  size_t next_len;         /* Size of next_input */
+  size_t next_pos;         /* Bytes of next_input parsed so far */
+  int next_end;            /* 1 once csv_feed marked the end, 2 once it was reached */
+  int next_row;            /* The field returned last also ended a row */
+  int next_c;              /* Terminator of that row */
+};
+
+/* Rows parsed by csv_parse_batch, stored by column */
+struct csv_batch {
+  size_t max_rows;        /* Number of rows the batch can hold */
+  size_t max_cols;        /* Number of columns kept for each row */
+  size_t rows;            /* Number of complete rows in the batch */
+  unsigned char *values;  /* Data of all fields, stored back to back */
+  size_t values_used;     /* Bytes of values in use */
+  size_t values_size;     /* Bytes allocated for values */
+  size_t *offsets;        /* Offset in values of column c of row r, at [c * max_rows + r] */
+  size_t *lengths;        /* Length of column c of row r, at [c * max_rows + r] */
+  unsigned char *nulls;   /* Non-zero at [c * max_rows + r] for missing and null fields */
+  size_t *ncols;          /* Number of fields in each row */
+  size_t col;             /* Column of the next field in the current row */
+};
+
+/* The typed API needs long long, which C89 doesn't have */
+#ifdef LLONG_MAX
+/* A field decoded by csv_parse_typed */
+struct csv_value {
+  size_t col;         /* Column of the field */
+  int type;           /* Type of the column */
+  int status;         /* CSV_VALUE_OK, CSV_VALUE_NULL or CSV_VALUE_INVALID */
+  const char *str;    /* Bytes of the field, not null-terminated */
+  size_t len;         /* Number of bytes at str */
+  union {
+    long long i;      /* CSV_TYPE_INT64, CSV_TYPE_DATE and CSV_TYPE_TIMESTAMP */
+    double d;         /* CSV_TYPE_DOUBLE */
+    int b;            /* CSV_TYPE_BOOL, 0 or 1 */
+  } v;
+};
+
+/* Type of a column of a schema and the handler its fields are passed to */
+struct csv_column {
+  int type;
+  void (*handler)(const struct csv_value *, void *);
+};
+
+/* Columns decoded by csv_parse_typed */
+struct csv_schema {
+  struct csv_column *columns; /* Column c at [c] */
+  size_t ncols;               /* Number of columns declared, the others are skipped */
+  size_t size;                /* Number of columns allocated */
+  unsigned char *selected;    /* Bit set of the columns that are not skipped */
+  size_t selected_size;       /* Columns from this one on are all skipped */
+  void (*row)(int, void *);   /* Called at the end of every row, may be NULL */
+  void *data;                 /* Passed to the handlers and row */
+};
+#endif
+
+/* Offsets at which rows of the input start, see csv_index_parse */
+struct csv_index {
+  size_t step;        /* The start of every step-th row is recorded */
+  size_t rows;        /* Number of rows indexed */
+  size_t bytes;       /* Number of bytes of input indexed */
+  size_t *offsets;    /* Offset of row i * step at [i] */
+  size_t count;       /* Number of offsets recorded */
+  size_t size;        /* Number of offsets allocated */
+};
+
+/* Fields of a CSV file read back from its cache, see csv_cache_open */
+struct csv_cache {
+  size_t rows;                /* Number of rows */
+  size_t cols;                /* Number of columns, the fields of the longest row */
+  const unsigned char *data;  /* Contents of the cache file */
+  size_t size;                /* Size of data */
+  int mapped;                 /* data is mapped rather than allocated */
+};
+
+/* Reads a file ahead of the parser in a background thread, see csv_reader_init */
+struct csv_reader {
+  int fd;                 /* Descriptor read from */
+  int close_fd;           /* fd is closed by csv_reader_free */
+  size_t buf_size;        /* Size of each buffer */
+  size_t nbufs;           /* Number of buffers in the ring */
+  unsigned char *mem;     /* Memory of the buffers */
+  unsigned char *base;    /* First buffer, page aligned */
+  size_t *lens;           /* Bytes read into each buffer */
+  size_t filled;          /* Buffers filled so far */
+  size_t taken;           /* Buffers passed to the caller so far */
+  size_t released;        /* Buffers given back by the caller so far */
+  int eof;                /* Nothing more will be read */
+  int status;             /* CSV_EREAD if reading failed */
+  int error;              /* errno of the failed read */
+  struct csv_decompressor *decomp;  /* Decompression stage, NULL for plain input */
+  struct csv_reader_sync *sync;  /* Read-ahead thread, NULL if there is none */
+};
+
+/* Writes fields and records to a buffered output */
+struct csv_writer {
+  int out;                /* CSV_OUT_FILE, CSV_OUT_FD or CSV_OUT_MEM */
+  FILE *fp;               /* Stream written to for CSV_OUT_FILE */
+  int fd;                 /* Descriptor written to for CSV_OUT_FD */
+  unsigned char *buf;     /* Output buffer, all of the output for CSV_OUT_MEM */
+  size_t used;            /* Bytes of buf in use */
+  size_t size;            /* Bytes allocated for buf */
+  size_t fields;          /* Number of fields written in the current record */
+  int blank;              /* Nothing has been written for the current record */
+  int status;             /* Operation status */
+  unsigned char options;
+  unsigned char quote_char;
+  unsigned char delim_char;
 };
 
 /* Function Prototypes */
@@ -99,6 +318,76 @@ void csv_set_realloc_func(struct csv_parser *p, void *(*)(void *, size_t));
 void csv_set_free_func(struct csv_parser *p, void (*)(void *));
 void csv_set_blk_size(struct csv_parser *p, size_t);
 size_t csv_get_buffer_size(const struct csv_parser *p);
+void csv_set_allocator(struct csv_parser *p, const struct csv_allocator *a);
+void csv_set_growth(struct csv_parser *p, int policy, size_t cap);
+void csv_set_shrink_size(struct csv_parser *p, size_t size);
+int csv_set_columns(struct csv_parser *p, const size_t *cols, size_t n);
+int csv_set_stats(struct csv_parser *p, int options);
+int csv_get_stats(const struct csv_parser *p, struct csv_stats *st);
+void csv_reset_stats(struct csv_parser *p);
+void csv_arena_init(struct csv_arena *a, void *mem, size_t size);
+void csv_arena_reset(struct csv_arena *a);
+void *csv_arena_realloc(void *arena, void *ptr, size_t size);
+void csv_arena_free(void *arena, void *ptr);
+int csv_batch_init(struct csv_batch *b, size_t max_rows, size_t max_cols);
+void csv_batch_clear(struct csv_batch *b);
+void csv_batch_free(struct csv_batch *b);
+size_t csv_parse_batch(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b);
+int csv_fini_batch(struct csv_parser *p, struct csv_batch *b);
+int csv_feed(struct csv_parser *p, const void *s, size_t len);
+int csv_next(struct csv_parser *p, const void **field, size_t *len, int *c);
+size_t csv_next_offset(const struct csv_parser *p);
+#ifdef LLONG_MAX
+int csv_schema_init(struct csv_schema *sc, void (*row)(int, void *), void *data);
+int csv_schema_set(struct csv_schema *sc, size_t col, int type, void (*handler)(const struct csv_value *, void *));
+void csv_schema_free(struct csv_schema *sc);
+size_t csv_parse_typed(struct csv_parser *p, const void *s, size_t len, const struct csv_schema *sc);
+int csv_fini_typed(struct csv_parser *p, const struct csv_schema *sc);
+#endif
+size_t csv_parse_parallel(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int, void *), void *data, unsigned int nthreads);
+size_t csv_parse_fd(struct csv_parser *p, int fd, void (*cb1)(void *, size_t, void *), void (*cb2)(int, void *), void *data);
+size_t csv_parse_file(struct csv_parser *p, const char *filename, void (*cb1)(void *, size_t, void *), void (*cb2)(int, void *), void *data);
+size_t csv_skip_rows(struct csv_parser *p, const void *s, size_t len, size_t *n);
+size_t csv_validate(struct csv_parser *p, const void *s, size_t len);
+size_t csv_validate_fd(struct csv_parser *p, int fd);
+size_t csv_validate_file(struct csv_parser *p, const char *filename);
+size_t csv_count(struct csv_parser *p, const void *s, size_t len, size_t *rows, size_t *fields);
+int csv_count_fini(struct csv_parser *p, size_t *rows, size_t *fields);
+int csv_reader_init(struct csv_reader *r, int fd, size_t buf_size, size_t nbufs);
+int csv_reader_open(struct csv_reader *r, const char *filename, size_t buf_size, size_t nbufs);
+int csv_reader_init_compressed(struct csv_reader *r, int fd, int format, size_t buf_size, size_t nbufs);
+int csv_reader_open_compressed(struct csv_reader *r, const char *filename, int format, size_t buf_size, size_t nbufs);
+const void *csv_reader_next(struct csv_reader *r, size_t *len);
+int csv_reader_error(const struct csv_reader *r);
+size_t csv_reader_parse(struct csv_parser *p, struct csv_reader *r, void (*cb1)(void *, size_t, void *), void (*cb2)(int, void *), void *data);
+void csv_reader_free(struct csv_reader *r);
+int csv_index_init(struct csv_index *x, size_t step);
+size_t csv_index_parse(struct csv_parser *p, const void *s, size_t len, struct csv_index *x);
+size_t csv_index_fd(struct csv_parser *p, int fd, struct csv_index *x);
+int csv_index_fini(struct csv_parser *p, struct csv_index *x);
+int csv_index_lookup(const struct csv_index *x, size_t row, size_t *offset, size_t *skip);
+int csv_seek_row(struct csv_parser *p, int fd, const struct csv_index *x, size_t row);
+int csv_index_save(const struct csv_index *x, const char *filename);
+int csv_index_load(struct csv_index *x, const char *filename);
+void csv_index_free(struct csv_index *x);
+int csv_cache_build(struct csv_parser *p, const char *source, const char *cache);
+int csv_cache_load(struct csv_cache *c, const struct csv_parser *p, const char *source, const char *cache, int options);
+int csv_cache_open(struct csv_cache *c, struct csv_parser *p, const char *source, const char *cache, int options);
+const void *csv_cache_field(const struct csv_cache *c, size_t row, size_t col, size_t *len);
+void csv_cache_free(struct csv_cache *c);
+int csv_writer_init(struct csv_writer *w, unsigned char options);
+int csv_writer_init_fp(struct csv_writer *w, FILE *fp, unsigned char options);
+int csv_writer_init_fd(struct csv_writer *w, int fd, unsigned char options);
+void csv_writer_set_delim(struct csv_writer *w, unsigned char c);
+void csv_writer_set_quote(struct csv_writer *w, unsigned char c);
+int csv_writer_field(struct csv_writer *w, const void *s, size_t len);
+int csv_writer_end_row(struct csv_writer *w);
+int csv_writer_rows(struct csv_writer *w, const void *const *fields, const size_t *lens, size_t rows, size_t cols,
+                    unsigned int nthreads);
+int csv_writer_flush(struct csv_writer *w);
+int csv_writer_error(const struct csv_writer *w);
+const void *csv_writer_data(const struct csv_writer *w, size_t *len);
+void csv_writer_free(struct csv_writer *w);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,696 @@
+/*
+libcsv - parse and write csv data
+Copyright (C) 2008-2021  Robert Gamble
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Header-only C++ parser whose dialect and options are template arguments,
+   see basic_csv_parser, and with C++17 a range of the rows of a file, see
+   basic_reader.  It needs only the constants of csv.h, not the library. */
+
+#ifndef LIBCSV_HPP__
+#define LIBCSV_HPP__
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include "csv.h"
+
+#if __cplusplus >= 201703L
+#  include <cstdio>
+#  include <functional>
+#  include <iterator>
+#  include <string>
+#  include <string_view>
+#  include <vector>
+/* Files are mapped into memory where the POSIX calls are known to exist */
+#  if defined(__unix__) || defined(__APPLE__)
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#    define CSVPP_HAVE_MMAP 1
+#  endif
+#endif
+
+namespace csv {
+
+/* Parses like csv_parse with a parser set up by csv_init(p, Options),
+ * csv_set_delim(p, Delim) and csv_set_quote(p, Quote), and the default
+ * space and terminator characters.  The field and row handlers are any
+ * callables taking (void *, std::size_t) and (int), called where csv_parse
+ * would call cb1 and cb2.  Being template arguments, they are inlined and
+ * the tests of the options and dialect are resolved at compile time.
+ * CSV_DFA is accepted and has no effect.
+ */
+template <unsigned char Delim = CSV_COMMA, unsigned char Quote = CSV_QUOTE, unsigned char Options = 0>
+class basic_csv_parser {
+public:
+  basic_csv_parser()
+    : pstate_(row_not_begun), quoted_(0), spaces_(0), entry_buf_(NULL), entry_pos_(0), entry_size_(0),
+      status_(CSV_SUCCESS) {}
+
+  ~basic_csv_parser() { std::free(entry_buf_); }
+
+  /* Parse len bytes at s, returns the number of bytes processed, see csv_parse */
+  template <class FieldHandler, class RowHandler>
+  std::size_t parse(const void *s, std::size_t len, FieldHandler &&field, RowHandler &&row);
+
+  /* Deliver the last field and row if the data did not end with a
+     terminator and reset the parser, see csv_fini */
+  template <class FieldHandler, class RowHandler>
+  int fini(FieldHandler &&field, RowHandler &&row);
+
+  int error() const { return status_; }
+  std::size_t buffer_size() const { return entry_size_; }
+
+private:
+  enum { row_not_begun, field_not_begun, field_begun, field_might_have_ended };
+  enum { cl_delim = 1, cl_quote = 2, cl_space = 4, cl_term = 8 };
+
+  static const bool strict = (Options & CSV_STRICT) != 0;
+  static const bool strict_fini = (Options & CSV_STRICT_FINI) != 0;
+  static const bool repall_nl = (Options & CSV_REPALL_NL) != 0;
+  static const bool append_null = (Options & CSV_APPEND_NULL) != 0;
+  static const bool empty_is_null = (Options & CSV_EMPTY_IS_NULL) != 0;
+  static const bool zero_copy = (Options & CSV_ZERO_COPY) != 0 && !append_null;
+
+  /* Class of byte c, a handful of comparisons with constants */
+  static unsigned classify(unsigned char c)
+  {
+    return (c == Delim ? cl_delim : 0) | (c == Quote ? cl_quote : 0) |
+           (c == CSV_SPACE || c == CSV_TAB ? cl_space : 0) | (c == CSV_CR || c == CSV_LF ? cl_term : 0);
+  }
+
+  /* Double the entry buffer until it holds need bytes, 0 on success */
+  int grow(std::size_t need)
+  {
+    std::size_t size = entry_size_ ? entry_size_ : 64;
+    void *vp;
+
+    do {
+      if (size > (std::size_t)-1 / 2) {
+        status_ = CSV_ETOOBIG;
+        return -1;
+      }
+      size *= 2;
+    } while (size < need);
+    if ((vp = std::realloc(entry_buf_, size)) == NULL) {
+      status_ = CSV_ENOMEM;
+      return -1;
+    }
+    entry_buf_ = static_cast<unsigned char *>(vp);
+    entry_size_ = size;
+    return 0;
+  }
+
+  basic_csv_parser(const basic_csv_parser &) = delete;
+  basic_csv_parser &operator=(const basic_csv_parser &) = delete;
+
+  int pstate_;
+  int quoted_;
+  std::size_t spaces_;
+  unsigned char *entry_buf_;
+  std::size_t entry_pos_;
+  std::size_t entry_size_;
+  int status_;
+};
+
+template <unsigned char Delim, unsigned char Quote, unsigned char Options>
+template <class FieldHandler, class RowHandler>
+std::size_t
+basic_csv_parser<Delim, Quote, Options>::parse(const void *s, std::size_t len, FieldHandler &&field, RowHandler &&row)
+{
+  /* The state machine of csv_parse, see libcsv.c for the states */
+  const unsigned char *us = static_cast<const unsigned char *>(s);
+  const std::size_t reserve = append_null ? 1 : 0;  /* Room kept for the null byte */
+  const unsigned stop = cl_delim | cl_space | cl_term | (strict ? cl_quote : 0);
+  std::size_t pos = 0, run, end;
+  unsigned char c;
+  unsigned cl;
+  int quoted = quoted_;
+  int pstate = pstate_;
+  std::size_t spaces = spaces_;
+  std::size_t entry_pos = entry_pos_;
+
+  /* With CSV_ZERO_COPY, zc_start points to the current field in s while it
+     does not need to be copied */
+  const unsigned char *zc_start = NULL;
+  std::size_t zc_pos = 0;       /* Offset of the byte that began the field */
+  int zc_state = row_not_begun; /* State before the field began */
+
+#define CSVPP_SAVE() \
+  (quoted_ = quoted, pstate_ = pstate, spaces_ = spaces, entry_pos_ = entry_pos)
+
+  /* Copy a zero-copy field in progress into the entry buffer, if that fails
+     the parser is rewound to the start of the field */
+#define CSVPP_ZC_SAVE() \
+  do { \
+    if (zero_copy && zc_start) { \
+      if (entry_size_ < entry_pos + 1 && grow(entry_pos + 1) != 0) { \
+        quoted_ = 0, pstate_ = zc_state, spaces_ = 0, entry_pos_ = 0; \
+        return zc_pos; \
+      } \
+      std::memcpy(entry_buf_, zc_start, entry_pos); \
+    } \
+  } while (0)
+
+#define CSVPP_SUBMIT_FIELD() \
+  do { \
+    if (!quoted) \
+      entry_pos -= spaces; \
+    if (append_null) \
+      entry_buf_[entry_pos] = '\0'; \
+    if (empty_is_null && !quoted && entry_pos == 0) \
+      field(static_cast<void *>(NULL), entry_pos); \
+    else \
+      field(zc_start ? const_cast<unsigned char *>(zc_start) : entry_buf_, entry_pos); \
+    pstate = field_not_begun; \
+    entry_pos = quoted = spaces = 0; \
+    zc_start = NULL; \
+  } while (0)
+
+#define CSVPP_SUBMIT_ROW(c) \
+  do { \
+    row(c); \
+    pstate = row_not_begun; \
+    entry_pos = quoted = spaces = 0; \
+  } while (0)
+
+#define CSVPP_SUBMIT_CHAR(c) (zc_start ? (void)entry_pos++ : (void)(entry_buf_[entry_pos++] = (c)))
+
+#define CSVPP_BEGIN_FIELD(start) \
+  do { \
+    if (zero_copy) { \
+      zc_start = us + (start); \
+      zc_pos = pos - 1; \
+      zc_state = pstate; \
+    } \
+    pstate = field_begun; \
+  } while (0)
+
+#define CSVPP_STRICT_ERROR() \
+  do { \
+    status_ = CSV_EPARSE; \
+    CSVPP_ZC_SAVE(); \
+    CSVPP_SAVE(); \
+    return pos - 1; \
+  } while (0)
+
+  if (s == NULL)
+    return 0;
+
+  if (!entry_buf_ && len && grow(1) != 0)
+    return 0;
+
+  while (pos < len) {
+    if (pstate == field_begun) {
+      /* Add a run of ordinary field bytes in one step */
+      end = len - pos;
+      if (!zc_start && entry_size_ - reserve - entry_pos < end)
+        end = entry_size_ - reserve - entry_pos;
+      if (quoted) {
+        const void *q = std::memchr(us + pos, Quote, end);
+        run = q ? static_cast<std::size_t>(static_cast<const unsigned char *>(q) - (us + pos)) : end;
+      } else {
+        for (run = 0; run < end && !(classify(us[pos + run]) & stop); run++)
+          ;
+      }
+      if (run) {
+        if (!zc_start)
+          std::memcpy(entry_buf_ + entry_pos, us + pos, run);
+        entry_pos += run;
+        pos += run;
+        spaces = 0;
+        continue;
+      }
+    }
+
+    if (!zc_start && entry_pos == entry_size_ - reserve && grow(entry_size_ + 1) != 0) {
+      CSVPP_SAVE();
+      return pos;
+    }
+
+    c = us[pos++];
+    cl = classify(c);
+
+    switch (pstate) {
+      case row_not_begun:
+      case field_not_begun:
+        if ((cl & cl_space) && !(cl & cl_delim)) {
+          continue;
+        } else if (cl & cl_term) {
+          if (pstate == field_not_begun) {
+            CSVPP_SUBMIT_FIELD();
+            CSVPP_SUBMIT_ROW(c);
+          } else if (repall_nl) {
+            CSVPP_SUBMIT_ROW(c);
+          }
+          continue;
+        } else if (cl & cl_delim) {
+          CSVPP_SUBMIT_FIELD();
+          break;
+        } else if (cl & cl_quote) {
+          CSVPP_BEGIN_FIELD(pos);
+          quoted = 1;
+        } else {
+          CSVPP_BEGIN_FIELD(pos - 1);
+          quoted = 0;
+          CSVPP_SUBMIT_CHAR(c);
+        }
+        break;
+      case field_begun:
+        if (cl & cl_quote) {
+          if (quoted) {
+            CSVPP_SUBMIT_CHAR(c);
+            pstate = field_might_have_ended;
+          } else {
+            if (strict)
+              CSVPP_STRICT_ERROR();
+            CSVPP_SUBMIT_CHAR(c);
+            spaces = 0;
+          }
+        } else if (cl & cl_delim) {
+          if (quoted)
+            CSVPP_SUBMIT_CHAR(c);
+          else
+            CSVPP_SUBMIT_FIELD();
+        } else if (cl & cl_term) {
+          if (!quoted) {
+            CSVPP_SUBMIT_FIELD();
+            CSVPP_SUBMIT_ROW(c);
+          } else {
+            CSVPP_SUBMIT_CHAR(c);
+          }
+        } else if (!quoted && (cl & cl_space)) {
+          CSVPP_SUBMIT_CHAR(c);
+          spaces++;
+        } else {
+          CSVPP_SUBMIT_CHAR(c);
+          spaces = 0;
+        }
+        break;
+      case field_might_have_ended:
+        if (cl & cl_delim) {
+          entry_pos -= spaces + 1;  /* Get rid of spaces and the closing quote */
+          CSVPP_SUBMIT_FIELD();
+        } else if (cl & cl_term) {
+          entry_pos -= spaces + 1;
+          CSVPP_SUBMIT_FIELD();
+          CSVPP_SUBMIT_ROW(c);
+        } else if (cl & cl_space) {
+          CSVPP_SUBMIT_CHAR(c);
+          spaces++;
+        } else if (cl & cl_quote) {
+          if (spaces) {
+            if (strict)
+              CSVPP_STRICT_ERROR();
+            spaces = 0;
+            CSVPP_SUBMIT_CHAR(c);
+          } else {
+            /* Two quotes in a row, the field no longer matches the input */
+            if (zc_start) {
+              CSVPP_ZC_SAVE();
+              zc_start = NULL;
+            }
+            pstate = field_begun;
+          }
+        } else {
+          if (strict)
+            CSVPP_STRICT_ERROR();
+          pstate = field_begun;
+          spaces = 0;
+          CSVPP_SUBMIT_CHAR(c);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  CSVPP_ZC_SAVE();
+  CSVPP_SAVE();
+  return pos;
+
+#undef CSVPP_SAVE
+#undef CSVPP_ZC_SAVE
+#undef CSVPP_SUBMIT_FIELD
+#undef CSVPP_SUBMIT_ROW
+#undef CSVPP_SUBMIT_CHAR
+#undef CSVPP_BEGIN_FIELD
+#undef CSVPP_STRICT_ERROR
+}
+
+template <unsigned char Delim, unsigned char Quote, unsigned char Options>
+template <class FieldHandler, class RowHandler>
+int
+basic_csv_parser<Delim, Quote, Options>::fini(FieldHandler &&field, RowHandler &&row)
+{
+  if (pstate_ == field_begun && quoted_ && strict && strict_fini) {
+    /* The quoted field was not closed */
+    status_ = CSV_EPARSE;
+    return -1;
+  }
+
+  switch (pstate_) {
+    case field_might_have_ended:
+      entry_pos_ -= spaces_ + 1;  /* Get rid of spaces and the closing quote */
+      /* fall through */
+    case field_not_begun:
+    case field_begun:
+      if (!quoted_)
+        entry_pos_ -= spaces_;
+      if (append_null)
+        entry_buf_[entry_pos_] = '\0';
+      if (empty_is_null && !quoted_ && entry_pos_ == 0)
+        field(static_cast<void *>(NULL), entry_pos_);
+      else
+        field(static_cast<void *>(entry_buf_), entry_pos_);
+      row(-1);
+      break;
+    default:
+      break;
+  }
+
+  pstate_ = row_not_begun;
+  spaces_ = entry_pos_ = 0;
+  quoted_ = status_ = 0;
+  return 0;
+}
+
+/* Parser of the default dialect, comma separated with double quotes */
+typedef basic_csv_parser<> parser;
+
+#if __cplusplus >= 201703L
+/* Range of the rows of a file or of data in memory, parsed a chunk at a
+ * time with basic_csv_parser:
+ *
+ *   for (auto &row : csv::reader("data.csv"))
+ *     use(row[3]);
+ *
+ * A file is named by a const char * or std::string, data in memory is
+ * passed as a std::string_view.  Each row is a sequence of std::string_view
+ * fields that stay valid until the iterator is incremented.  Fields point
+ * straight into data in memory and into files that can be mapped, the
+ * others are copied into storage that is reused from chunk to chunk, so no
+ * memory is allocated per row once the buffers are large enough.  Rows end
+ * at parse errors, which error() reports; empty fields are empty views
+ * whatever the options.
+ */
+template <unsigned char Delim = CSV_COMMA, unsigned char Quote = CSV_QUOTE, unsigned char Options = 0>
+class basic_reader {
+public:
+  class row;
+  class iterator;
+
+  static const std::size_t default_chunk_size = 1 << 16;
+
+  /* Read the file named filename, mapped into memory where possible */
+  explicit basic_reader(const char *filename, std::size_t chunk_size = default_chunk_size)
+    : basic_reader(chunk_size)
+  {
+#ifdef CSVPP_HAVE_MMAP
+    struct stat st;
+    int fd = ::open(filename, O_RDONLY);
+
+    if (fd >= 0 && ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *m = ::mmap(NULL, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m != MAP_FAILED) {
+        map_ = m;
+        mem_ = static_cast<const char *>(m);
+        mem_len_ = static_cast<std::size_t>(st.st_size);
+      }
+    }
+    if (fd >= 0)
+      ::close(fd);
+    if (mem_)
+      return;
+#endif
+    if ((fp_ = std::fopen(filename, "rb")) == NULL)
+      error_ = CSV_EREAD;
+    close_fp_ = true;
+  }
+
+  /* Read fp from its current position, it is left open */
+  explicit basic_reader(std::FILE *fp, std::size_t chunk_size = default_chunk_size) : basic_reader(chunk_size)
+  {
+    fp_ = fp;
+  }
+
+  explicit basic_reader(const std::string &filename, std::size_t chunk_size = default_chunk_size)
+    : basic_reader(filename.c_str(), chunk_size) {}
+
+  /* Parse data in memory, which must outlive the rows */
+  explicit basic_reader(std::string_view data, std::size_t chunk_size = default_chunk_size)
+    : basic_reader(chunk_size)
+  {
+    mem_ = data.data();
+    mem_len_ = data.size();
+  }
+
+  ~basic_reader()
+  {
+#ifdef CSVPP_HAVE_MMAP
+    if (map_)
+      ::munmap(map_, mem_len_);
+#endif
+    if (fp_ && close_fp_)
+      std::fclose(fp_);
+  }
+
+  basic_reader(const basic_reader &) = delete;
+  basic_reader &operator=(const basic_reader &) = delete;
+
+  /* CSV_EREAD if the input could not be opened or read, otherwise the error
+     of the parser */
+  int error() const { return error_; }
+
+  iterator begin() { return iterator(current() ? this : NULL); }
+  iterator end() { return iterator(NULL); }
+
+  /* Fields of a row, see basic_reader */
+  class row {
+  public:
+    class iterator;
+
+    std::size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+
+    std::string_view operator[](std::size_t i) const
+    {
+      const slot &s = reader_->slots_[first_ + i];
+      return std::string_view(s.ptr ? s.ptr : reader_->store_.data() + s.off, s.len);
+    }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, count_); }
+
+    class iterator {
+    public:
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef std::string_view value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const std::string_view *pointer;
+      typedef std::string_view reference;
+
+      iterator(const row *r, std::size_t i) : row_(r), i_(i) {}
+      std::string_view operator*() const { return (*row_)[i_]; }
+      std::string_view operator[](difference_type n) const { return (*row_)[i_ + n]; }
+      iterator &operator++() { ++i_; return *this; }
+      iterator operator++(int) { iterator t = *this; ++i_; return t; }
+      iterator &operator--() { --i_; return *this; }
+      iterator operator--(int) { iterator t = *this; --i_; return t; }
+      iterator &operator+=(difference_type n) { i_ += n; return *this; }
+      iterator &operator-=(difference_type n) { i_ -= n; return *this; }
+      iterator operator+(difference_type n) const { return iterator(row_, i_ + n); }
+      iterator operator-(difference_type n) const { return iterator(row_, i_ - n); }
+      difference_type operator-(const iterator &o) const { return difference_type(i_) - difference_type(o.i_); }
+      bool operator==(const iterator &o) const { return i_ == o.i_; }
+      bool operator!=(const iterator &o) const { return i_ != o.i_; }
+      bool operator<(const iterator &o) const { return i_ < o.i_; }
+      bool operator>(const iterator &o) const { return i_ > o.i_; }
+      bool operator<=(const iterator &o) const { return i_ <= o.i_; }
+      bool operator>=(const iterator &o) const { return i_ >= o.i_; }
+
+    private:
+      const row *row_;
+      std::size_t i_;
+    };
+
+  private:
+    friend class basic_reader;
+
+    const basic_reader *reader_;
+    std::size_t first_;
+    std::size_t count_;
+  };
+
+  /* Input iterator over the rows */
+  class iterator {
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef row value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const row *pointer;
+    typedef const row &reference;
+
+    const row &operator*() const { return reader_->row_; }
+    const row *operator->() const { return &reader_->row_; }
+
+    iterator &operator++()
+    {
+      reader_->next_++;
+      if (!reader_->current())
+        reader_ = NULL;
+      return *this;
+    }
+
+    bool operator==(const iterator &o) const { return reader_ == o.reader_; }
+    bool operator!=(const iterator &o) const { return reader_ != o.reader_; }
+
+  private:
+    friend class basic_reader;
+
+    explicit iterator(basic_reader *r) : reader_(r) {}
+
+    basic_reader *reader_;
+  };
+
+private:
+  /* A field, in the input at ptr or at offset off of store_ if ptr is NULL */
+  struct slot {
+    const char *ptr;
+    std::size_t off;
+    std::size_t len;
+  };
+
+  explicit basic_reader(std::size_t chunk_size)
+    : chunk_size_(chunk_size ? chunk_size : default_chunk_size), mem_(NULL), mem_len_(0), mem_pos_(0),
+      map_(NULL), fp_(NULL), close_fp_(false), in_(NULL), in_len_(0), next_(0), done_(false), error_(CSV_SUCCESS)
+  {
+    row_.reader_ = this;
+  }
+
+  /* Point row_ at the row next_, parsing more of the input if needed,
+     returns false at the end */
+  bool current()
+  {
+    while (next_ >= ends_.size())
+      if (!fill())
+        return false;
+    row_.first_ = next_ ? ends_[next_ - 1] : 0;
+    row_.count_ = ends_[next_] - row_.first_;
+    return true;
+  }
+
+  /* Parse the next chunk of the input once the rows of the last one were
+     used, returns false if there is nothing left */
+  bool fill()
+  {
+    std::size_t i, keep = 0, done_fields = ends_.empty() ? 0 : ends_.back();
+    std::size_t n, ret;
+
+    /* Keep the fields of the row in progress at the start of the storage,
+       copying those that point into a buffer about to be overwritten */
+    slots_.erase(slots_.begin(), slots_.begin() + done_fields);
+    for (i = 0; i < slots_.size(); i++) {
+      if (!slots_[i].ptr) {
+        std::memmove(&store_[keep], &store_[slots_[i].off], slots_[i].len);
+        slots_[i].off = keep;
+        keep += slots_[i].len;
+      }
+    }
+    store_.resize(keep);
+    for (i = 0; i < slots_.size(); i++) {
+      if (slots_[i].ptr && !mem_) {
+        slots_[i].off = store_.size();
+        store_.append(slots_[i].ptr, slots_[i].len);
+        slots_[i].ptr = NULL;
+      }
+    }
+    ends_.clear();
+    next_ = 0;
+
+    if (done_)
+      return false;
+
+    auto field = [this](void *s, std::size_t len) {
+      const char *p = static_cast<const char *>(s);
+      slot sl;
+      if (p && std::less_equal<const char *>()(in_, p) && std::less_equal<const char *>()(p + len, in_ + in_len_)) {
+        sl.ptr = p;
+        sl.off = 0;
+      } else {
+        sl.ptr = NULL;
+        sl.off = store_.size();
+        store_.append(p ? p : "", len);
+      }
+      sl.len = len;
+      slots_.push_back(sl);
+    };
+    auto row_end = [this](int) { ends_.push_back(slots_.size()); };
+
+    if (mem_) {
+      in_ = mem_ + mem_pos_;
+      n = mem_len_ - mem_pos_ < chunk_size_ ? mem_len_ - mem_pos_ : chunk_size_;
+      mem_pos_ += n;
+    } else if (fp_) {
+      buf_.resize(chunk_size_);
+      in_ = buf_.data();
+      n = std::fread(buf_.data(), 1, chunk_size_, fp_);
+      if (n < chunk_size_ && std::ferror(fp_))
+        error_ = CSV_EREAD;
+    } else {
+      n = 0;
+    }
+    in_len_ = n;
+
+    if (n && (ret = parser_.parse(in_, n, field, row_end)) < n) {
+      error_ = parser_.error();
+      done_ = true;
+    } else if (!n || error_) {
+      if (!error_ && parser_.fini(field, row_end) != 0)
+        error_ = parser_.error();
+      done_ = true;
+    }
+    return true;
+  }
+
+  basic_csv_parser<Delim, Quote, Options | CSV_ZERO_COPY> parser_;
+  std::size_t chunk_size_;      /* Bytes parsed at a time */
+  const char *mem_;             /* Input in memory or mapped, NULL for a stream */
+  std::size_t mem_len_;
+  std::size_t mem_pos_;         /* Bytes of mem_ parsed so far */
+  void *map_;                   /* Mapping of the file, unmapped at the end */
+  std::FILE *fp_;               /* Stream read into buf_ */
+  bool close_fp_;
+  std::vector<char> buf_;       /* Chunk read from fp_ */
+  const char *in_;              /* Chunk being parsed */
+  std::size_t in_len_;
+  std::vector<slot> slots_;     /* Fields of the rows of the chunk */
+  std::vector<std::size_t> ends_;  /* Index in slots_ of the end of each row */
+  std::string store_;           /* Fields that do not point into the input */
+  std::size_t next_;            /* Row of the chunk the iterator is at */
+  row row_;                     /* The row the iterator is at */
+  bool done_;                   /* The input was parsed to the end or an error */
+  int error_;
+};
+
+/* Reader of the default dialect */
+typedef basic_reader<> reader;
+#endif
+
+}  /* namespace csv */
+
+#endif
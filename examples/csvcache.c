@@ -0,0 +1,102 @@
+/*
+csvcache - parses CSV files once into a binary cache next to them, named
+           after the file with .cache appended, and reads them back from
+           the cache as long as they don't change; -p writes the cached
+           rows to standard output as CSV
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <csv.h>
+
+static int
+print_cache (const struct csv_cache *c)
+{
+  struct csv_writer w;
+  const void *f;
+  size_t row, col, len;
+
+  if (csv_writer_init_fp(&w, stdout, 0) != 0)
+    return -1;
+  for (row = 0; row < c->rows; row++) {
+    /* Missing fields are written as null ones, every row has all columns */
+    for (col = 0; col < c->cols; col++) {
+      f = csv_cache_field(c, row, col, &len);
+      csv_writer_field(&w, f, len);
+    }
+    csv_writer_end_row(&w);
+  }
+  if (csv_writer_flush(&w) != 0) {
+    csv_writer_free(&w);
+    return -1;
+  }
+  csv_writer_free(&w);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct csv_parser p;
+  struct csv_cache c;
+  int i, built, print = 0, force = 0, options = 0, status = EXIT_SUCCESS;
+  char *cache;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: csvcache [-s] [-f] [-v] [-p] files\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (csv_init(&p, CSV_EMPTY_IS_NULL) != 0) {
+    fprintf(stderr, "Failed to initialize csv parser\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      csv_set_opts(&p, CSV_EMPTY_IS_NULL | CSV_STRICT | CSV_STRICT_FINI);
+      continue;
+    } else if (strcmp(argv[i], "-f") == 0) {
+      force = 1;
+      continue;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      options = CSV_CACHE_VERIFY;
+      continue;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      print = 1;
+      continue;
+    }
+
+    if ((cache = malloc(strlen(argv[i]) + sizeof ".cache")) == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(cache, "%s.cache", argv[i]);
+
+    built = force || csv_cache_load(&c, &p, argv[i], cache, options) != 0;
+    if (built && (csv_cache_build(&p, argv[i], cache) != 0 || csv_cache_load(&c, &p, argv[i], cache, 0) != 0)) {
+      if (csv_error(&p) == CSV_EREAD || csv_error(&p) == CSV_EWRITE)
+        fprintf(stderr, "Failed to cache %s: %s\n", argv[i], strerror(errno));
+      else
+        fprintf(stderr, "Failed to cache %s: %s\n", argv[i], csv_strerror(csv_error(&p)));
+      csv_fini(&p, NULL, NULL, NULL);
+      status = EXIT_FAILURE;
+      free(cache);
+      continue;
+    }
+
+    fprintf(print ? stderr : stdout, "%s: %lu rows, %lu columns, %s %s\n", argv[i], (unsigned long)c.rows,
+            (unsigned long)c.cols, built ? "built" : "loaded", cache);
+    if (print && print_cache(&c) != 0) {
+      fprintf(stderr, "Failed to write rows of %s: %s\n", argv[i], strerror(errno));
+      status = EXIT_FAILURE;
+    }
+    csv_cache_free(&c);
+    free(cache);
+  }
+
+  csv_free(&p);
+  exit(status);
+}
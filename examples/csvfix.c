@@ -9,21 +9,18 @@ csvfix - reads (possibly malformed) CSV data from input file
 #include <errno.h>
 #include <csv.h>
 
-void cb1 (void *s, size_t i, void *outfile) {
-  csv_fwrite((FILE *)outfile, s, i);
-  fputc(',',(FILE *)outfile);
+void cb1 (void *s, size_t i, void *w) {
+  csv_writer_field(w, s, i);
 }
 
-void cb2 (int c, void *outfile) {
-  fseek((FILE *)outfile, -1, SEEK_CUR);
-  fputc('\n', (FILE *)outfile);
+void cb2 (int c, void *w) {
+  csv_writer_end_row(w);
 }
 
 int main (int argc, char *argv[]) {
-  char buf[1024];
-  size_t i;
   struct csv_parser p;
-  FILE *infile, *outfile;
+  struct csv_writer w;
+  FILE *outfile;
   csv_init(&p, 0);
 
   if (argc != 3) {
@@ -36,42 +33,37 @@ int main (int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  infile = fopen(argv[1], "rb");
-  if (infile == NULL) {
-    fprintf(stderr, "Failed to open file %s: %s\n", argv[1], strerror(errno));
-    exit(EXIT_FAILURE);
-  }
-
   outfile = fopen(argv[2], "wb");
   if (outfile == NULL) {
     fprintf(stderr, "Failed to open file %s: %s\n", argv[2], strerror(errno));
-    fclose(infile);
     exit(EXIT_FAILURE);
   }
 
-  while ((i=fread(buf, 1, 1024, infile)) > 0) {
-    if (csv_parse(&p, buf, i, cb1, cb2, outfile) != i) {
+  if (csv_writer_init_fp(&w, outfile, CSV_QUOTE_ALL) != 0) {
+    fprintf(stderr, "Failed to allocate output buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  csv_parse_file(&p, argv[1], cb1, cb2, &w);
+  if (csv_error(&p) != CSV_SUCCESS) {
+    if (csv_error(&p) == CSV_EREAD)
+      fprintf(stderr, "Error reading file %s: %s\n", argv[1], strerror(errno));
+    else
       fprintf(stderr, "Error parsing file: %s\n", csv_strerror(csv_error(&p)));
-      fclose(infile);
-      fclose(outfile);
-      remove(argv[2]);
-      exit(EXIT_FAILURE);
-    }
+    fclose(outfile);
+    remove(argv[2]);
+    exit(EXIT_FAILURE);
   }
 
-  csv_fini(&p, cb1, cb2, outfile);
+  csv_fini(&p, cb1, cb2, &w);
   csv_free(&p);
 
-  if (ferror(infile)) {
-    fprintf(stderr, "Error reading from input file");
-    fclose(infile);
-    fclose(outfile);
+  if (csv_writer_flush(&w) != 0 || fclose(outfile) != 0) {
+    fprintf(stderr, "Error writing file %s: %s\n", argv[2], strerror(errno));
     remove(argv[2]);
     exit(EXIT_FAILURE);
   }
-
-  fclose(infile);
-  fclose(outfile);
+  csv_writer_free(&w);
   return EXIT_SUCCESS;
 }
 
@@ -9,14 +9,6 @@ csvinfo - reads CSV data from input file(s) and reports the number
 #include <stdlib.h>
 #include <csv.h>
 
-struct counts {
-  long unsigned fields;
-  long unsigned rows;
-};
-
-void cb1 (void *s, size_t len, void *data) { ((struct counts *)data)->fields++; }
-void cb2 (int c, void *data) { ((struct counts *)data)->rows++; }
-
 static int is_space(unsigned char c) {
   if (c == CSV_SPACE || c == CSV_TAB) return 1;
   return 0;
@@ -31,12 +23,11 @@ static int is_term(unsigned char c) {
 int
 main (int argc, char *argv[])
 {
-  FILE *fp;
   struct csv_parser p;
-  char buf[1024];
-  size_t bytes_read;
   unsigned char options = 0;
-  struct counts c = {0, 0};
+  char buf[1024 * 64];
+  size_t fields = 0, rows = 0, bytes_read;
+  FILE *fp;
 
   if (argc < 2) {
     fprintf(stderr, "Usage: csvinfo [-s] files\n");
@@ -60,26 +51,27 @@ main (int argc, char *argv[])
 
     fp = fopen(*argv, "rb");
     if (!fp) {
-      fprintf(stderr, "Failed to open %s: %s\n", *argv, strerror(errno));
+      fprintf(stderr, "Failed to read %s: %s\n", *argv, strerror(errno));
       continue;
     }
 
-    while ((bytes_read=fread(buf, 1, 1024, fp)) > 0) {
-      if (csv_parse(&p, buf, bytes_read, cb1, cb2, &c) != bytes_read) {
+    while ((bytes_read = fread(buf, 1, sizeof buf, fp)) > 0) {
+      if (csv_count(&p, buf, bytes_read, &rows, &fields) != bytes_read) {
         fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
+        break;
       }
     }
 
-    csv_fini(&p, cb1, cb2, &c);
-
     if (ferror(fp)) {
-      fprintf(stderr, "Error while reading file %s\n", *argv);
+      fprintf(stderr, "Failed to read %s: %s\n", *argv, strerror(errno));
       fclose(fp);
+      csv_fini(&p, NULL, NULL, NULL);
       continue;
     }
 
     fclose(fp);
-    printf("%s: %lu fields, %lu rows\n", *argv, c.fields, c.rows);
+    csv_count_fini(&p, &rows, &fields);
+    printf("%s: %lu fields, %lu rows\n", *argv, (long unsigned)fields, (long unsigned)rows);
   }
 
   csv_free(&p);
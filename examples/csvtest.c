@@ -10,38 +10,43 @@ csvtest - reads CSV data from stdin and output properly formed equivalent
 #include <errno.h>
 #include <csv.h>
 
-static int put_comma;
-
-void cb1 (void *s, size_t i, void *p) {
-  if (put_comma)
-    putc(',', stdout);
-  csv_fwrite(stdout, s, i);
-  put_comma = 1;
+void cb1 (void *s, size_t i, void *w) {
+  csv_writer_field(w, s, i);
 }
 
-void cb2 (int c, void *p) {
-  put_comma = 0;
-  putc('\n', stdout);
+void cb2 (int c, void *w) {
+  csv_writer_end_row(w);
 }
 
 int main (void) {
   struct csv_parser p;
+  struct csv_writer w;
   int i;
   char c;
 
   csv_init(&p, 0);
+  if (csv_writer_init_fp(&w, stdout, CSV_QUOTE_ALL) != 0) {
+    fprintf(stderr, "Failed to allocate output buffer\n");
+    exit(EXIT_FAILURE);
+  }
 
   while ((i=getc(stdin)) != EOF) {
     c = i;
-    if (csv_parse(&p, &c, 1, cb1, cb2, NULL) != 1) {
+    if (csv_parse(&p, &c, 1, cb1, cb2, &w) != 1) {
       fprintf(stderr, "Error: %s\n", csv_strerror(csv_error(&p)));
       exit(EXIT_FAILURE);
     }
   }
 
-  csv_fini(&p, cb1, cb2, NULL);
+  csv_fini(&p, cb1, cb2, &w);
   csv_free(&p);
 
+  if (csv_writer_flush(&w) != 0) {
+    fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  csv_writer_free(&w);
+
   return EXIT_SUCCESS;
 }
 
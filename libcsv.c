@@ -18,6 +18,41 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <locale.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+/* csv_parse_fd needs POSIX I/O, files are mapped into memory if possible */
+#if defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H) && defined(HAVE_SYS_STAT_H)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  define CSV_HAVE_POSIX_IO 1
+#  ifdef HAVE_SYS_MMAN_H
+#    include <sys/mman.h>
+#  endif
+#  ifdef HAVE_SYS_UIO_H
+#    include <sys/uio.h>
+#  endif
+#else
+#  undef HAVE_SYS_MMAN_H
+#  undef HAVE_SYS_UIO_H
+#endif
 
 #if __STDC_VERSION__ >= 199901L
 #  include <stdint.h>
@@ -25,9 +60,21 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #  define SIZE_MAX ((size_t)-1) /* C89 doesn't have stdint.h or SIZE_MAX */
 #endif
 
+/* SIMD scanning is used where the compiler supports it, SSE2 is part of the
+   x86-64 baseline, AVX2 is selected at runtime when the CPU supports it */
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define CSV_HAVE_SSE2 1
+#endif
+#if defined(CSV_HAVE_SSE2) && defined(__GNUC__) && defined(__x86_64__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#  include <immintrin.h>
+#  define CSV_HAVE_AVX2 1
+#endif
+
 #include "csv.h"
 
-#define VERSION "3.0.3"
+#define VERSION "4.0.0"
 
 #define ROW_NOT_BEGUN           0
 #define FIELD_NOT_BEGUN         1
@@ -45,36 +92,166 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #define MEM_BLK_SIZE 128
+#define READ_SIZE (1 << 18)  /* Buffer size for input that can't be mapped */
+#define WRITE_SIZE (1 << 16) /* Output buffer size of writers to files */
+
+/* Is column col of the projection selected, see csv_set_columns */
+#define CSV_SELECTED(p, col) \
+  ((col) < (p)->columns_size && ((p)->columns[(col) >> 3] >> ((col) & 7) & 1))
 
 #define SUBMIT_FIELD(p) \
   do { \
-   if (!quoted) \
-     entry_pos -= spaces; \
-   if (p->options & CSV_APPEND_NULL) \
-     ((p)->entry_buf[entry_pos]) = '\0'; \
-   if (cb1 && (p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
-     cb1(NULL, entry_pos, data); \
-   else if (cb1) \
-     cb1(p->entry_buf, entry_pos, data); \
+   if (!skip_field) { \
+     if (!quoted) \
+       entry_pos -= spaces; \
+     if (p->options & CSV_APPEND_NULL) \
+       ((p)->entry_buf[entry_pos]) = '\0'; \
+     if (sink) \
+       sink->quoted = quoted, \
+       sink->field(sink, ((p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) ? NULL : \
+                      zc_start ? zc_start : (p)->entry_buf, entry_pos); \
+     else if (cb1 && (p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
+       cb1(NULL, entry_pos, data); \
+     else if (cb1) \
+       cb1(zc_start ? (void *)zc_start : (p)->entry_buf, entry_pos, data); \
+   } \
+   if (projecting) { \
+     (p)->column++; \
+     skip_field = !CSV_SELECTED(p, (p)->column); \
+   } \
    pstate = FIELD_NOT_BEGUN; \
    entry_pos = quoted = spaces = 0; \
+   zc_start = NULL; \
  } while (0)
 
 #define SUBMIT_ROW(p, c) \
   do { \
-    if (cb2) \
+    if (sink) \
+      sink->row(sink, c, pos); \
+    else if (cb2) \
       cb2(c, data); \
+    if (projecting) { \
+      (p)->column = 0; \
+      skip_field = !CSV_SELECTED(p, 0); \
+    } \
     pstate = ROW_NOT_BEGUN; \
     entry_pos = quoted = spaces = 0; \
   } while (0)
 
-#define SUBMIT_CHAR(p, c) ((p)->entry_buf[entry_pos++] = (c))
+/* Fields read in zero-copy mode are only counted until they have to be
+   copied into the entry buffer */
+#define SUBMIT_CHAR(p, c) (zc_start ? (void)entry_pos++ : (void)((p)->entry_buf[entry_pos++] = (c)))
+
+/* Start a new field, zero-copy fields begin at the byte at offset start.
+   Fields that are skipped are not copied either, but never delivered */
+#define BEGIN_FIELD(p, start) \
+  do { \
+    if (zero_copy || skip_field) { \
+      zc_start = us + (start); \
+      zc_pos = pos - 1; \
+      zc_state = pstate; \
+    } \
+    pstate = FIELD_BEGUN; \
+  } while (0)
+
+/* Copy a zero-copy field that is still in progress into the entry buffer,
+   if that fails the parser is rewound to the start of the field */
+#define ZC_SAVE(p) \
+  do { \
+    if (zc_start && !skip_field && csv_zc_copy(p, zc_start, entry_pos) != 0) { \
+      p->status = CSV_ENOMEM; \
+      p->quoted = 0, p->pstate = zc_state, p->spaces = 0, p->entry_pos = 0; \
+      return zc_pos; \
+    } \
+  } while (0)
+
+/* Receives fields and rows in place of the callbacks for the APIs that
+   collect parsed data themselves, a sink without a field or row function
+   only validates the data */
+struct csv_sink {
+  void (*field)(struct csv_sink *, const unsigned char *, size_t);
+  void (*row)(struct csv_sink *, int c, size_t pos);  /* pos is just past the terminator */
+  void *data;               /* Batch or chunk being filled */
+  int quoted;               /* Whether the field being passed was quoted */
+  int stop;                 /* Set to stop parsing after the current byte */
+  int status;               /* Error to report when stopping, if any */
+  size_t offset;            /* Offset of the buffer being parsed in the input,
+                               advanced by csv_parse_fd_sink */
+};
+
+static int
+csv_reserve(void **buf, size_t *size, size_t used, size_t need, size_t elem)
+{
+  /* Make room for need more elements of elem bytes in a malloc'ed array of
+   * which used elements are in use, doubling its size, returns 0 on success
+   */
+  size_t n = *size ? *size : MEM_BLK_SIZE;
+  void *vp;
+
+  if (need <= *size - used)
+    return 0;
+  while (n - used < need)
+    n = n > SIZE_MAX / 2 ? SIZE_MAX : n * 2;
+  if (n - used < need || n > SIZE_MAX / elem || (vp = realloc(*buf, n * elem)) == NULL)
+    return -1;
+  *buf = vp;
+  *size = n;
+  return 0;
+}
+
+static void
+csv_batch_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  /* Store a field in the current row of the batch */
+  struct csv_batch *b = sink->data;
+  size_t i;
+
+  if (b->col < b->max_cols) {
+    i = b->col * b->max_rows + b->rows;
+    if (csv_reserve((void **)&b->values, &b->values_size, b->values_used, len, 1) != 0) {
+      sink->status = CSV_ENOMEM;
+      sink->stop = 1;
+      return;
+    }
+    if (len)
+      memcpy(b->values + b->values_used, field, len);
+    b->offsets[i] = b->values_used;
+    b->lengths[i] = len;
+    b->nulls[i] = field == NULL;
+    b->values_used += len;
+  }
+  b->col++;
+}
+
+static void
+csv_batch_row(struct csv_sink *sink, int c, size_t pos)
+{
+  /* Complete the current row of the batch, stop once it is full */
+  struct csv_batch *b = sink->data;
+  size_t col;
+
+  (void)c, (void)pos;
+
+  for (col = b->col; col < b->max_cols; col++) {
+    size_t i = col * b->max_rows + b->rows;
+    b->offsets[i] = b->values_used;
+    b->lengths[i] = 0;
+    b->nulls[i] = 1;
+  }
+  b->ncols[b->rows++] = b->col;
+  b->col = 0;
+
+  if (b->rows == b->max_rows)
+    sink->stop = 1;
+}
 
 static const char *csv_errors[] = {"success",
                              "error parsing data while strict checking enabled",
                              "memory exhausted while increasing buffer size",
                              "data size too large",
-                             "invalid status code"};
+                             "invalid status code",
+                             "error reading input",
+                             "error writing output"};
 
 int
 csv_error(const struct csv_parser *p)
@@ -89,7 +266,7 @@ const char *
 csv_strerror(int status)
 {
   /* Return a textual description of status */
-  if (status >= CSV_EINVALID || status < 0)
+  if (status == CSV_EINVALID || status > CSV_EWRITE || status < 0)
     return csv_errors[CSV_EINVALID];
   else
     return csv_errors[status];
@@ -116,6 +293,57 @@ csv_set_opts(struct csv_parser *p, unsigned char options)
   return 0;
 }
 
+/* Character classes, a byte can belong to several */
+#define CL_DELIM 1
+#define CL_QUOTE 2
+#define CL_SPACE 4
+#define CL_TERM  8
+
+static void
+csv_build_classes(struct csv_parser *p)
+{
+  /* Classify every byte for the current dialect so the parser needs one
+   * table lookup per byte instead of comparisons and calls to is_space
+   * and is_term.  Also collect the bytes that end a run of an unquoted
+   * field, for vector scanning if there are few enough of them.
+   */
+  struct csv_classes *k = &p->classes;
+  unsigned char cl;
+  int c, n = 0;
+
+  for (c = 0; c < 256; c++) {
+    cl = 0;
+    if (c == p->delim_char)
+      cl |= CL_DELIM;
+    if (c == p->quote_char)
+      cl |= CL_QUOTE;
+    if (p->is_space ? p->is_space((unsigned char)c) : c == CSV_SPACE || c == CSV_TAB)
+      cl |= CL_SPACE;
+    if (p->is_term ? p->is_term((unsigned char)c) : c == CSV_CR || c == CSV_LF)
+      cl |= CL_TERM;
+    if (cl & (CL_DELIM | CL_SPACE | CL_TERM)) {
+      if (n < (int)sizeof k->stops)
+        k->stops[n] = (unsigned char)c;
+      n++;
+    }
+    k->cls[c] = cl;
+  }
+
+  k->nstops = n <= (int)sizeof k->stops ? n : -1;
+  k->delim_char = p->delim_char;
+  k->quote_char = p->quote_char;
+  k->is_space = p->is_space;
+  k->is_term = p->is_term;
+}
+
+/* Rebuild the classes if the dialect was changed without the setters */
+#define CHECK_CLASSES(p) \
+  do { \
+    if ((p)->classes.delim_char != (p)->delim_char || (p)->classes.quote_char != (p)->quote_char || \
+        (p)->classes.is_space != (p)->is_space || (p)->classes.is_term != (p)->is_term) \
+      csv_build_classes(p); \
+  } while (0)
+
 int
 csv_init(struct csv_parser *p, unsigned char options)
 {
@@ -139,10 +367,47 @@ csv_init(struct csv_parser *p, unsigned char options)
   p->malloc_func = NULL;
   p->realloc_func = realloc;
   p->free_func = free;
+  p->allocator.realloc_func = NULL;
+  p->allocator.free_func = NULL;
+  p->allocator.ctx = NULL;
+  p->grow_policy = CSV_GROW_LINEAR;
+  p->grow_cap = 0;
+  p->shrink_size = 0;
+  p->columns = NULL;
+  p->columns_size = 0;
+  p->column = 0;
+  p->skip_rest = 0;
+  p->stats = NULL;
+  p->stats_options = 0;
+  p->next_input = NULL;
+  p->next_len = p->next_pos = 0;
+  p->next_end = p->next_row = p->next_c = 0;
+  csv_build_classes(p);
 
   return 0;
 }
 
+static void *
+csv_realloc(struct csv_parser *p, void *ptr, size_t size)
+{
+  /* Resize memory owned by the parser with the configured allocator */
+  if (p->allocator.realloc_func)
+    return p->allocator.realloc_func(p->allocator.ctx, ptr, size);
+  return p->realloc_func(ptr, size);
+}
+
+static void
+csv_release(struct csv_parser *p, void *ptr)
+{
+  /* Free memory owned by the parser with the configured allocator */
+  if (p->allocator.realloc_func) {
+    if (p->allocator.free_func)
+      p->allocator.free_func(p->allocator.ctx, ptr);
+  } else if (p->free_func) {
+    p->free_func(ptr);
+  }
+}
+
 void
 csv_free(struct csv_parser *p)
 {
@@ -150,17 +415,124 @@ csv_free(struct csv_parser *p)
   if (p == NULL)
     return;
 
-  if (p->entry_buf && p->free_func)
-    p->free_func(p->entry_buf);
+  if (p->entry_buf)
+    csv_release(p, p->entry_buf);
+  if (p->columns)
+    csv_release(p, p->columns);
+  if (p->stats)
+    csv_release(p, p->stats);
 
   p->entry_buf = NULL;
   p->entry_size = 0;
+  p->columns = NULL;
+  p->columns_size = 0;
+  p->stats = NULL;
+  p->stats_options = 0;
 
   return;
 }
 
-int
-csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+/* Where a parser with statistics passes the fields and rows it counted */
+struct csv_counted {
+  struct csv_parser *p;
+  void (*cb1)(void *, size_t, void *);
+  void (*cb2)(int, void *);
+  void *data;
+  struct csv_sink *sink;  /* Used instead of the callbacks if not NULL */
+};
+
+static double
+csv_now(void)
+{
+  /* Seconds since some fixed point, for timing callbacks */
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void
+csv_counted_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  /* Count a field and pass it on */
+  struct csv_counted *c = sink->data;
+  struct csv_stats *st = c->p->stats;
+  const unsigned char *q, *end = field + len;
+  double start = 0;
+
+  st->fields++;
+  if (len > st->max_field)
+    st->max_field = len;
+  if (sink->quoted) {
+    /* Quotes in a quoted field were written doubled */
+    st->quoted_fields++;
+    for (q = field; len && (q = memchr(q, c->p->quote_char, (size_t)(end - q))) != NULL; q++)
+      st->doubled_quotes++;
+  }
+
+  if (c->p->stats_options & CSV_STATS_TIMING)
+    start = csv_now();
+  if (c->sink) {
+    c->sink->quoted = sink->quoted;
+    c->sink->field(c->sink, field, len);
+    sink->stop = c->sink->stop;
+    sink->status = c->sink->status;
+  } else if (c->cb1) {
+    c->cb1((void *)field, len, c->data);
+  }
+  if (c->p->stats_options & CSV_STATS_TIMING)
+    st->callback_seconds += csv_now() - start;
+}
+
+static void
+csv_counted_row(struct csv_sink *sink, int ch, size_t pos)
+{
+  /* Count a row and pass it on */
+  struct csv_counted *c = sink->data;
+  struct csv_stats *st = c->p->stats;
+  double start = 0;
+
+  st->rows++;
+  if (c->p->stats_options & CSV_STATS_TIMING)
+    start = csv_now();
+  if (c->sink) {
+    c->sink->offset = sink->offset;
+    c->sink->row(c->sink, ch, pos);
+    sink->stop = c->sink->stop;
+    sink->status = c->sink->status;
+  } else if (c->cb2) {
+    c->cb2(ch, c->data);
+  }
+  if (c->p->stats_options & CSV_STATS_TIMING)
+    st->callback_seconds += csv_now() - start;
+}
+
+static void
+csv_counting_sink(struct csv_sink *sink, struct csv_counted *c, struct csv_parser *p, void (*cb1)(void *, size_t, void *),
+                  void (*cb2)(int, void *), void *data, struct csv_sink *next)
+{
+  /* Set up sink to count what the parser delivers before passing it to the
+     callbacks or to next */
+  c->p = p;
+  c->cb1 = cb1;
+  c->cb2 = cb2;
+  c->data = data;
+  c->sink = next;
+  sink->field = csv_counted_field;
+  sink->row = csv_counted_row;
+  sink->data = c;
+  sink->quoted = 0;
+  sink->stop = 0;
+  sink->status = 0;
+  sink->offset = next ? next->offset : 0;
+}
+
+static int
+csv_fini_sink(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+              struct csv_sink *sink)
 {
   if (p == NULL)
     return -1;
@@ -170,13 +542,29 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
+  unsigned const char *zc_start = NULL;  /* Fields are always buffered here */
+  size_t pos = 0;                        /* No input is read here */
+  int projecting = p->columns != NULL;
+  int skip_field = projecting && !CSV_SELECTED(p, p->column);
+  struct csv_counted counted;
+  struct csv_sink counting;
 
   if ((pstate == FIELD_BEGUN) && p->quoted && (p->options & CSV_STRICT) && (p->options & CSV_STRICT_FINI)) {
     /* Current field is quoted, no end-quote was seen, and CSV_STRICT_FINI is set */
     p->status = CSV_EPARSE;
+    if (p->stats)
+      p->stats->strict_errors++;
     return -1;
   }
 
+  if (p->stats) {
+    csv_counting_sink(&counting, &counted, p, cb1, cb2, data, sink);
+    cb1 = NULL, cb2 = NULL, sink = &counting;
+  }
+
+  if (p->skip_rest || !p->entry_buf)  /* The rest of the row was skipped or only validated */
+    pstate = ROW_NOT_BEGUN;
+
   switch (pstate) {
     case FIELD_MIGHT_HAVE_ENDED:
       p->entry_pos -= p->spaces + 1;  /* get rid of spaces and original quote */
@@ -197,23 +585,46 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
 
   /* Reset parser */
   p->spaces = p->quoted = p->entry_pos = p->status = 0;
+  p->column = 0;
+  p->skip_rest = 0;
   p->pstate = ROW_NOT_BEGUN;
 
+  /* Give back memory from an unusually large field */
+  if (p->shrink_size && p->entry_size > p->shrink_size && p->entry_buf) {
+    void *vp = csv_realloc(p, p->entry_buf, p->shrink_size);
+    if (vp) {
+      p->entry_buf = vp;
+      p->entry_size = p->shrink_size;
+    }
+  }
+
   return 0;
 }
 
+int
+csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  return csv_fini_sink(p, cb1, cb2, data, NULL);
+}
+
 void
 csv_set_delim(struct csv_parser *p, unsigned char c)
 {
   /* Set the delimiter */
-  if (p) p->delim_char = c;
+  if (p) {
+    p->delim_char = c;
+    csv_build_classes(p);
+  }
 }
 
 void
 csv_set_quote(struct csv_parser *p, unsigned char c)
 {
   /* Set the quote character */
-  if (p) p->quote_char = c;
+  if (p) {
+    p->quote_char = c;
+    csv_build_classes(p);
+  }
 }
 
 unsigned char
@@ -238,14 +649,20 @@ void
 csv_set_space_func(struct csv_parser *p, int (*f)(unsigned char))
 {
   /* Set the space function */
-  if (p) p->is_space = f;
+  if (p) {
+    p->is_space = f;
+    csv_build_classes(p);
+  }
 }
  
 void
 csv_set_term_func(struct csv_parser *p, int (*f)(unsigned char))
 {
   /* Set the term function */
-  if (p) p->is_term = f;
+  if (p) {
+    p->is_term = f;
+    csv_build_classes(p);
+  }
 }
 
 void
@@ -269,6 +686,59 @@ csv_set_blk_size(struct csv_parser *p, size_t size)
   if (p) p->blk_size = size;
 }
 
+int
+csv_set_stats(struct csv_parser *p, int options)
+{
+  /* Keep statistics with CSV_STATS_COUNT, and time the callbacks with
+   * CSV_STATS_TIMING too, or stop keeping them if options is 0.  The
+   * counters start at 0 when statistics are enabled.  Returns 0 on success
+   * and -1 on error.
+   */
+  if (p == NULL || (options & ~(CSV_STATS_COUNT | CSV_STATS_TIMING)))
+    return -1;
+
+  if (options == 0) {
+    if (p->stats)
+      csv_release(p, p->stats);
+    p->stats = NULL;
+    p->stats_options = 0;
+    return 0;
+  }
+
+  if (p->stats == NULL) {
+    if ((p->stats = csv_realloc(p, NULL, sizeof *p->stats)) == NULL)
+      return -1;
+    csv_reset_stats(p);
+  }
+  p->stats_options = options | CSV_STATS_COUNT;
+  return 0;
+}
+
+int
+csv_get_stats(const struct csv_parser *p, struct csv_stats *st)
+{
+  /* Copy the statistics of the parser to st, returns -1 if the parser does
+     not keep any */
+  if (p == NULL || st == NULL || p->stats == NULL)
+    return -1;
+
+  *st = *p->stats;
+  st->buffer_size = p->entry_size;
+  return 0;
+}
+
+void
+csv_reset_stats(struct csv_parser *p)
+{
+  /* Start the statistics over, the peak buffer size from the current one */
+  if (p == NULL || p->stats == NULL)
+    return;
+
+  memset(p->stats, 0, sizeof *p->stats);
+  p->stats->callback_seconds = 0;
+  p->stats->buffer_size = p->stats->peak_buffer_size = p->entry_size;
+}
+
 size_t
 csv_get_buffer_size(const struct csv_parser *p)
 {
@@ -277,15 +747,192 @@ csv_get_buffer_size(const struct csv_parser *p)
     return p->entry_size;
   return 0;
 }
+
+void
+csv_set_allocator(struct csv_parser *p, const struct csv_allocator *a)
+{
+  /* Set the allocator used for the buffer, NULL restores realloc_func and free_func */
+  if (p == NULL)
+    return;
+
+  if (a && a->realloc_func) {
+    p->allocator = *a;
+  } else {
+    p->allocator.realloc_func = NULL;
+    p->allocator.free_func = NULL;
+    p->allocator.ctx = NULL;
+  }
+}
+
+void
+csv_set_growth(struct csv_parser *p, int policy, size_t cap)
+{
+  /* Set how the buffer grows and the largest single increase */
+  if (p) {
+    p->grow_policy = policy;
+    p->grow_cap = cap;
+  }
+}
+
+void
+csv_set_shrink_size(struct csv_parser *p, size_t size)
+{
+  /* Set the size csv_fini shrinks larger buffers to */
+  if (p) p->shrink_size = size;
+}
+
+int
+csv_set_columns(struct csv_parser *p, const size_t *cols, size_t n)
+{
+  /* Deliver only the fields of the n columns in cols, or all fields if n
+   * is 0 and cols is NULL; returns 0 on success and -1 on error
+   */
+  unsigned char *set;
+  size_t i, size = 0;
+
+  if (p == NULL || (n && cols == NULL))
+    return -1;
+
+  if (cols == NULL) {
+    if (p->columns)
+      csv_release(p, p->columns);
+    p->columns = NULL;
+    p->columns_size = 0;
+    return 0;
+  }
+
+  for (i = 0; i < n; i++)
+    if (cols[i] >= size)
+      size = cols[i] + 1;
+  if (size > SIZE_MAX - 8 || (set = csv_realloc(p, NULL, size / 8 + 1)) == NULL)
+    return -1;
+  memset(set, 0, size / 8 + 1);
+  for (i = 0; i < n; i++)
+    set[cols[i] >> 3] |= (unsigned char)(1 << (cols[i] & 7));
+
+  if (p->columns)
+    csv_release(p, p->columns);
+  p->columns = set;
+  p->columns_size = size;
+  return 0;
+}
+
+/* Arena blocks are preceded by a header holding the block size and the
+   offset of the previous block, both kept aligned for any object */
+#define ARENA_ALIGN 16
+#define ARENA_HDR_SIZE ((2 * sizeof(size_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void
+csv_arena_init(struct csv_arena *a, void *mem, size_t size)
+{
+  /* Initialize an arena handing out memory from the size bytes at mem */
+  if (a == NULL)
+    return;
+
+  a->mem = mem;
+  a->size = mem ? size : 0;
+  a->used = 0;
+  a->last = a->size;
+
+  /* Start at an aligned address */
+  if (a->mem && (size_t)a->mem % ARENA_ALIGN) {
+    size_t skip = ARENA_ALIGN - (size_t)a->mem % ARENA_ALIGN;
+    a->mem += skip < a->size ? skip : a->size;
+    a->size -= skip < a->size ? skip : a->size;
+    a->last = a->size;
+  }
+}
+
+void
+csv_arena_reset(struct csv_arena *a)
+{
+  /* Release everything allocated from the arena at once */
+  if (a) {
+    a->used = 0;
+    a->last = a->size;
+  }
+}
+
+void *
+csv_arena_realloc(void *arena, void *ptr, size_t size)
+{
+  /* Allocate or resize a block, the most recent block is resized in place */
+  struct csv_arena *a = arena;
+  size_t *hdr;
+  size_t old_size = 0;
+  size_t off;
+
+  if (a == NULL)
+    return NULL;
+
+  if (ptr) {
+    hdr = (size_t *)((unsigned char *)ptr - ARENA_HDR_SIZE);
+    old_size = hdr[0];
+    off = (size_t)((unsigned char *)hdr - a->mem);
+    if (off == a->last) {
+      /* Last block, extend or shrink it where it is */
+      if (size > a->size - off - ARENA_HDR_SIZE)
+        return NULL;
+      hdr[0] = size;
+      a->used = off + ARENA_HDR_SIZE + ARENA_ROUND(size);
+      if (a->used > a->size)
+        a->used = a->size;
+      return ptr;
+    }
+    if (size <= old_size) {
+      hdr[0] = size;
+      return ptr;
+    }
+  }
+
+  /* Carve a new block off the end of the arena */
+  if (a->used > a->size || a->size - a->used < ARENA_HDR_SIZE ||
+      size > a->size - a->used - ARENA_HDR_SIZE)
+    return NULL;
+
+  off = a->used;
+  hdr = (size_t *)(a->mem + off);
+  hdr[0] = size;
+  hdr[1] = a->last;
+  a->last = off;
+  a->used = off + ARENA_HDR_SIZE + ARENA_ROUND(size);
+  if (a->used > a->size)
+    a->used = a->size;
+
+  if (ptr)
+    memcpy(a->mem + off + ARENA_HDR_SIZE, ptr, old_size);
+
+  return a->mem + off + ARENA_HDR_SIZE;
+}
+
+void
+csv_arena_free(void *arena, void *ptr)
+{
+  /* Free a block, only the most recent block's memory can be reused
+     before the arena is reset */
+  struct csv_arena *a = arena;
+  size_t *hdr;
+
+  if (a == NULL || ptr == NULL)
+    return;
+
+  hdr = (size_t *)((unsigned char *)ptr - ARENA_HDR_SIZE);
+  if ((size_t)((unsigned char *)hdr - a->mem) == a->last) {
+    a->used = a->last;
+    a->last = hdr[1];
+  }
+}
  
 static int
 csv_increase_buffer(struct csv_parser *p)
 {
   if (p == NULL) return 0;
-  if (p->realloc_func == NULL) return 0;
+  if (p->realloc_func == NULL && p->allocator.realloc_func == NULL) return 0;
   
   /* Increase the size of the entry buffer.  Attempt to increase size by 
-   * p->blk_size, if this is larger than SIZE_MAX try to increase current
+   * p->blk_size, or by the current size up to p->grow_cap with geometric
+   * growth, if this is larger than SIZE_MAX try to increase current
    * buffer size to SIZE_MAX.  If allocation fails, try to allocate halve 
    * the size and try again until successful or increment size is zero.
    */
@@ -293,6 +940,12 @@ csv_increase_buffer(struct csv_parser *p)
   size_t to_add = p->blk_size;
   void *vp;
 
+  if (p->grow_policy == CSV_GROW_GEOMETRIC && p->entry_size > to_add) {
+    to_add = p->entry_size;
+    if (p->grow_cap && to_add > p->grow_cap)
+      to_add = p->grow_cap > p->blk_size ? p->grow_cap : p->blk_size;
+  }
+
   if ( p->entry_size >= SIZE_MAX - to_add )
     to_add = SIZE_MAX - p->entry_size;
 
@@ -301,7 +954,7 @@ csv_increase_buffer(struct csv_parser *p)
     return -1;
   }
 
-  while ((vp = p->realloc_func(p->entry_buf, p->entry_size + to_add)) == NULL) {
+  while ((vp = csv_realloc(p, p->entry_buf, p->entry_size + to_add)) == NULL) {
     to_add /= 2;
     if (!to_add) {
       p->status = CSV_ENOMEM;
@@ -312,158 +965,4281 @@ csv_increase_buffer(struct csv_parser *p)
   /* Update entry buffer pointer and entry_size if successful */
   p->entry_buf = vp;
   p->entry_size += to_add;
+  if (p->stats) {
+    p->stats->reallocs++;
+    if (p->entry_size > p->stats->peak_buffer_size)
+      p->stats->peak_buffer_size = p->entry_size;
+  }
   return 0;
 }
- 
-size_t
-csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+
+#define CSV_SPAN_MAX 6  /* Maximum number of stop characters for csv_span */
+
+#if defined(__GNUC__)
+#  define CSV_INLINE __inline__ __attribute__((always_inline))
+#  define CSV_CTZ(x) ((size_t)__builtin_ctz(x))
+#  define CSV_POPCOUNT(x) ((size_t)__builtin_popcount(x))
+#else
+#  define CSV_INLINE
+static size_t
+csv_ctz(unsigned int x)
 {
-  assert(p && "received null csv_parser");
+  size_t n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+}
+#  define CSV_CTZ(x) csv_ctz(x)
+static size_t
+csv_popcount(unsigned int x)
+{
+  size_t n = 0;
+  while (x) {
+    x &= x - 1;
+    n++;
+  }
+  return n;
+}
+#  define CSV_POPCOUNT(x) csv_popcount(x)
+#endif
 
-  if (s == NULL) return 0;
-  
-  unsigned const char *us = s;  /* Access input data as array of unsigned char */
-  unsigned char c;              /* The character we are currently processing */
-  size_t pos = 0;               /* The number of characters we have processed in this call */
+static size_t
+csv_span_scalar(const unsigned char *s, size_t len, const unsigned char *set, int n)
+{
+  size_t i;
+  int j;
 
-  /* Store key fields into local variables for performance */
-  unsigned char delim = p->delim_char;
-  unsigned char quote = p->quote_char;
-  int (*is_space)(unsigned char) = p->is_space;
-  int (*is_term)(unsigned char) = p->is_term;
-  int quoted = p->quoted;
-  int pstate = p->pstate;
-  size_t spaces = p->spaces;
-  size_t entry_pos = p->entry_pos;
+  for (i = 0; i < len; i++)
+    for (j = 0; j < n; j++)
+      if (s[i] == set[j])
+        return i;
+  return len;
+}
 
+#ifdef CSV_HAVE_SSE2
+static size_t
+csv_span_sse2(const unsigned char *s, size_t len, const unsigned char *set, int n)
+{
+  __m128i v[CSV_SPAN_MAX];
+  size_t i = 0;
+  int j;
 
-  if (!p->entry_buf && pos < len) {
-    /* Buffer hasn't been allocated yet and len > 0 */
-    if (csv_increase_buffer(p) != 0) { 
-      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-      return pos;
-    }
+  for (j = 0; j < n; j++)
+    v[j] = _mm_set1_epi8((char)set[j]);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i m = _mm_cmpeq_epi8(b, v[0]);
+    unsigned int mask;
+    for (j = 1; j < n; j++)
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(b, v[j]));
+    mask = (unsigned int)_mm_movemask_epi8(m);
+    if (mask)
+      return i + CSV_CTZ(mask);
   }
 
-  while (pos < len) {
-    /* Check memory usage, increase buffer if necessary */
-    if (entry_pos == ((p->options & CSV_APPEND_NULL) ? p->entry_size - 1 : p->entry_size) ) {
-      if (csv_increase_buffer(p) != 0) {
-        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-        return pos;
-      }
-    }
+  return i + csv_span_scalar(s + i, len - i, set, n);
+}
+#endif
 
-    c = us[pos++];
+#ifdef CSV_HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t
+csv_span_avx2(const unsigned char *s, size_t len, const unsigned char *set, int n)
+{
+  __m256i v[CSV_SPAN_MAX];
+  size_t i = 0;
+  int j;
 
-    switch (pstate) {
-      case ROW_NOT_BEGUN:
-      case FIELD_NOT_BEGUN:
-        if ((is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) && c!=delim) { /* Space or Tab */
-          continue;
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) { /* Carriage Return or Line Feed */
-          if (pstate == FIELD_NOT_BEGUN) {
-            SUBMIT_FIELD(p);
-            SUBMIT_ROW(p, c); 
-          } else {  /* ROW_NOT_BEGUN */
-            /* Don't submit empty rows by default */
-            if (p->options & CSV_REPALL_NL) {
-              SUBMIT_ROW(p, c);
-            }
-          }
-          continue;
-        } else if (c == delim) { /* Comma */
-          SUBMIT_FIELD(p);
-          break;
-        } else if (c == quote) { /* Quote */
-          pstate = FIELD_BEGUN;
-          quoted = 1;
-        } else {               /* Anything else */
-          pstate = FIELD_BEGUN;
-          quoted = 0;
-          SUBMIT_CHAR(p, c);
-        }
+  for (j = 0; j < n; j++)
+    v[j] = _mm256_set1_epi8((char)set[j]);
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i m = _mm256_cmpeq_epi8(b, v[0]);
+    unsigned int mask;
+    for (j = 1; j < n; j++)
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, v[j]));
+    mask = (unsigned int)_mm256_movemask_epi8(m);
+    if (mask)
+      return i + CSV_CTZ(mask);
+  }
+
+  return i + csv_span_sse2(s + i, len - i, set, n);
+}
+#endif
+
+#ifdef CSV_HAVE_AVX2
+static int csv_avx2;  /* Set by csv_detect_avx2 if the CPU supports AVX2 */
+
+static void
+csv_detect_avx2(void)
+{
+  csv_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+}
+
+static int
+csv_have_avx2(void)
+{
+  /* Detect AVX2 once, parsers and writers may run on several threads */
+#ifdef HAVE_PTHREAD
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, csv_detect_avx2);
+#else
+  static int detected;
+
+  if (!detected) {
+    csv_detect_avx2();
+    detected = 1;
+  }
+#endif
+  return csv_avx2;
+}
+#endif
+
+static size_t
+csv_span(const unsigned char *s, size_t len, const unsigned char *set, int n)
+{
+  /* Return the number of leading bytes of s that match none of the n bytes
+   * in set, using the widest vector unit available on this CPU
+   */
+#ifdef CSV_HAVE_AVX2
+  if (len >= 32 && csv_have_avx2())
+    return csv_span_avx2(s, len, set, n);
+#endif
+#ifdef CSV_HAVE_SSE2
+  return csv_span_sse2(s, len, set, n);
+#else
+  return csv_span_scalar(s, len, set, n);
+#endif
+}
+
+/* Marks of the structural bytes of a window of the input, bit i stands for
+   the byte at base + i */
+#define MARK_SIZE 32   /* Bytes in a window, the marks fit in 32 bits */
+#define MARK_TERMS 4   /* Most terminator bytes marked with vector code */
+
+struct csv_marks {
+  size_t base;         /* Offset of the window in the input */
+  size_t end;          /* Offset just past the window */
+  unsigned long quotes;
+  unsigned long delims;
+  unsigned long terms;
+  unsigned char term[MARK_TERMS];  /* Terminator bytes of the dialect */
+  int nterms;          /* Number of terminator bytes, -1 if there are too many */
+};
+
+static void
+csv_marks_init(const struct csv_parser *p, struct csv_marks *m)
+{
+  int c;
+
+  m->base = m->end = 0;
+  m->nterms = 0;
+  for (c = 0; c < 256 && m->nterms >= 0; c++) {
+    if (!(p->classes.cls[c] & CL_TERM))
+      continue;
+    if (m->nterms == MARK_TERMS)
+      m->nterms = -1;
+    else
+      m->term[m->nterms++] = (unsigned char)c;
+  }
+}
+
+static void
+csv_mark(const struct csv_parser *p, const unsigned char *s, size_t len, size_t base, struct csv_marks *m)
+{
+  /* Mark the quotes, delimiters and terminators in the window of s that
+   * starts at base
+   */
+  const unsigned char *cls = p->classes.cls;
+  size_t n = len - base < MARK_SIZE ? len - base : MARK_SIZE;
+  unsigned long q = 0, d = 0, t = 0;
+  size_t i;
+
+  s += base;
+  m->base = base;
+  m->end = base + n;
+
+#ifdef CSV_HAVE_SSE2
+  if (m->nterms >= 0) {
+    const __m128i vq = _mm_set1_epi8((char)p->quote_char), vd = _mm_set1_epi8((char)p->delim_char);
+    unsigned char tail[MARK_SIZE];
+    __m128i b, vt;
+    int h, j;
+
+    if (n < MARK_SIZE) {
+      memset(tail, 0, sizeof tail);
+      memcpy(tail, s, n);
+      s = tail;
+    }
+    for (h = 0; h < MARK_SIZE; h += 16) {
+      b = _mm_loadu_si128((const __m128i *)(s + h));
+      vt = _mm_setzero_si128();
+      for (j = 0; j < m->nterms; j++)
+        vt = _mm_or_si128(vt, _mm_cmpeq_epi8(b, _mm_set1_epi8((char)m->term[j])));
+      q |= (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(b, vq)) << h;
+      d |= (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(b, vd)) << h;
+      t |= (unsigned long)_mm_movemask_epi8(vt) << h;
+    }
+    if (n < MARK_SIZE) {
+      /* Bytes past the end of the input are never marked */
+      unsigned long keep = (1UL << n) - 1;
+      q &= keep, d &= keep, t &= keep;
+    }
+    m->quotes = q, m->delims = d, m->terms = t;
+    return;
+  }
+#endif
+
+  for (i = 0; i < n; i++) {
+    if (cls[s[i]] & CL_QUOTE)
+      q |= 1UL << i;
+    if (cls[s[i]] & CL_DELIM)
+      d |= 1UL << i;
+    if (cls[s[i]] & CL_TERM)
+      t |= 1UL << i;
+  }
+  m->quotes = q, m->delims = d, m->terms = t;
+}
+
+static size_t
+csv_next_mark(const struct csv_parser *p, const unsigned char *s, size_t len, size_t pos, struct csv_marks *m, int which)
+{
+  /* Return the offset of the first byte at or after pos of one of the
+   * classes in which, or len if there is none
+   */
+  unsigned long bits;
+
+  while (pos < len) {
+    if (pos < m->base || pos >= m->end)
+      csv_mark(p, s, len, pos, m);
+    bits = ((which & CL_QUOTE) ? m->quotes : 0) | ((which & CL_DELIM) ? m->delims : 0) |
+           ((which & CL_TERM) ? m->terms : 0);
+    bits >>= pos - m->base;
+    if (bits)
+      return pos + CSV_CTZ((unsigned int)bits);
+    pos = m->end;
+  }
+  return len;
+}
+
+static size_t
+csv_next_break(const struct csv_parser *p, const unsigned char *s, size_t len, size_t pos, struct csv_marks *m,
+               size_t *delims)
+{
+  /* Return the offset of the first quote or terminator at or after pos, or
+   * len if there is none, adding the number of delimiters before it to
+   * *delims
+   */
+  unsigned long bits, d;
+  size_t k;
+
+  while (pos < len) {
+    if (pos < m->base || pos >= m->end)
+      csv_mark(p, s, len, pos, m);
+    bits = (m->quotes | m->terms) >> (pos - m->base);
+    d = m->delims >> (pos - m->base);
+    if (bits) {
+      k = CSV_CTZ((unsigned int)bits);
+      *delims += CSV_POPCOUNT((unsigned int)(d & ((1UL << k) - 1)));
+      return pos + k;
+    }
+    *delims += CSV_POPCOUNT((unsigned int)d);
+    pos = m->end;
+  }
+  return len;
+}
+
+static size_t
+csv_count_byte_scalar(const unsigned char *s, size_t len, unsigned char c)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < len; i++)
+    n += s[i] == c;
+  return n;
+}
+
+#ifdef CSV_HAVE_SSE2
+static size_t
+csv_count_byte_sse2(const unsigned char *s, size_t len, unsigned char c)
+{
+  /* Matches are counted in byte lanes, which are summed before they can
+   * overflow after 255 blocks */
+  const __m128i v = _mm_set1_epi8((char)c), zero = _mm_setzero_si128();
+  __m128i acc;
+  size_t i = 0, n = 0;
+  int k;
+
+  while (i + 16 <= len) {
+    acc = zero;
+    for (k = 0; k < 255 && i + 16 <= len; k++, i += 16)
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), v));
+    acc = _mm_sad_epu8(acc, zero);
+    n += (size_t)_mm_cvtsi128_si32(acc) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+  }
+
+  return n + csv_count_byte_scalar(s + i, len - i, c);
+}
+#endif
+
+#ifdef CSV_HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t
+csv_count_byte_avx2(const unsigned char *s, size_t len, unsigned char c)
+{
+  const __m256i v = _mm256_set1_epi8((char)c), zero = _mm256_setzero_si256();
+  __m256i acc;
+  __m128i sum;
+  size_t i = 0, n = 0;
+  int k;
+
+  while (i + 32 <= len) {
+    acc = zero;
+    for (k = 0; k < 255 && i + 32 <= len; k++, i += 32)
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), v));
+    acc = _mm256_sad_epu8(acc, zero);
+    sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    n += (size_t)_mm_cvtsi128_si32(sum) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+  }
+
+  return n + csv_count_byte_sse2(s + i, len - i, c);
+}
+#endif
+
+static size_t
+csv_count_byte(const unsigned char *s, size_t len, unsigned char c)
+{
+  /* Return the number of bytes of s equal to c */
+#ifdef CSV_HAVE_AVX2
+  if (len >= 32 && csv_have_avx2())
+    return csv_count_byte_avx2(s, len, c);
+#endif
+#ifdef CSV_HAVE_SSE2
+  return csv_count_byte_sse2(s, len, c);
+#else
+  return csv_count_byte_scalar(s, len, c);
+#endif
+}
+
+static size_t
+csv_escape(unsigned char *dest, const unsigned char *s, size_t len, unsigned char quote, size_t quotes)
+{
+  /* Copy len bytes from s to dest doubling the quotes, of which there are
+   * known to be quotes, dest must have room for len + quotes bytes.
+   * Returns the number of bytes written.
+   */
+  size_t i = 0, out = 0, j;
+#ifdef CSV_HAVE_SSE2
+  const __m128i v = _mm_set1_epi8((char)quote);
+  unsigned int mask;
+
+  /* Blocks are stored whole, after a quote the next block starts behind it */
+  while (quotes && i + 16 <= len) {
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+    _mm_storeu_si128((__m128i *)(dest + out), b);
+    mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(b, v));
+    if (!mask) {
+      i += 16, out += 16;
+      continue;
+    }
+    j = CSV_CTZ(mask) + 1;
+    i += j, out += j;
+    dest[out++] = quote;
+    quotes--;
+  }
+#endif
+
+  for (; quotes && i < len; i++) {
+    if ((dest[out++] = s[i]) == quote) {
+      dest[out++] = quote;
+      quotes--;
+    }
+  }
+  if (i < len)
+    memcpy(dest + out, s + i, len - i);
+  return out + len - i;
+}
+
+static CSV_INLINE size_t
+csv_copy_run(const struct csv_parser *p, unsigned char *dest, const unsigned char *s, size_t len, int quoted)
+{
+  /* Copy the run at the start of s that the FIELD_BEGUN state would simply
+   * add to the current field to dest, return its length.  If dest is NULL
+   * the run is only measured.
+   */
+  const unsigned char *cls = p->classes.cls;
+  unsigned char stop = CL_DELIM | CL_SPACE | CL_TERM;
+  unsigned char set[CSV_SPAN_MAX];
+  unsigned char c;
+  int n = p->classes.nstops;
+  size_t i;
+
+  if (quoted) {
+    /* Only a quote ends a run inside a quoted field */
+    const unsigned char *q;
+    for (i = 0; i < len && i < 16; i++) {
+      if ((c = s[i]) == p->quote_char)
+        return i;
+      if (dest) dest[i] = c;
+    }
+    q = memchr(s + i, p->quote_char, len - i);
+    len = q ? (size_t)(q - s) : len;
+    if (dest) memcpy(dest + i, s + i, len - i);
+    return len;
+  }
+
+  /* Quotes inside a non-quoted field are ordinary data unless in strict mode */
+  if (p->options & CSV_STRICT)
+    stop |= CL_QUOTE;
+
+  /* Most fields are short, copy the first bytes directly before paying for
+     the vector setup */
+  for (i = 0; i < len && i < 16; i++) {
+    c = s[i];
+    if (cls[c] & stop)
+      return i;
+    if (dest) dest[i] = c;
+  }
+
+  if (n < 0 || n + ((stop & CL_QUOTE) != 0) > CSV_SPAN_MAX) {
+    /* Too many kinds of bytes end the run to scan for them in parallel */
+    for (; i < len && !(cls[c = s[i]] & stop); i++)
+      if (dest) dest[i] = c;
+    return i;
+  }
+
+  memcpy(set, p->classes.stops, (size_t)n);
+  if (stop & CL_QUOTE)
+    set[n++] = p->quote_char;
+
+  len = i + csv_span(s + i, len - i, set, n);
+  if (dest) memcpy(dest + i, s + i, len - i);
+  return len;
+}
+
+static size_t
+csv_scan_row(const struct csv_parser *p, const unsigned char *s, size_t pos, size_t len, int *pstate, int *quoted,
+             size_t *spaces)
+{
+  /* Move over the current row up to the byte that ends it, or the end of
+   * the input, going through the states the parser would but ignoring the
+   * data.  Without CSV_STRICT only the quotes that begin and end fields
+   * matter, the rest of each field is skipped with a memchr or vector
+   * scan.  Returns the new position.
+   */
+  const unsigned char *cls = p->classes.cls;
+  const unsigned char *q;
+  unsigned char cl;
+  int state = *pstate, qu = *quoted;
+  size_t sp = *spaces;
+
+  while (pos < len && state != ROW_NOT_BEGUN) {
+    cl = cls[s[pos]];
+    if (state == FIELD_NOT_BEGUN) {
+      if ((cl & CL_TERM) && !((cl & CL_SPACE) && !(cl & CL_DELIM)))
         break;
-      case FIELD_BEGUN:
-        if (c == quote) {         /* Quote */
-          if (quoted) {
-            SUBMIT_CHAR(p, c);
-            pstate = FIELD_MIGHT_HAVE_ENDED;
-          } else {
-            /* STRICT ERROR - double quote inside non-quoted field */
-            if (p->options & CSV_STRICT) {
-              p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-              return pos-1;
-            }
-            SUBMIT_CHAR(p, c);
-            spaces = 0;
-          }
-        } else if (c == delim) {  /* Comma */
-          if (quoted) {
-            SUBMIT_CHAR(p, c);
-          } else {
-            SUBMIT_FIELD(p);
-          }
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
-          if (!quoted) {
-            SUBMIT_FIELD(p);
-            SUBMIT_ROW(p, c);
-          } else {
-            SUBMIT_CHAR(p, c);
-          }
-        } else if (!quoted && (is_space? is_space(c) : c == CSV_SPACE || c == CSV_TAB)) { /* Tab or space for non-quoted field */
-            SUBMIT_CHAR(p, c);
-            spaces++;
-        } else {  /* Anything else */
-          SUBMIT_CHAR(p, c);
-          spaces = 0;
-        }
+      if ((cl & CL_QUOTE) && !(cl & (CL_SPACE | CL_DELIM)))
+        state = FIELD_BEGUN, qu = 1;
+      else if (!(cl & (CL_SPACE | CL_DELIM)))
+        state = FIELD_BEGUN, qu = 0;
+      pos++;
+    } else if (state == FIELD_BEGUN && qu) {
+      if ((q = memchr(s + pos, p->quote_char, len - pos)) == NULL)
+        pos = len;
+      else
+        pos = (size_t)(q - s) + 1, state = FIELD_MIGHT_HAVE_ENDED, sp = 0;
+    } else if (state == FIELD_BEGUN) {
+      /* Quotes are ordinary data here, spaces only matter to the field */
+      if ((cl & (CL_DELIM | CL_TERM)) && !(cl & CL_QUOTE)) {
+        if (!(cl & CL_DELIM))
+          break;
+        state = FIELD_NOT_BEGUN, qu = 0;
+        pos++;
+      } else {
+        pos++;
+        pos += csv_copy_run(p, NULL, s + pos, len - pos, 0);
+      }
+    } else {  /* FIELD_MIGHT_HAVE_ENDED */
+      if (cl & CL_DELIM)
+        state = FIELD_NOT_BEGUN, qu = 0;
+      else if (cl & CL_TERM)
         break;
-      case FIELD_MIGHT_HAVE_ENDED:
-        /* This only happens when a quote character is encountered in a quoted field */
-        if (c == delim) {  /* Comma */
-          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
-          SUBMIT_FIELD(p);
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
-          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
-          SUBMIT_FIELD(p);
+      else if (cl & CL_SPACE)
+        sp++;
+      else if ((cl & CL_QUOTE) && sp)
+        sp = 0;  /* Kept as data, the field may still end here */
+      else
+        state = FIELD_BEGUN, sp = 0;
+      pos++;
+    }
+  }
+
+  *pstate = state;
+  *quoted = qu;
+  *spaces = state == FIELD_MIGHT_HAVE_ENDED ? sp : 0;
+  return pos;
+}
+
+/* Once no more columns of the row are wanted, move to the end of the row
+   without going through the state machine for every field */
+#define SKIP_ROW_REST(p) \
+  if (skip_field && (p)->column >= (p)->columns_size && pstate != ROW_NOT_BEGUN && \
+      !((p)->options & CSV_STRICT)) { \
+    size_t end = csv_scan_row(p, us, pos, len, &pstate, &quoted, &spaces); \
+    if (end != pos) { \
+      pos = end; \
+      entry_pos = pstate == FIELD_MIGHT_HAVE_ENDED ? spaces + 1 : 0; \
+      continue; \
+    } \
+  }
+
+static int
+csv_reserve_entry(struct csv_parser *p, size_t n)
+{
+  /* Grow the entry buffer until it holds n bytes and a null byte */
+  while (p->entry_size < n + 1)
+    if (csv_increase_buffer(p) != 0)
+      return -1;
+  return 0;
+}
+
+static int
+csv_zc_copy(struct csv_parser *p, const unsigned char *zc_start, size_t entry_pos)
+{
+  /* Copy the part of a zero-copy field read so far into the entry buffer,
+   * needed when the field spans calls to csv_parse or must be unescaped
+   */
+  if (csv_reserve_entry(p, entry_pos) != 0)
+    return -1;
+
+  memcpy(p->entry_buf, zc_start, entry_pos);
+  return 0;
+}
+
+/* Actions of the table-driven parser core, each also sets the next state */
+#define OP_SKIP         0   /* Space before a field, ignored */
+#define OP_EMPTY_ROW    1   /* Terminator with no row in progress */
+#define OP_END_ROW      2   /* Terminator ends the field and the row */
+#define OP_END_FIELD    3   /* Delimiter ends the field */
+#define OP_BEGIN_QUOTED 4   /* Quote begins a quoted field */
+#define OP_BEGIN        5   /* Other byte begins a non-quoted field */
+#define OP_ADD          6   /* Delimiter or terminator inside a quoted field */
+#define OP_CHAR         7   /* Ordinary byte inside a field */
+#define OP_SPACE        8   /* Space that is removed if it ends the field */
+#define OP_BARE_QUOTE   9   /* Quote inside a non-quoted field */
+#define OP_QUOTE        10  /* Quote inside a quoted field, the field might end */
+#define OP_CLOSE_FIELD  11  /* Delimiter after the closing quote */
+#define OP_CLOSE_ROW    12  /* Terminator after the closing quote */
+#define OP_QUOTE_AFTER  13  /* Quote after a quote, escaped quote or error */
+#define OP_AFTER_CLOSE  14  /* Other byte after a quote */
+
+/* Action for each state and byte class, the state is pstate with quoted in
+   bit 2 and the class the CL_* bits of the byte.  Where a byte is in several
+   classes, the action is the one the switch-based core would take */
+static const unsigned char csv_actions[8 * 16] = {
+  /* ROW_NOT_BEGUN */
+  OP_BEGIN, OP_END_FIELD, OP_BEGIN_QUOTED, OP_END_FIELD,
+  OP_SKIP, OP_END_FIELD, OP_SKIP, OP_END_FIELD,
+  OP_EMPTY_ROW, OP_EMPTY_ROW, OP_EMPTY_ROW, OP_EMPTY_ROW,
+  OP_SKIP, OP_EMPTY_ROW, OP_SKIP, OP_EMPTY_ROW,
+  /* FIELD_NOT_BEGUN */
+  OP_BEGIN, OP_END_FIELD, OP_BEGIN_QUOTED, OP_END_FIELD,
+  OP_SKIP, OP_END_FIELD, OP_SKIP, OP_END_FIELD,
+  OP_END_ROW, OP_END_ROW, OP_END_ROW, OP_END_ROW,
+  OP_SKIP, OP_END_ROW, OP_SKIP, OP_END_ROW,
+  /* FIELD_BEGUN */
+  OP_CHAR, OP_END_FIELD, OP_BARE_QUOTE, OP_BARE_QUOTE,
+  OP_SPACE, OP_END_FIELD, OP_BARE_QUOTE, OP_BARE_QUOTE,
+  OP_END_ROW, OP_END_FIELD, OP_BARE_QUOTE, OP_BARE_QUOTE,
+  OP_END_ROW, OP_END_FIELD, OP_BARE_QUOTE, OP_BARE_QUOTE,
+  /* Unused, FIELD_MIGHT_HAVE_ENDED is always quoted */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* Unused, fields that have not begun are not quoted */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* FIELD_BEGUN, quoted */
+  OP_CHAR, OP_ADD, OP_QUOTE, OP_QUOTE,
+  OP_CHAR, OP_ADD, OP_QUOTE, OP_QUOTE,
+  OP_ADD, OP_ADD, OP_QUOTE, OP_QUOTE,
+  OP_ADD, OP_ADD, OP_QUOTE, OP_QUOTE,
+  /* FIELD_MIGHT_HAVE_ENDED */
+  OP_AFTER_CLOSE, OP_CLOSE_FIELD, OP_QUOTE_AFTER, OP_CLOSE_FIELD,
+  OP_SPACE, OP_CLOSE_FIELD, OP_SPACE, OP_CLOSE_FIELD,
+  OP_CLOSE_ROW, OP_CLOSE_FIELD, OP_CLOSE_ROW, OP_CLOSE_FIELD,
+  OP_CLOSE_ROW, OP_CLOSE_FIELD, OP_CLOSE_ROW, OP_CLOSE_FIELD
+};
+
+static size_t
+csv_parse_dfa(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+              struct csv_sink *sink)
+{
+  /* Table-driven parser core used with CSV_DFA, it produces the same results
+   * as the switch-based core but dispatches on one table lookup per byte
+   * instead of a chain of tests that depend on the data
+   */
+  unsigned const char *us = s;
+  unsigned char c;
+  size_t pos = 0;
+  size_t run;
+  const unsigned char *cls = p->classes.cls;
+  int quoted = p->quoted;
+  int pstate = p->pstate;
+  size_t spaces = p->spaces;
+  size_t entry_pos = p->entry_pos;
+  int zero_copy = (p->options & CSV_ZERO_COPY) && !(p->options & CSV_APPEND_NULL);
+  unsigned const char *zc_start = NULL;
+  size_t zc_pos = 0;
+  int zc_state = ROW_NOT_BEGUN;
+  int projecting = p->columns != NULL;
+  int skip_field = projecting && !CSV_SELECTED(p, p->column);
+
+  if (skip_field && (pstate == FIELD_BEGUN || pstate == FIELD_MIGHT_HAVE_ENDED))
+    zc_start = us;
+
+  if (!p->entry_buf && pos < len) {
+    if (csv_increase_buffer(p) != 0) {
+      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+      return pos;
+    }
+  }
+
+  while (pos < len && !(sink && sink->stop)) {
+    SKIP_ROW_REST(p);
+    if (pstate == FIELD_BEGUN) {
+      size_t room = p->entry_size - 1 - entry_pos;
+      if (zc_start)
+        run = csv_copy_run(p, NULL, us + pos, len - pos, quoted);
+      else
+        run = csv_copy_run(p, p->entry_buf + entry_pos, us + pos, room < len - pos ? room : len - pos, quoted);
+      if (run) {
+        entry_pos += run;
+        pos += run;
+        spaces = 0;
+        continue;
+      }
+    }
+
+    /* The last byte is kept for CSV_APPEND_NULL even while it is off, a
+     * field scanned by csv_scan may be finished with it on */
+    if (!zc_start && entry_pos == p->entry_size - 1) {
+      if (csv_increase_buffer(p) != 0) {
+        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+        return pos;
+      }
+    }
+
+    c = us[pos++];
+
+    switch (csv_actions[(pstate | quoted << 2) << 4 | cls[c]]) {
+      case OP_SKIP:
+        break;
+      case OP_EMPTY_ROW:
+        if (p->options & CSV_REPALL_NL)
           SUBMIT_ROW(p, c);
-        } else if (is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) {  /* Space or Tab */
-          SUBMIT_CHAR(p, c);
-          spaces++;
-        } else if (c == quote) {  /* Quote */
-          if (spaces) {
-            /* STRICT ERROR - unescaped double quote */
-            if (p->options & CSV_STRICT) {
-              p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-              return pos-1;
-            }
-            spaces = 0;
-            SUBMIT_CHAR(p, c);
-          } else {
-            /* Two quotes in a row */
-            pstate = FIELD_BEGUN;
-          }
-        } else {  /* Anything else */
-          /* STRICT ERROR - unescaped double quote */
+        break;
+      case OP_END_ROW:
+        SUBMIT_FIELD(p);
+        SUBMIT_ROW(p, c);
+        break;
+      case OP_END_FIELD:
+        SUBMIT_FIELD(p);
+        break;
+      case OP_BEGIN_QUOTED:
+        BEGIN_FIELD(p, pos);
+        quoted = 1;
+        break;
+      case OP_BEGIN:
+        BEGIN_FIELD(p, pos - 1);
+        quoted = 0;
+        SUBMIT_CHAR(p, c);
+        break;
+      case OP_ADD:
+        SUBMIT_CHAR(p, c);
+        break;
+      case OP_CHAR:
+        SUBMIT_CHAR(p, c);
+        spaces = 0;
+        break;
+      case OP_SPACE:
+        SUBMIT_CHAR(p, c);
+        spaces++;
+        break;
+      case OP_BARE_QUOTE:
+        if (p->options & CSV_STRICT) {
+          p->status = CSV_EPARSE;
+          ZC_SAVE(p);
+          p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+          return pos-1;
+        }
+        SUBMIT_CHAR(p, c);
+        spaces = 0;
+        break;
+      case OP_QUOTE:
+        SUBMIT_CHAR(p, c);
+        pstate = FIELD_MIGHT_HAVE_ENDED;
+        break;
+      case OP_CLOSE_FIELD:
+        entry_pos -= spaces + 1;
+        SUBMIT_FIELD(p);
+        break;
+      case OP_CLOSE_ROW:
+        entry_pos -= spaces + 1;
+        SUBMIT_FIELD(p);
+        SUBMIT_ROW(p, c);
+        break;
+      case OP_QUOTE_AFTER:
+        if (spaces) {
           if (p->options & CSV_STRICT) {
             p->status = CSV_EPARSE;
+            ZC_SAVE(p);
             p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
             return pos-1;
           }
-          pstate = FIELD_BEGUN;
           spaces = 0;
           SUBMIT_CHAR(p, c);
+        } else {
+          if (zc_start && !skip_field) {
+            ZC_SAVE(p);
+            zc_start = NULL;
+          }
+          pstate = FIELD_BEGUN;
         }
         break;
-     default:
-       break;
+      case OP_AFTER_CLOSE:
+        if (p->options & CSV_STRICT) {
+          p->status = CSV_EPARSE;
+          ZC_SAVE(p);
+          p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+          return pos-1;
+        }
+        pstate = FIELD_BEGUN;
+        spaces = 0;
+        SUBMIT_CHAR(p, c);
+        break;
+    }
+  }
+  ZC_SAVE(p);
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  return pos;
+}
+
+static CSV_INLINE size_t
+csv_parse_sink(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+               struct csv_sink *sink)
+{
+  assert(p && "received null csv_parser");
+
+  if (s == NULL) return 0;
+
+  
+  unsigned const char *us = s;  /* Access input data as array of unsigned char */
+  unsigned char c;              /* The character we are currently processing */
+  size_t pos = 0;               /* The number of characters we have processed in this call */
+  size_t run;                   /* Length of a run of ordinary field bytes */
+
+  /* Store key fields into local variables for performance */
+  const unsigned char *cls;     /* Class of each byte, see csv_build_classes */
+  unsigned char cl;             /* Class of the character we are processing */
+  int quoted = p->quoted;
+  int pstate = p->pstate;
+  size_t spaces = p->spaces;
+  size_t entry_pos = p->entry_pos;
+
+  /* Zero-copy state, zc_start points to the start of the current field in s
+     while it does not need to be copied */
+  int zero_copy = (p->options & CSV_ZERO_COPY) && !(p->options & CSV_APPEND_NULL);
+  unsigned const char *zc_start = NULL;
+  size_t zc_pos = 0;            /* Offset of the byte that began the field */
+  int zc_state = ROW_NOT_BEGUN; /* State before the field began */
+
+  /* Fields of columns left out of the projection are scanned like zero-copy
+     fields but never copied or delivered */
+  int projecting = p->columns != NULL;
+  int skip_field = projecting && !CSV_SELECTED(p, p->column);
+
+  CHECK_CLASSES(p);
+  cls = p->classes.cls;
+
+  if (p->options & CSV_DFA)
+    return csv_parse_dfa(p, s, len, cb1, cb2, data, sink);
+
+  if (skip_field && (pstate == FIELD_BEGUN || pstate == FIELD_MIGHT_HAVE_ENDED))
+    zc_start = us;
+
+  if (!p->entry_buf && pos < len) {
+    /* Buffer hasn't been allocated yet and len > 0 */
+    if (csv_increase_buffer(p) != 0) { 
+      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+      return pos;
+    }
+  }
+
+  while (pos < len && !(sink && sink->stop)) {
+    SKIP_ROW_REST(p);
+    if (pstate == FIELD_BEGUN) {
+      /* Copy a run of ordinary field bytes in one step instead of going
+         through the state machine for each one */
+      size_t room = p->entry_size - 1 - entry_pos;
+      if (zc_start)
+        run = csv_copy_run(p, NULL, us + pos, len - pos, quoted);
+      else
+        run = csv_copy_run(p, p->entry_buf + entry_pos, us + pos, room < len - pos ? room : len - pos, quoted);
+      if (run) {
+        entry_pos += run;
+        pos += run;
+        spaces = 0;
+        continue;
+      }
+    }
+
+    /* Check memory usage, increase buffer if necessary */
+    if (!zc_start && entry_pos == p->entry_size - 1) {
+      if (csv_increase_buffer(p) != 0) {
+        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+        return pos;
+      }
+    }
+
+    c = us[pos++];
+    cl = cls[c];
+
+    switch (pstate) {
+      case ROW_NOT_BEGUN:
+      case FIELD_NOT_BEGUN:
+        if ((cl & CL_SPACE) && !(cl & CL_DELIM)) { /* Space or Tab */
+          continue;
+        } else if (cl & CL_TERM) { /* Carriage Return or Line Feed */
+          if (pstate == FIELD_NOT_BEGUN) {
+            SUBMIT_FIELD(p);
+            SUBMIT_ROW(p, c); 
+          } else {  /* ROW_NOT_BEGUN */
+            /* Don't submit empty rows by default */
+            if (p->options & CSV_REPALL_NL) {
+              SUBMIT_ROW(p, c);
+            }
+          }
+          continue;
+        } else if (cl & CL_DELIM) { /* Comma */
+          SUBMIT_FIELD(p);
+          break;
+        } else if (cl & CL_QUOTE) { /* Quote */
+          BEGIN_FIELD(p, pos);
+          quoted = 1;
+        } else {               /* Anything else */
+          BEGIN_FIELD(p, pos - 1);
+          quoted = 0;
+          SUBMIT_CHAR(p, c);
+        }
+        break;
+      case FIELD_BEGUN:
+        if (cl & CL_QUOTE) {      /* Quote */
+          if (quoted) {
+            SUBMIT_CHAR(p, c);
+            pstate = FIELD_MIGHT_HAVE_ENDED;
+          } else {
+            /* STRICT ERROR - double quote inside non-quoted field */
+            if (p->options & CSV_STRICT) {
+              p->status = CSV_EPARSE;
+              ZC_SAVE(p);
+              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+              return pos-1;
+            }
+            SUBMIT_CHAR(p, c);
+            spaces = 0;
+          }
+        } else if (cl & CL_DELIM) {  /* Comma */
+          if (quoted) {
+            SUBMIT_CHAR(p, c);
+          } else {
+            SUBMIT_FIELD(p);
+          }
+        } else if (cl & CL_TERM) {  /* Carriage Return or Line Feed */
+          if (!quoted) {
+            SUBMIT_FIELD(p);
+            SUBMIT_ROW(p, c);
+          } else {
+            SUBMIT_CHAR(p, c);
+          }
+        } else if (!quoted && (cl & CL_SPACE)) { /* Tab or space for non-quoted field */
+            SUBMIT_CHAR(p, c);
+            spaces++;
+        } else {  /* Anything else */
+          SUBMIT_CHAR(p, c);
+          spaces = 0;
+        }
+        break;
+      case FIELD_MIGHT_HAVE_ENDED:
+        /* This only happens when a quote character is encountered in a quoted field */
+        if (cl & CL_DELIM) {  /* Comma */
+          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
+          SUBMIT_FIELD(p);
+        } else if (cl & CL_TERM) {  /* Carriage Return or Line Feed */
+          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
+          SUBMIT_FIELD(p);
+          SUBMIT_ROW(p, c);
+        } else if (cl & CL_SPACE) {  /* Space or Tab */
+          SUBMIT_CHAR(p, c);
+          spaces++;
+        } else if (cl & CL_QUOTE) {  /* Quote */
+          if (spaces) {
+            /* STRICT ERROR - unescaped double quote */
+            if (p->options & CSV_STRICT) {
+              p->status = CSV_EPARSE;
+              ZC_SAVE(p);
+              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+              return pos-1;
+            }
+            spaces = 0;
+            SUBMIT_CHAR(p, c);
+          } else {
+            /* Two quotes in a row, the field no longer matches the input */
+            if (zc_start && !skip_field) {
+              ZC_SAVE(p);
+              zc_start = NULL;
+            }
+            pstate = FIELD_BEGUN;
+          }
+        } else {  /* Anything else */
+          /* STRICT ERROR - unescaped double quote */
+          if (p->options & CSV_STRICT) {
+            p->status = CSV_EPARSE;
+            ZC_SAVE(p);
+            p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+            return pos-1;
+          }
+          pstate = FIELD_BEGUN;
+          spaces = 0;
+          SUBMIT_CHAR(p, c);
+        }
+        break;
+     default:
+       break;
+    }
+  }
+  ZC_SAVE(p);
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  return pos;
+}
+
+static size_t
+csv_skip_rest(struct csv_parser *p, const void *s, size_t len)
+{
+  /* Finish the row csv_skip_rows stopped in without delivering it,
+     returns the number of bytes skipped */
+  size_t rows = 1;
+
+  if (!p->skip_rest || s == NULL)
+    return 0;
+  return csv_skip_rows(p, s, len, &rows);
+}
+
+static size_t
+csv_parse_counted(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *),
+                  void *data, struct csv_sink *sink)
+{
+  /* Parse into the callbacks or sink while keeping the statistics, kept
+     apart so that parsers without statistics pay nothing for them */
+  struct csv_counted counted;
+  struct csv_sink counting;
+  size_t pos, skipped;
+
+  pos = csv_skip_rest(p, s, len);
+  if (!p->skip_rest) {
+    /* Offsets passed on to sink count the bytes of the skipped row too */
+    csv_counting_sink(&counting, &counted, p, cb1, cb2, data, sink);
+    counting.offset += pos;
+    skipped = pos;
+    pos += csv_parse_sink(p, (const unsigned char *)s + pos, len - pos, NULL, NULL, NULL, &counting);
+    if (sink)
+      sink->offset = counting.offset - skipped;
+  }
+  p->stats->bytes += pos;
+  if (pos < len && p->status == CSV_EPARSE)
+    p->stats->strict_errors++;
+  return pos;
+}
+
+size_t
+csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  size_t pos;
+
+  assert(p && "received null csv_parser");
+
+  if (s == NULL)
+    return 0;
+  if (p->stats)
+    return csv_parse_counted(p, s, len, cb1, cb2, data, NULL);
+  pos = csv_skip_rest(p, s, len);
+  if (p->skip_rest)
+    return pos;
+  return pos + csv_parse_sink(p, (const unsigned char *)s + pos, len - pos, cb1, cb2, data, NULL);
+}
+
+static size_t
+csv_parse_to(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+             struct csv_sink *sink)
+{
+  /* Parse into sink if there is one, for callers that take either */
+  size_t pos, n;
+
+  if (!sink)
+    return csv_parse(p, s, len, cb1, cb2, data);
+  if (!sink->field && !sink->row)
+    return csv_validate(p, s, len);
+  if (p->stats)
+    return csv_parse_counted(p, s, len, NULL, NULL, NULL, sink);
+  pos = csv_skip_rest(p, s, len);
+  if (p->skip_rest)
+    return pos;
+  /* Offsets passed to sink count the bytes of the skipped row too */
+  sink->offset += pos;
+  n = csv_parse_sink(p, (const unsigned char *)s + pos, len - pos, NULL, NULL, NULL, sink);
+  sink->offset -= pos;
+  return pos + n;
+}
+
+size_t
+csv_validate(struct csv_parser *p, const void *s, size_t len)
+{
+  /* Check s as csv_parse does with CSV_STRICT without keeping any fields,
+   * moving from one quote, delimiter or terminator to the next.  Returns the
+   * number of bytes processed, which is the offset of the offending byte if
+   * the data is malformed.
+   */
+  const unsigned char *us = s;
+  const unsigned char *cls;
+  struct csv_marks m;
+  unsigned char cl;
+  int pstate, quoted;
+  size_t spaces, entry_pos, pos = 0;
+
+  assert(p && "received null csv_parser");
+
+  if (s == NULL)
+    return 0;
+
+  CHECK_CLASSES(p);
+  cls = p->classes.cls;
+  csv_marks_init(p, &m);
+  pstate = p->pstate;
+  quoted = p->quoted;
+  spaces = p->spaces;
+
+  while (pos < len) {
+    switch (pstate) {
+      case ROW_NOT_BEGUN:
+      case FIELD_NOT_BEGUN:
+        cl = cls[us[pos++]];
+        if ((cl & CL_SPACE) && !(cl & CL_DELIM))
+          ;
+        else if (cl & CL_TERM)
+          pstate = ROW_NOT_BEGUN;
+        else if (cl & CL_DELIM)
+          pstate = FIELD_NOT_BEGUN;
+        else
+          pstate = FIELD_BEGUN, quoted = (cl & CL_QUOTE) != 0;
+        break;
+      case FIELD_BEGUN:
+        if (quoted) {
+          /* Only a quote can end a quoted field */
+          pos = csv_next_mark(p, us, len, pos, &m, CL_QUOTE);
+          if (pos < len)
+            pos++, pstate = FIELD_MIGHT_HAVE_ENDED, spaces = 0;
+          break;
+        }
+        pos = csv_next_mark(p, us, len, pos, &m, CL_QUOTE | CL_DELIM | CL_TERM);
+        if (pos == len)
+          break;
+        cl = cls[us[pos]];
+        if (cl & CL_QUOTE)
+          goto malformed;  /* Quote inside a non-quoted field */
+        pstate = (cl & CL_DELIM) ? FIELD_NOT_BEGUN : ROW_NOT_BEGUN;
+        pos++;
+        break;
+      case FIELD_MIGHT_HAVE_ENDED:
+        cl = cls[us[pos]];
+        if (cl & CL_DELIM)
+          pstate = FIELD_NOT_BEGUN, quoted = 0;
+        else if (cl & CL_TERM)
+          pstate = ROW_NOT_BEGUN, quoted = 0;
+        else if (cl & CL_SPACE)
+          spaces++;
+        else if ((cl & CL_QUOTE) && !spaces)
+          pstate = FIELD_BEGUN;  /* Escaped quote */
+        else
+          goto malformed;  /* Unescaped quote or data after the closing quote */
+        pos++;
+        break;
+    }
+  }
+
+  /* No field is kept, the entry only counts the closing quote and the
+     spaces after it for csv_fini to take off again */
+  entry_pos = pstate == FIELD_MIGHT_HAVE_ENDED ? spaces + 1 : 0;
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  return pos;
+
+malformed:
+  p->status = CSV_EPARSE;
+  entry_pos = pstate == FIELD_MIGHT_HAVE_ENDED ? spaces + 1 : 0;
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  return pos;
+}
+
+int
+csv_batch_init(struct csv_batch *b, size_t max_rows, size_t max_cols)
+{
+  /* Initialize a batch holding up to max_rows rows of max_cols columns,
+     returns 0 on success, -1 on error */
+  size_t cells;
+
+  if (b == NULL || max_rows == 0 || max_cols == 0 || max_rows > SIZE_MAX / max_cols)
+    return -1;
+
+  cells = max_rows * max_cols;
+  b->max_rows = max_rows;
+  b->max_cols = max_cols;
+  b->values = NULL;
+  b->values_size = 0;
+  b->offsets = cells <= SIZE_MAX / sizeof *b->offsets ? malloc(cells * sizeof *b->offsets) : NULL;
+  b->lengths = cells <= SIZE_MAX / sizeof *b->lengths ? malloc(cells * sizeof *b->lengths) : NULL;
+  b->nulls = malloc(cells);
+  b->ncols = max_rows <= SIZE_MAX / sizeof *b->ncols ? malloc(max_rows * sizeof *b->ncols) : NULL;
+
+  if (!b->offsets || !b->lengths || !b->nulls || !b->ncols) {
+    csv_batch_free(b);
+    return -1;
+  }
+
+  b->rows = b->col = b->values_used = 0;
+  return 0;
+}
+
+void
+csv_batch_clear(struct csv_batch *b)
+{
+  /* Remove the complete rows from the batch so it can be filled again, the
+     fields of a row still being parsed are kept as the first row */
+  size_t keep, base, col;
+
+  if (b == NULL || b->offsets == NULL)
+    return;
+
+  keep = b->col < b->max_cols ? b->col : b->max_cols;
+  base = keep ? b->offsets[b->rows] : b->values_used;
+
+  for (col = 0; col < keep; col++) {
+    size_t from = col * b->max_rows + b->rows, to = col * b->max_rows;
+    b->offsets[to] = b->offsets[from] - base;
+    b->lengths[to] = b->lengths[from];
+    b->nulls[to] = b->nulls[from];
+  }
+
+  if (base < b->values_used)
+    memmove(b->values, b->values + base, b->values_used - base);
+  b->values_used -= base;
+  b->rows = 0;
+}
+
+void
+csv_batch_free(struct csv_batch *b)
+{
+  /* Free the memory allocated for the batch */
+  if (b == NULL)
+    return;
+
+  free(b->values);
+  free(b->offsets);
+  free(b->lengths);
+  free(b->nulls);
+  free(b->ncols);
+  b->values = NULL;
+  b->offsets = b->lengths = b->ncols = NULL;
+  b->nulls = NULL;
+  b->values_size = b->values_used = 0;
+  b->rows = b->col = 0;
+}
+
+size_t
+csv_parse_batch(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b)
+{
+  /* Parse rows into the batch until it is full or the data is used up,
+     returns the number of bytes processed */
+  struct csv_sink sink;
+  size_t pos;
+
+  assert(p && "received null csv_parser");
+
+  if (b == NULL || b->rows == b->max_rows)
+    return 0;
+
+  sink.field = csv_batch_field;
+  sink.row = csv_batch_row;
+  sink.data = b;
+  sink.stop = 0;
+  sink.status = 0;
+
+  pos = csv_parse_to(p, s, len, NULL, NULL, NULL, &sink);
+  if (sink.status)
+    p->status = sink.status;
+  return pos;
+}
+
+int
+csv_fini_batch(struct csv_parser *p, struct csv_batch *b)
+{
+  /* Finish the last row into the batch, which must have room for it */
+  struct csv_sink sink;
+
+  if (p == NULL || b == NULL)
+    return -1;
+  if (p->pstate != ROW_NOT_BEGUN && b->rows == b->max_rows)
+    return -1;
+
+  sink.field = csv_batch_field;
+  sink.row = csv_batch_row;
+  sink.data = b;
+  sink.stop = 0;
+  sink.status = 0;
+
+  if (csv_fini_sink(p, NULL, NULL, NULL, &sink) != 0)
+    return -1;
+  if (sink.status) {
+    p->status = sink.status;
+    return -1;
+  }
+  return 0;
+}
+
+/* The event csv_next is looking for */
+struct csv_pulled {
+  const unsigned char *field;
+  size_t len;
+  int c;
+  int fields;   /* A field was read */
+  int rows;     /* A row ended */
+};
+
+static void
+csv_pulled_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  struct csv_pulled *ev = sink->data;
+
+  ev->field = field;
+  ev->len = len;
+  ev->fields = 1;
+  sink->stop = 1;
+}
+
+static void
+csv_pulled_row(struct csv_sink *sink, int c, size_t pos)
+{
+  struct csv_pulled *ev = sink->data;
+
+  (void)pos;
+  ev->c = c;
+  ev->rows = 1;
+  sink->stop = 1;
+}
+
+int
+csv_feed(struct csv_parser *p, const void *s, size_t len)
+{
+  /* Give csv_next the len bytes at s to parse, or mark the end of the input
+   * if s is NULL.  Whatever was left of the previous input is dropped.
+   * Returns 0 on success, -1 on error.
+   */
+  if (p == NULL)
+    return -1;
+  if (s == NULL) {
+    if (!p->next_end)
+      p->next_end = 1;
+    p->next_input = NULL;
+    p->next_len = p->next_pos = 0;
+    return 0;
+  }
+  p->next_input = s;
+  p->next_len = len;
+  p->next_pos = 0;
+  p->next_end = 0;
+  return 0;
+}
+
+int
+csv_next(struct csv_parser *p, const void **field, size_t *len, int *c)
+{
+  /* Parse up to the next field or the end of a row and return which,
+   * CSV_EVENT_NEED_INPUT once the input given to csv_feed is used up or
+   * CSV_EVENT_END once its end was reached.  A field is stored in *field
+   * and *len, valid until the next call, and the character that ended a row
+   * in *c, -1 at the end of the input.
+   */
+  struct csv_pulled ev;
+  struct csv_sink sink;
+  size_t left, n;
+  int rc;
+
+  if (p == NULL)
+    return CSV_EVENT_ERROR;
+
+  if (p->next_row) {
+    /* The row ended by the byte that ended the last field */
+    p->next_row = 0;
+    if (c)
+      *c = p->next_c;
+    return CSV_EVENT_ROW;
+  }
+
+  ev.fields = ev.rows = 0;
+  sink.field = csv_pulled_field;
+  sink.row = csv_pulled_row;
+  sink.data = &ev;
+  sink.stop = 0;
+  sink.status = 0;
+  sink.offset = 0;
+
+  if (p->next_pos < p->next_len) {
+    /* Parsing stops after the byte that ended the field or row */
+    left = p->next_len - p->next_pos;
+    n = csv_parse_to(p, p->next_input + p->next_pos, left, NULL, NULL, NULL, &sink);
+    p->next_pos += n;
+    if (!ev.fields && !ev.rows)
+      return n < left ? CSV_EVENT_ERROR : CSV_EVENT_NEED_INPUT;
+  } else if (p->next_end == 1) {
+    /* Deliver the last field and row, keeping the buffer in place for it */
+    p->next_end = 2;
+    n = p->shrink_size;
+    p->shrink_size = 0;
+    rc = csv_fini_sink(p, NULL, NULL, NULL, &sink);
+    p->shrink_size = n;
+    if (rc != 0)
+      return CSV_EVENT_ERROR;
+    if (!ev.fields && !ev.rows)
+      return CSV_EVENT_END;
+  } else {
+    return p->next_end ? CSV_EVENT_END : CSV_EVENT_NEED_INPUT;
+  }
+
+  if (ev.fields) {
+    if (field)
+      *field = ev.field;
+    if (len)
+      *len = ev.len;
+    p->next_row = ev.rows;
+    p->next_c = ev.c;
+    return CSV_EVENT_FIELD;
+  }
+  if (c)
+    *c = ev.c;
+  return CSV_EVENT_ROW;
+}
+
+size_t
+csv_next_offset(const struct csv_parser *p)
+{
+  /* Return the number of bytes of the input given to csv_feed that
+     csv_next has parsed, the offset of the offending byte after an error */
+  if (p == NULL)
+    return 0;
+  return p->next_pos;
+}
+
+#ifdef LLONG_MAX  /* The typed API needs long long, see csv.h */
+
+/* Powers of ten that a double holds exactly */
+static const double csv_pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static int
+csv_is_word(const unsigned char *s, size_t len, const char *word)
+{
+  /* Is s the lower case word in any case */
+  size_t i;
+
+  for (i = 0; i < len && word[i]; i++)
+    if ((s[i] >= 'A' && s[i] <= 'Z' ? s[i] + ('a' - 'A') : s[i]) != (unsigned char)word[i])
+      return 0;
+  return i == len && !word[i];
+}
+
+static int
+csv_digits(const unsigned char *s, size_t n, unsigned long *v)
+{
+  /* Decode exactly n decimal digits, returns 0 on success */
+  unsigned long x = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if ((unsigned int)(s[i] - '0') > 9)
+      return -1;
+    x = x * 10 + (s[i] - '0');
+  }
+  *v = x;
+  return 0;
+}
+
+static int
+csv_decode_int64(const unsigned char *s, size_t len, long long *v)
+{
+  /* Decode a decimal integer with an optional sign, returns 0 on success
+     and -1 if s holds anything else or the value does not fit */
+  unsigned long long n = 0;
+  unsigned int d;
+  size_t i = 0;
+  int neg = 0;
+
+  if (len && (s[0] == '-' || s[0] == '+'))
+    neg = s[i++] == '-';
+  if (i == len)
+    return -1;
+  while (i < len - 1 && s[i] == '0')
+    i++;
+  if (len - i > 19)
+    return -1;
+  for (; i < len; i++) {
+    if ((d = (unsigned int)(s[i] - '0')) > 9)
+      return -1;
+    n = n * 10 + d;
+  }
+  if (n > (unsigned long long)LLONG_MAX + neg)
+    return -1;
+  *v = neg && n ? -(long long)(n - 1) - 1 : (long long)n;
+  return 0;
+}
+
+static int
+csv_decode_double(const unsigned char *s, size_t len, double *v)
+{
+  /* Decode a decimal floating point number, inf, infinity or nan in any
+   * case, with an optional sign and whatever the locale.  Numbers of at
+   * most 19 significant digits are converted with a single multiplication
+   * or division when the mantissa and the power of ten are exact doubles,
+   * which rounds correctly, the others by strtod.  Returns 0 on success.
+   */
+  unsigned long long m = 0;
+  unsigned int d;
+  size_t i = 0, j, digits = 0, nd = 0, plen;
+  long e = 0, x = 0;
+  int neg = 0, xneg = 0, lost = 0, ret;
+  char buf[128], *copy, *end;
+  const char *point;
+  double r;
+
+  if (len && (s[0] == '-' || s[0] == '+'))
+    neg = s[i++] == '-';
+  if (i < len && (unsigned int)(s[i] - '0') > 9 && s[i] != '.') {
+    if (!csv_is_word(s + i, len - i, "inf") && !csv_is_word(s + i, len - i, "infinity") &&
+        !csv_is_word(s + i, len - i, "nan"))
+      return -1;
+    goto slow;
+  }
+
+  for (; i < len && (d = (unsigned int)(s[i] - '0')) <= 9; i++, nd++) {
+    if (digits < 19 && (m || d))
+      m = m * 10 + d, digits++;
+    else if (digits == 19)
+      e++, lost |= d != 0;
+  }
+  if (i < len && s[i] == '.') {
+    for (i++; i < len && (d = (unsigned int)(s[i] - '0')) <= 9; i++, nd++) {
+      if (digits < 19)
+        m = m * 10 + d, digits += m != 0, e--;
+      else
+        lost |= d != 0;
+    }
+  }
+  if (nd == 0)
+    return -1;
+  if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+    if (++i < len && (s[i] == '-' || s[i] == '+'))
+      xneg = s[i++] == '-';
+    if (i == len)
+      return -1;
+    for (; i < len && (d = (unsigned int)(s[i] - '0')) <= 9; i++)
+      if (x < 100000)
+        x = x * 10 + (long)d;
+  }
+  if (i != len)
+    return -1;
+  e += xneg ? -x : x;
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+  if (!lost && m <= (1ULL << 53) && e >= -22 && e <= 22) {
+    r = (double)m;
+    r = e < 0 ? r / csv_pow10[-e] : r * csv_pow10[e];
+    *v = neg ? -r : r;
+    return 0;
+  }
+#endif
+  if (m == 0) {
+    *v = neg ? -0.0 : 0.0;
+    return 0;
+  }
+
+slow:
+  /* strtod wants the decimal point of the locale and a null byte */
+  point = localeconv()->decimal_point;
+  plen = strlen(point);
+  if (len > SIZE_MAX / (plen + 1) - 1)
+    return -1;
+  copy = len * (plen + 1) < sizeof buf ? buf : malloc(len * (plen + 1) + 1);
+  if (copy == NULL)
+    return -1;
+  for (i = j = 0; i < len; i++) {
+    if (s[i] == '.')
+      memcpy(copy + j, point, plen), j += plen;
+    else
+      copy[j++] = (char)s[i];
+  }
+  copy[j] = '\0';
+  r = strtod(copy, &end);
+  ret = end == copy + j ? 0 : -1;
+  if (copy != buf)
+    free(copy);
+  if (ret == 0)
+    *v = r;
+  return ret;
+}
+
+static int
+csv_decode_bool(const unsigned char *s, size_t len, int *v)
+{
+  /* Decode true or false, yes or no, t or f, y or n in any case, or 1 or 0 */
+  static const char *const words[] = {"false", "true", "no", "yes", "f", "t", "n", "y", "0", "1"};
+  size_t i;
+
+  for (i = 0; i < sizeof words / sizeof *words; i++) {
+    if (csv_is_word(s, len, words[i])) {
+      *v = (int)(i & 1);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int
+csv_decode_date(const unsigned char *s, size_t len, long long *v)
+{
+  /* Decode a YYYY-MM-DD date of the Gregorian calendar to the number of
+     days since 1970-01-01 */
+  static const unsigned char mdays[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  unsigned long y, m, d;
+  long era, yoe, doy;
+
+  if (len != 10 || s[4] != '-' || s[7] != '-' || csv_digits(s, 4, &y) != 0 ||
+      csv_digits(s + 5, 2, &m) != 0 || csv_digits(s + 8, 2, &d) != 0)
+    return -1;
+  if (m < 1 || m > 12 || d < 1 || d > mdays[m - 1] ||
+      (m == 2 && d == 29 && (y % 4 || (y % 100 == 0 && y % 400))))
+    return -1;
+
+  /* Count from March so that leap days come last in a year */
+  era = ((long)y - (m <= 2)) < 0 ? -1 : ((long)y - (m <= 2)) / 400;
+  yoe = (long)y - (m <= 2) - era * 400;
+  doy = (long)(153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + (long)d - 1;
+  *v = (long long)era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+  return 0;
+}
+
+static int
+csv_decode_timestamp(const unsigned char *s, size_t len, long long *v)
+{
+  /* Decode YYYY-MM-DD[Thh:mm[:ss[.ffffff]]][Z|+hh:mm|-hh:mm], with a space
+     allowed instead of T, to microseconds since 1970-01-01 UTC */
+  unsigned long h = 0, m = 0, sec = 0, us = 0, oh = 0, om = 0;
+  long long days;
+  long off = 0;
+  size_t i = 10, start;
+
+  if (len < 10 || csv_decode_date(s, 10, &days) != 0)
+    return -1;
+  if (i < len) {
+    if ((s[i] != 'T' && s[i] != 't' && s[i] != ' ') || len - i < 6 || csv_digits(s + i + 1, 2, &h) != 0 ||
+        s[i + 3] != ':' || csv_digits(s + i + 4, 2, &m) != 0)
+      return -1;
+    i += 6;
+    if (i < len && s[i] == ':') {
+      if (len - i < 3 || csv_digits(s + i + 1, 2, &sec) != 0)
+        return -1;
+      i += 3;
+      if (i < len && s[i] == '.') {
+        /* Digits beyond microseconds are dropped */
+        for (start = ++i; i < len && (unsigned int)(s[i] - '0') <= 9; i++)
+          if (i - start < 6)
+            us = us * 10 + (s[i] - '0');
+        if (i == start)
+          return -1;
+        for (start = i - start; start < 6; start++)
+          us *= 10;
+      }
+    }
+    if (i < len && (s[i] == 'Z' || s[i] == 'z')) {
+      i++;
+    } else if (i < len && (s[i] == '+' || s[i] == '-')) {
+      if (len - i < 3 || csv_digits(s + i + 1, 2, &oh) != 0)
+        return -1;
+      start = i;
+      i += 3;
+      if (i < len) {
+        i += s[i] == ':';
+        if (len - i != 2 || csv_digits(s + i, 2, &om) != 0)
+          return -1;
+        i += 2;
+      }
+      if (oh > 23 || om > 59)
+        return -1;
+      off = (long)(oh * 60 + om) * 60;
+      off = s[start] == '-' ? -off : off;
+    }
+    if (i != len || h > 23 || m > 59 || sec > 60)
+      return -1;
+  }
+  *v = (days * 86400 + (long long)(h * 3600 + m * 60 + sec) - off) * 1000000 + (long long)us;
+  return 0;
+}
+
+static void
+csv_decode(int type, const unsigned char *field, size_t len, struct csv_value *v)
+{
+  /* Decode a field as a value of type, empty fields are null unless they
+     are strings */
+  int ret = 0;
+
+  v->type = type;
+  v->str = (const char *)field;
+  v->len = len;
+  v->v.i = 0;
+  if (field == NULL || (len == 0 && type != CSV_TYPE_STRING)) {
+    v->status = CSV_VALUE_NULL;
+    return;
+  }
+
+  switch (type) {
+    case CSV_TYPE_INT64:
+      ret = csv_decode_int64(field, len, &v->v.i);
+      break;
+    case CSV_TYPE_DOUBLE:
+      ret = csv_decode_double(field, len, &v->v.d);
+      break;
+    case CSV_TYPE_BOOL:
+      ret = csv_decode_bool(field, len, &v->v.b);
+      break;
+    case CSV_TYPE_DATE:
+      ret = csv_decode_date(field, len, &v->v.i);
+      break;
+    case CSV_TYPE_TIMESTAMP:
+      ret = csv_decode_timestamp(field, len, &v->v.i);
+      break;
+  }
+  v->status = ret ? CSV_VALUE_INVALID : CSV_VALUE_OK;
+}
+
+int
+csv_schema_init(struct csv_schema *sc, void (*row)(int, void *), void *data)
+{
+  /* Initialize a schema without any columns, row is called at the end of
+     every row and data is passed to all handlers */
+  if (sc == NULL)
+    return -1;
+
+  sc->columns = NULL;
+  sc->ncols = sc->size = 0;
+  sc->selected_size = 0;
+  sc->row = row;
+  sc->data = data;
+  if ((sc->selected = calloc(1, 1)) == NULL)
+    return -1;
+  return 0;
+}
+
+int
+csv_schema_set(struct csv_schema *sc, size_t col, int type, void (*handler)(const struct csv_value *, void *))
+{
+  /* Declare the type of column col and the handler its fields are passed
+     to, returns 0 on success and -1 on error */
+  unsigned char *set;
+  size_t i, n;
+
+  if (sc == NULL || type < CSV_TYPE_SKIP || type > CSV_TYPE_TIMESTAMP || (type != CSV_TYPE_SKIP && handler == NULL))
+    return -1;
+
+  if (col >= sc->ncols) {
+    if (col == SIZE_MAX || csv_reserve((void **)&sc->columns, &sc->size, sc->ncols, col + 1 - sc->ncols,
+                                       sizeof *sc->columns) != 0)
+      return -1;
+    if ((set = realloc(sc->selected, col / 8 + 1)) == NULL)
+      return -1;
+    sc->selected = set;
+    for (i = sc->ncols; i <= col; i++)
+      sc->columns[i].type = CSV_TYPE_SKIP, sc->columns[i].handler = NULL;
+    sc->ncols = col + 1;
+  }
+  sc->columns[col].type = type;
+  sc->columns[col].handler = type == CSV_TYPE_SKIP ? NULL : handler;
+
+  /* The parser's projection delivers the columns that are not skipped */
+  memset(sc->selected, 0, (sc->ncols - 1) / 8 + 1);
+  for (i = n = 0; i < sc->ncols; i++) {
+    if (sc->columns[i].type != CSV_TYPE_SKIP) {
+      sc->selected[i >> 3] |= (unsigned char)(1 << (i & 7));
+      n = i + 1;
+    }
+  }
+  sc->selected_size = n;
+  return 0;
+}
+
+void
+csv_schema_free(struct csv_schema *sc)
+{
+  /* Free the memory allocated for the schema */
+  if (sc == NULL)
+    return;
+
+  free(sc->columns);
+  free(sc->selected);
+  sc->columns = NULL;
+  sc->selected = NULL;
+  sc->ncols = sc->size = sc->selected_size = 0;
+}
+
+/* Parser and schema of csv_parse_typed, the parser tells the column */
+struct csv_typed {
+  struct csv_parser *p;
+  const struct csv_schema *sc;
+};
+
+static void
+csv_typed_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  /* Decode a field of a column that is not skipped and pass it on */
+  struct csv_typed *t = sink->data;
+  const struct csv_column *c = &t->sc->columns[t->p->column];
+  struct csv_value v;
+
+  csv_decode(c->type, field, len, &v);
+  v.col = t->p->column;
+  c->handler(&v, t->sc->data);
+}
+
+static void
+csv_typed_row(struct csv_sink *sink, int c, size_t pos)
+{
+  /* Pass the columns a short row lacks as nulls, then end the row */
+  struct csv_typed *t = sink->data;
+  const struct csv_schema *sc = t->sc;
+  struct csv_value v;
+  size_t col;
+
+  (void)pos;
+
+  for (col = t->p->column; col < sc->selected_size; col++) {
+    if (sc->columns[col].type != CSV_TYPE_SKIP) {
+      csv_decode(sc->columns[col].type, NULL, 0, &v);
+      v.col = col;
+      sc->columns[col].handler(&v, sc->data);
+    }
+  }
+  if (sc->row)
+    sc->row(c, sc->data);
+}
+
+size_t
+csv_parse_typed(struct csv_parser *p, const void *s, size_t len, const struct csv_schema *sc)
+{
+  /* Parse s, passing the decoded fields of the columns of the schema to
+     their handlers, returns the number of bytes processed */
+  struct csv_typed t;
+  struct csv_sink sink;
+  unsigned char *columns;
+  size_t columns_size, pos;
+
+  assert(p && "received null csv_parser");
+
+  if (sc == NULL)
+    return 0;
+
+  t.p = p;
+  t.sc = sc;
+  sink.field = csv_typed_field;
+  sink.row = csv_typed_row;
+  sink.data = &t;
+  sink.stop = 0;
+  sink.status = 0;
+  sink.offset = 0;
+
+  /* Skipped columns are not even copied */
+  columns = p->columns, columns_size = p->columns_size;
+  p->columns = sc->selected, p->columns_size = sc->selected_size;
+  pos = csv_parse_to(p, s, len, NULL, NULL, NULL, &sink);
+  p->columns = columns, p->columns_size = columns_size;
+  return pos;
+}
+
+int
+csv_fini_typed(struct csv_parser *p, const struct csv_schema *sc)
+{
+  /* Finish the last row as csv_parse_typed does */
+  struct csv_typed t;
+  struct csv_sink sink;
+  unsigned char *columns;
+  size_t columns_size;
+  int ret;
+
+  if (p == NULL || sc == NULL)
+    return -1;
+
+  t.p = p;
+  t.sc = sc;
+  sink.field = csv_typed_field;
+  sink.row = csv_typed_row;
+  sink.data = &t;
+  sink.stop = 0;
+  sink.status = 0;
+  sink.offset = 0;
+
+  columns = p->columns, columns_size = p->columns_size;
+  p->columns = sc->selected, p->columns_size = sc->selected_size;
+  ret = csv_fini_sink(p, NULL, NULL, NULL, &sink);
+  p->columns = columns, p->columns_size = columns_size;
+  return ret;
+}
+
+#endif
+
+#ifdef HAVE_PTHREAD
+
+#define CHUNK_MIN (1 << 16)  /* Smallest chunk worth handing to a thread */
+#define CHUNK_MAX (1 << 20)  /* Largest chunk, bounds the memory used for its events */
+#define MAX_THREADS 256
+
+/* Events recorded while reading ahead a chunk, kept small since there is
+   one for every field.  Offsets and lengths are limited by CHUNK_MAX, the
+   type is stored in the top bits of len */
+#define EV_INPUT 0  /* Field that is in the input at off */
+#define EV_COPY  1  /* Field that had to be unescaped, stored in copied at off */
+#define EV_NULL  2  /* Empty field passed as NULL for CSV_EMPTY_IS_NULL */
+#define EV_ROW   3  /* End of a row just before off, len holds the terminator */
+#define EV_SHIFT 30
+#define EV_TYPE(ev) ((int)((ev)->len >> EV_SHIFT))
+#define EV_LEN(ev) ((size_t)((ev)->len & ((1U << EV_SHIFT) - 1)))
+
+struct csv_event {
+  unsigned int off;
+  unsigned int len;
+};
+
+/* Part of the data read ahead by a worker thread.  Chunks start after a row
+   terminator on the guess that no row is in progress there, which is wrong
+   when the terminator is inside a quoted field */
+struct csv_chunk {
+  struct csv_parser w;        /* Parser run by the worker */
+  const unsigned char *s;     /* Start of the chunk */
+  size_t len;                 /* Length of the chunk */
+  size_t done;                /* Number of bytes processed by the worker */
+  struct csv_sink sink;       /* Records the events of the worker */
+  struct csv_event *events;
+  size_t nevents;
+  size_t events_size;
+  unsigned char *copied;      /* Fields that don't match the input */
+  size_t copied_used;
+  size_t copied_size;
+  size_t max_len;             /* Length of the longest EV_INPUT field */
+  pthread_t thread;
+  int started;                /* Is the worker thread running? */
+};
+
+static struct csv_event *
+csv_chunk_event(struct csv_sink *sink, size_t off, size_t len, int type)
+{
+  /* Add an event to the chunk, returns NULL and stops the worker on error */
+  struct csv_chunk *ch = sink->data;
+  struct csv_event *ev;
+
+  if (csv_reserve((void **)&ch->events, &ch->events_size, ch->nevents, 1, sizeof *ch->events) != 0) {
+    sink->status = CSV_ENOMEM;
+    sink->stop = 1;
+    return NULL;
+  }
+
+  ev = ch->events + ch->nevents++;
+  ev->off = (unsigned int)off;
+  ev->len = (unsigned int)len | (unsigned int)type << EV_SHIFT;
+  return ev;
+}
+
+static void
+csv_chunk_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  /* Record a field, the worker runs in zero-copy mode so most fields are
+     recorded by their position in the input */
+  struct csv_chunk *ch = sink->data;
+
+  if (field == NULL) {
+    csv_chunk_event(sink, 0, 0, EV_NULL);
+  } else if (field != ch->w.entry_buf) {
+    if (len > ch->max_len)
+      ch->max_len = len;
+    csv_chunk_event(sink, (size_t)(field - ch->s), len, EV_INPUT);
+  } else {
+    /* Copies are null-terminated for CSV_APPEND_NULL */
+    if (csv_reserve((void **)&ch->copied, &ch->copied_size, ch->copied_used, len + 1, 1) != 0) {
+      sink->status = CSV_ENOMEM;
+      sink->stop = 1;
+      return;
+    }
+    memcpy(ch->copied + ch->copied_used, field, len);
+    ch->copied[ch->copied_used + len] = '\0';
+    if (csv_chunk_event(sink, ch->copied_used, len, EV_COPY))
+      ch->copied_used += len + 1;
+  }
+}
+
+static void
+csv_chunk_row(struct csv_sink *sink, int c, size_t pos)
+{
+  /* Record the end of a row */
+  csv_chunk_event(sink, pos, (unsigned char)c, EV_ROW);
+}
+
+static void *
+csv_chunk_run(void *arg)
+{
+  /* Worker thread, read ahead a chunk */
+  struct csv_chunk *ch = arg;
+
+  ch->done = csv_parse_sink(&ch->w, ch->s, ch->len, NULL, NULL, NULL, &ch->sink);
+  return NULL;
+}
+
+static size_t
+csv_chunk_deliver(struct csv_parser *p, struct csv_chunk *ch,
+                  void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  /* Pass the events of a chunk to the callbacks.  If a row is in progress
+   * when the chunk starts, the chunk is parsed again up to the first row end
+   * of the worker at which the parser has no row in progress either, from
+   * there on both see the same data in the same state.  Returns the number
+   * of bytes of the chunk processed like csv_parse.
+   */
+  int zero_copy = (p->options & CSV_ZERO_COPY) && !(p->options & CSV_APPEND_NULL);
+  int status = p->status;
+  size_t done = 0, i = 0, n, need, partial;
+  struct csv_event *ev;
+
+  if (ch->started && !ch->sink.status && ch->w.status != CSV_ENOMEM && ch->w.status != CSV_ETOOBIG) {
+    while (p->pstate != ROW_NOT_BEGUN) {
+      while (i < ch->nevents && EV_TYPE(ch->events + i) != EV_ROW)
+        i++;
+      if (i == ch->nevents)
+        break;
+      ev = ch->events + i++;
+      n = csv_parse(p, ch->s + done, ev->off - done, cb1, cb2, data);
+      if (n < ev->off - done)
+        return done + n;
+      done = ev->off;
+    }
+
+    /* Make room for every field up front, the callbacks can't be undone.  A
+       field the worker stopped in is only counted if it is skipped */
+    partial = ch->w.columns && !CSV_SELECTED(&ch->w, ch->w.column) ? 0 : ch->w.entry_pos;
+    need = zero_copy || ch->max_len < partial ? partial : ch->max_len;
+    if (p->pstate == ROW_NOT_BEGUN && csv_reserve_entry(p, need) == 0) {
+      for (; i < ch->nevents; i++) {
+        ev = ch->events + i;
+        switch (EV_TYPE(ev)) {
+          case EV_ROW:
+            if (cb2)
+              cb2((int)EV_LEN(ev), data);
+            break;
+          case EV_NULL:
+            if (cb1)
+              cb1(NULL, 0, data);
+            break;
+          case EV_COPY:
+            if (cb1)
+              cb1(ch->copied + ev->off, EV_LEN(ev), data);
+            break;
+          default:
+            if (cb1 && zero_copy) {
+              cb1((void *)(ch->s + ev->off), EV_LEN(ev), data);
+            } else if (cb1) {
+              memcpy(p->entry_buf, ch->s + ev->off, EV_LEN(ev));
+              cb1(p->entry_buf, EV_LEN(ev), data);
+            }
+        }
+      }
+
+      /* Continue from where the worker stopped */
+      if (partial)
+        memcpy(p->entry_buf, ch->w.entry_buf, partial);
+      p->quoted = ch->w.quoted, p->pstate = ch->w.pstate, p->spaces = ch->w.spaces, p->entry_pos = ch->w.entry_pos;
+      p->column = ch->w.column;
+      if (ch->w.status)
+        p->status = ch->w.status;
+      return ch->done;
+    }
+    p->status = status;
+  }
+
+  return done + csv_parse(p, ch->s + done, ch->len - done, cb1, cb2, data);
+}
+
+static unsigned int
+csv_cpu_count(void)
+{
+  /* Return the number of CPUs available, or 1 if unknown */
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n > 0)
+    return n > MAX_THREADS ? MAX_THREADS : (unsigned int)n;
+#endif
+  return 1;
+}
+
+static size_t
+csv_find_term(const struct csv_parser *p, const unsigned char *s, size_t len)
+{
+  /* Return the offset of the first row terminator in s, or len if none */
+  static const unsigned char terms[] = {CSV_CR, CSV_LF};
+  size_t i;
+
+  if (p->is_term == NULL)
+    return csv_span(s, len, terms, 2);
+  for (i = 0; i < len && !(p->classes.cls[s[i]] & CL_TERM); i++)
+    ;
+  return i;
+}
+#endif
+
+size_t
+csv_parse_parallel(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+                   unsigned int nthreads)
+{
+  /* Parse s like csv_parse using up to nthreads threads, 0 for one per CPU.
+   * The data is split into chunks at row terminators, worker threads read
+   * ahead every chunk but the first while the calling thread parses that
+   * one, then the recorded fields and rows are passed to the callbacks in
+   * order.
+   */
+#ifdef HAVE_PTHREAD
+  const unsigned char *us = s;
+  struct csv_chunk *chunks, *ch;
+  size_t pos = 0, size, end, start, n;
+  unsigned int i, nchunks;
+  int failed = 0;
+
+  assert(p && "received null csv_parser");
+
+  if (s == NULL)
+    return 0;
+
+  if (nthreads == 0)
+    nthreads = csv_cpu_count();
+  if (nthreads > MAX_THREADS)
+    nthreads = MAX_THREADS;
+  if (nthreads < 2 || len < 2 * CHUNK_MIN || p->stats || (chunks = calloc(nthreads, sizeof *chunks)) == NULL)
+    return csv_parse(p, s, len, cb1, cb2, data);
+
+  CHECK_CLASSES(p);
+
+  for (i = 1; i < nthreads; i++) {
+    ch = chunks + i;
+    csv_init(&ch->w, p->options | CSV_ZERO_COPY);
+    ch->w.delim_char = p->delim_char;
+    ch->w.quote_char = p->quote_char;
+    ch->w.is_space = p->is_space;
+    ch->w.is_term = p->is_term;
+    ch->w.blk_size = p->blk_size;
+    ch->w.grow_policy = p->grow_policy;
+    ch->w.grow_cap = p->grow_cap;
+    ch->w.columns = p->columns;
+    ch->w.columns_size = p->columns_size;
+    ch->sink.field = csv_chunk_field;
+    ch->sink.row = csv_chunk_row;
+    ch->sink.data = ch;
+  }
+
+  while (!failed && len - pos >= 2 * CHUNK_MIN) {
+    /* Split the next part of the data at the first terminator after each
+       multiple of the chunk size */
+    size = (len - pos) / nthreads;
+    size = size < CHUNK_MIN ? CHUNK_MIN : size > CHUNK_MAX ? CHUNK_MAX : size;
+    end = len - pos < nthreads * size ? len : pos + nthreads * size;
+    chunks[0].s = us + pos;
+    for (nchunks = 1; nchunks < nthreads; nchunks++) {
+      start = pos + nchunks * size;
+      if (start <= (size_t)(chunks[nchunks - 1].s - us))
+        start = (size_t)(chunks[nchunks - 1].s - us) + 1;
+      if (start >= end)
+        break;
+      start += csv_find_term(p, us + start, end - start) + 1;
+      if (start >= end)
+        break;
+      chunks[nchunks].s = us + start;
+    }
+    for (i = 0; i < nchunks; i++)
+      chunks[i].len = (size_t)((i + 1 < nchunks ? chunks[i + 1].s : us + end) - chunks[i].s);
+
+    for (i = 1; i < nchunks; i++) {
+      ch = chunks + i;
+      ch->w.quoted = 0, ch->w.pstate = ROW_NOT_BEGUN, ch->w.spaces = 0, ch->w.entry_pos = 0;
+      ch->w.status = 0;
+      ch->nevents = ch->copied_used = ch->max_len = 0;
+      ch->sink.stop = ch->sink.status = 0;
+      ch->started = pthread_create(&ch->thread, NULL, csv_chunk_run, ch) == 0;
+    }
+
+    /* The first chunk continues the data parsed so far */
+    n = csv_parse(p, chunks[0].s, chunks[0].len, cb1, cb2, data);
+    pos += n;
+    failed = n < chunks[0].len;
+
+    for (i = 1; i < nchunks; i++) {
+      ch = chunks + i;
+      if (ch->started)
+        pthread_join(ch->thread, NULL);
+      if (!failed) {
+        n = csv_chunk_deliver(p, ch, cb1, cb2, data);
+        pos += n;
+        failed = n < ch->len;
+      }
+    }
+  }
+
+  for (i = 1; i < nthreads; i++) {
+    chunks[i].w.columns = NULL;  /* Shared with the parser */
+    csv_free(&chunks[i].w);
+    free(chunks[i].events);
+    free(chunks[i].copied);
+  }
+  free(chunks);
+
+  if (failed)
+    return pos;
+  return pos + csv_parse(p, us + pos, len - pos, cb1, cb2, data);
+#else
+  (void)nthreads;
+  return csv_parse(p, s, len, cb1, cb2, data);
+#endif
+}
+
+static size_t
+csv_parse_fd_sink(struct csv_parser *p, int fd, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+                  struct csv_sink *sink)
+{
+  /* Parse everything that can be read from fd, regular files are mapped into
+   * memory and parsed in one pass, anything else is read in large blocks.
+   * Returns the number of bytes processed, if that is short of the data
+   * available csv_error() reports why.  The file offset is left just past
+   * the data processed where the file allows seeking.
+   */
+#ifdef CSV_HAVE_POSIX_IO
+  size_t pos = 0, n, base = sink ? sink->offset : 0;
+  unsigned char *buf;
+  ssize_t r;
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+  off_t start, skip;
+  size_t size;
+  long page;
+  void *m;
+#endif
+
+  assert(p && "received null csv_parser");
+
+#ifdef HAVE_SYS_MMAN_H
+  /* Map from the current offset rounded down to a page boundary */
+  page = sysconf(_SC_PAGESIZE);
+  if (page > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (start = lseek(fd, 0, SEEK_CUR)) >= 0
+      && st.st_size > start && (unsigned long long)(st.st_size - start) <= SIZE_MAX - page) {
+    skip = start % page;
+    size = (size_t)(st.st_size - start + skip);
+    m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, start - skip);
+    if (m != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      madvise(m, size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+      madvise(m, size, MADV_HUGEPAGE);
+#endif
+      pos = csv_parse_to(p, (unsigned char *)m + skip, size - skip, cb1, cb2, data, sink);
+      munmap(m, size);
+      lseek(fd, start + (off_t)pos, SEEK_SET);
+      if (pos < size - (size_t)skip)
+        return pos;
+      /* Read on in case the file grew after fstat */
+    }
+  }
+#endif
+
+  if ((buf = malloc(READ_SIZE)) == NULL) {
+    p->status = CSV_ENOMEM;
+    return pos;
+  }
+
+  for (;;) {
+    r = read(fd, buf, READ_SIZE);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      p->status = CSV_EREAD;
+    if (r <= 0)
+      break;
+    if (sink)
+      sink->offset = base + pos;
+    n = csv_parse_to(p, buf, (size_t)r, cb1, cb2, data, sink);
+    pos += n;
+    if (n < (size_t)r) {
+      lseek(fd, -(off_t)((size_t)r - n), SEEK_CUR);
+      break;
+    }
+  }
+
+  free(buf);
+  return pos;
+#else
+  (void)fd, (void)cb1, (void)cb2, (void)data, (void)sink;
+  assert(p && "received null csv_parser");
+  p->status = CSV_EREAD;
+  return 0;
+#endif
+}
+
+size_t
+csv_parse_fd(struct csv_parser *p, int fd, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  return csv_parse_fd_sink(p, fd, cb1, cb2, data, NULL);
+}
+
+static size_t
+csv_parse_file_sink(struct csv_parser *p, const char *filename, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+                    struct csv_sink *sink)
+{
+  /* Open filename and parse its contents with csv_parse_fd_sink, returns
+   * the number of bytes processed
+   */
+  size_t pos = 0;
+#ifdef CSV_HAVE_POSIX_IO
+  int fd;
+
+  assert(p && "received null csv_parser");
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    p->status = CSV_EREAD;
+    return 0;
+  }
+  pos = csv_parse_fd_sink(p, fd, cb1, cb2, data, sink);
+  close(fd);
+#else
+  FILE *fp;
+  unsigned char *buf;
+  size_t r, n;
+
+  assert(p && "received null csv_parser");
+
+  if ((fp = fopen(filename, "rb")) == NULL) {
+    p->status = CSV_EREAD;
+    return 0;
+  }
+  if ((buf = malloc(READ_SIZE)) == NULL) {
+    p->status = CSV_ENOMEM;
+    fclose(fp);
+    return 0;
+  }
+  while ((r = fread(buf, 1, READ_SIZE, fp)) > 0) {
+    n = csv_parse_to(p, buf, r, cb1, cb2, data, sink);
+    pos += n;
+    if (n < r)
+      break;
+  }
+  if (ferror(fp))
+    p->status = CSV_EREAD;
+  free(buf);
+  fclose(fp);
+#endif
+  return pos;
+}
+
+size_t
+csv_parse_file(struct csv_parser *p, const char *filename, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  return csv_parse_file_sink(p, filename, cb1, cb2, data, NULL);
+}
+
+size_t
+csv_validate_fd(struct csv_parser *p, int fd)
+{
+  /* Validate everything that can be read from fd, see csv_parse_fd */
+  struct csv_sink sink;
+
+  sink.field = NULL;
+  sink.row = NULL;
+  sink.offset = 0;
+  return csv_parse_fd_sink(p, fd, NULL, NULL, NULL, &sink);
+}
+
+size_t
+csv_validate_file(struct csv_parser *p, const char *filename)
+{
+  /* Validate the contents of filename, see csv_parse_file */
+  struct csv_sink sink;
+
+  sink.field = NULL;
+  sink.row = NULL;
+  sink.offset = 0;
+  return csv_parse_file_sink(p, filename, NULL, NULL, NULL, &sink);
+}
+
+/* Buffers a reader holds by default, each of READ_SIZE bytes */
+#define READER_BUFS 4
+
+#ifdef HAVE_PTHREAD
+/* Read-ahead thread of a reader and what it shares with the caller */
+struct csv_reader_sync {
+  pthread_t thread;
+  pthread_mutex_t lock;    /* Guards the counters and flags of the reader */
+  pthread_cond_t filled;   /* Signalled when a buffer is filled or reading ends */
+  pthread_cond_t space;    /* Signalled when a buffer is given back or on stop */
+  int stop;                /* Set by csv_reader_free to end the thread */
+};
+#endif
+
+#ifdef CSV_HAVE_POSIX_IO
+static size_t
+csv_reader_read(struct csv_reader *r, unsigned char *buf, size_t size, int *error)
+{
+  /* Read up to size bytes into buf with a single read, returns the number of
+     bytes read, 0 at the end of the input or with *error set to errno */
+  ssize_t got;
+
+  do
+    got = read(r->fd, buf, size);
+  while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    *error = errno;
+    return 0;
+  }
+  return (size_t)got;
+}
+
+/* errno of compressed input that is corrupt or cut short */
+#  ifdef EBADMSG
+#    define CSV_EBADDATA EBADMSG
+#  else
+#    define CSV_EBADDATA EIO
+#  endif
+/* errno of input compressed in a format the library was built without */
+#  ifdef ENOTSUP
+#    define CSV_ENOCODEC ENOTSUP
+#  else
+#    define CSV_ENOCODEC CSV_EBADDATA
+#  endif
+
+/* A decompression backend.  decode decompresses from in[*in_pos..in_len)
+   into out[*out_pos..out_len), advancing both positions, and returns 1 when
+   a stream ends, 0 when more input or room is needed and -1 on bad data.
+   reset prepares for another stream following one that ended. */
+struct csv_codec {
+  int (*init)(void **state);
+  int (*decode)(void *state, const unsigned char *in, size_t *in_pos, size_t in_len,
+                unsigned char *out, size_t *out_pos, size_t out_len);
+  int (*reset)(void *state);
+  void (*free)(void *state);
+};
+
+#  ifdef HAVE_ZLIB
+static int
+csv_gzip_init(void **state)
+{
+  /* gzip and zlib headers are both recognized */
+  z_stream *z = calloc(1, sizeof *z);
+
+  if (z == NULL)
+    return -1;
+  if (inflateInit2(z, 15 + 32) != Z_OK) {
+    free(z);
+    return -1;
+  }
+  *state = z;
+  return 0;
+}
+
+static int
+csv_gzip_decode(void *state, const unsigned char *in, size_t *in_pos, size_t in_len,
+                unsigned char *out, size_t *out_pos, size_t out_len)
+{
+  z_stream *z = state;
+  uInt avail_in = in_len - *in_pos > UINT_MAX ? UINT_MAX : (uInt)(in_len - *in_pos);
+  uInt avail_out = out_len - *out_pos > UINT_MAX ? UINT_MAX : (uInt)(out_len - *out_pos);
+  int rc;
+
+  z->next_in = (Bytef *)(in + *in_pos);
+  z->avail_in = avail_in;
+  z->next_out = out + *out_pos;
+  z->avail_out = avail_out;
+  rc = inflate(z, Z_NO_FLUSH);
+  *in_pos += avail_in - z->avail_in;
+  *out_pos += avail_out - z->avail_out;
+  if (rc == Z_STREAM_END)
+    return 1;
+  return rc == Z_OK || rc == Z_BUF_ERROR ? 0 : -1;
+}
+
+static int
+csv_gzip_reset(void *state)
+{
+  /* Concatenated gzip members make up a single file */
+  return inflateReset(state) == Z_OK ? 0 : -1;
+}
+
+static void
+csv_gzip_free(void *state)
+{
+  inflateEnd(state);
+  free(state);
+}
+
+static const struct csv_codec csv_gzip_codec = {
+  csv_gzip_init, csv_gzip_decode, csv_gzip_reset, csv_gzip_free
+};
+#  endif
+
+#  ifdef HAVE_ZSTD
+static int
+csv_zstd_init(void **state)
+{
+  ZSTD_DStream *ds = ZSTD_createDStream();
+
+  if (ds == NULL)
+    return -1;
+  if (ZSTD_isError(ZSTD_initDStream(ds))) {
+    ZSTD_freeDStream(ds);
+    return -1;
+  }
+  *state = ds;
+  return 0;
+}
+
+static int
+csv_zstd_decode(void *state, const unsigned char *in, size_t *in_pos, size_t in_len,
+                unsigned char *out, size_t *out_pos, size_t out_len)
+{
+  /* A return of 0 means that a frame was decoded and flushed entirely */
+  ZSTD_inBuffer input;
+  ZSTD_outBuffer output;
+  size_t rc;
+
+  input.src = in;
+  input.size = in_len;
+  input.pos = *in_pos;
+  output.dst = out;
+  output.size = out_len;
+  output.pos = *out_pos;
+  rc = ZSTD_decompressStream(state, &output, &input);
+  *in_pos = input.pos;
+  *out_pos = output.pos;
+  if (ZSTD_isError(rc))
+    return -1;
+  return rc == 0;
+}
+
+static int
+csv_zstd_reset(void *state)
+{
+  /* The next frame starts where the last one ended */
+  (void)state;
+  return 0;
+}
+
+static void
+csv_zstd_free(void *state)
+{
+  ZSTD_freeDStream(state);
+}
+
+static const struct csv_codec csv_zstd_codec = {
+  csv_zstd_init, csv_zstd_decode, csv_zstd_reset, csv_zstd_free
+};
+#  endif
+
+static const struct csv_codec *
+csv_codec_find(int format)
+{
+  /* Return the backend of format, NULL if the library was built without it */
+#  ifdef HAVE_ZLIB
+  if (format == CSV_COMPRESS_GZIP)
+    return &csv_gzip_codec;
+#  endif
+#  ifdef HAVE_ZSTD
+  if (format == CSV_COMPRESS_ZSTD)
+    return &csv_zstd_codec;
+#  endif
+  (void)format;
+  return NULL;
+}
+#endif
+
+/* Decompression stage of a reader, compressed input is read into in */
+struct csv_decompressor {
+  int format;                     /* CSV_COMPRESS_AUTO until the input is seen */
+  const struct csv_codec *codec;  /* Backend, NULL once the input is plain */
+  void *state;                    /* State of the backend */
+  unsigned char *in;              /* Compressed input of buf_size bytes */
+  size_t in_pos;                  /* Offset of the first byte not decoded */
+  size_t in_len;                  /* Number of bytes read into in */
+  int in_eof;                     /* Nothing more can be read */
+  int ended;                      /* The last stream decoded ended */
+};
+
+#ifdef CSV_HAVE_POSIX_IO
+static int
+csv_decompress_detect(struct csv_reader *r, int *error)
+{
+  /* Tell the format of the input from its first bytes, which are kept in
+     d->in, and start the backend.  Returns 0 on success, -1 with *error set
+     otherwise. */
+  static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+  static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+  struct csv_decompressor *d = r->decomp;
+  size_t got;
+
+  while (d->format == CSV_COMPRESS_AUTO && d->in_len < sizeof zstd_magic) {
+    got = csv_reader_read(r, d->in + d->in_len, r->buf_size - d->in_len, error);
+    if (*error)
+      return -1;
+    if (got == 0)
+      break;
+    d->in_len += got;
+  }
+  if (d->format == CSV_COMPRESS_AUTO) {
+    if (d->in_len >= sizeof gzip_magic && memcmp(d->in, gzip_magic, sizeof gzip_magic) == 0)
+      d->format = CSV_COMPRESS_GZIP;
+    else if (d->in_len >= sizeof zstd_magic && memcmp(d->in, zstd_magic, sizeof zstd_magic) == 0)
+      d->format = CSV_COMPRESS_ZSTD;
+    else
+      d->format = CSV_COMPRESS_NONE;
+  }
+  if (d->format == CSV_COMPRESS_NONE)
+    return 0;
+  if ((d->codec = csv_codec_find(d->format)) == NULL) {
+    *error = CSV_ENOCODEC;
+    return -1;
+  }
+  if (d->codec->init(&d->state) != 0) {
+    d->codec = NULL;
+    *error = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+static size_t
+csv_decompress_fill(struct csv_reader *r, unsigned char *buf, int *error)
+{
+  /* Decompress into buf until it is full or the input ends, see
+     csv_reader_fill */
+  struct csv_decompressor *d = r->decomp;
+  size_t n = 0, before, in_before, got;
+  int rc;
+
+  if (d->format == CSV_COMPRESS_AUTO || (d->codec == NULL && d->format != CSV_COMPRESS_NONE)) {
+    if (csv_decompress_detect(r, error) != 0)
+      return 0;
+  }
+
+  if (d->codec == NULL) {
+    /* Plain input, pass on what was read to detect the format */
+    n = d->in_len - d->in_pos;
+    memcpy(buf, d->in + d->in_pos, n);
+    d->in_pos = d->in_len;
+    while (n < r->buf_size && (got = csv_reader_read(r, buf + n, r->buf_size - n, error)) > 0)
+      n += got;
+    return n;
+  }
+
+  while (n < r->buf_size) {
+    if (d->in_pos == d->in_len && !d->in_eof) {
+      d->in_pos = 0;
+      d->in_len = csv_reader_read(r, d->in, r->buf_size, error);
+      if (*error)
+        break;
+      d->in_eof = d->in_len == 0;
+      continue;
+    }
+    if (d->ended) {
+      if (d->in_pos == d->in_len)
+        break;  /* The input ends with a whole stream */
+      if (d->codec->reset(d->state) != 0) {
+        *error = CSV_EBADDATA;
+        break;
+      }
+      d->ended = 0;
+    }
+    before = n;
+    in_before = d->in_pos;
+    rc = d->codec->decode(d->state, d->in, &d->in_pos, d->in_len, buf, &n, r->buf_size);
+    if (rc < 0 || (rc == 0 && n == before && d->in_pos == in_before)) {
+      /* Bad data, or the input ends in the middle of a stream */
+      *error = CSV_EBADDATA;
+      break;
+    }
+    d->ended = rc;
+  }
+  return n;
+}
+#endif
+
+static size_t
+csv_reader_fill(struct csv_reader *r, unsigned char *buf, int *error)
+{
+  /* Read into buf until it is full or the input ends, returns the number of
+     bytes read and sets *error to errno if reading failed */
+  size_t n = 0;
+#ifdef CSV_HAVE_POSIX_IO
+  size_t got;
+
+  *error = 0;
+  if (r->decomp)
+    return csv_decompress_fill(r, buf, error);
+  while (n < r->buf_size && (got = csv_reader_read(r, buf + n, r->buf_size - n, error)) > 0)
+    n += got;
+#else
+  (void)r, (void)buf;
+  *error = -1;
+#endif
+  return n;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+csv_reader_run(void *arg)
+{
+  /* Fill the buffers of the ring ahead of the caller until the input ends,
+     reading fails or the reader is freed */
+  struct csv_reader *r = arg;
+  struct csv_reader_sync *sync = r->sync;
+  unsigned char *buf;
+  size_t i, n;
+  int error, done = 0;
+
+  while (!done) {
+    pthread_mutex_lock(&sync->lock);
+    while (r->filled - r->released == r->nbufs && !sync->stop)
+      pthread_cond_wait(&sync->space, &sync->lock);
+    if (sync->stop) {
+      pthread_mutex_unlock(&sync->lock);
+      break;
+    }
+    i = r->filled % r->nbufs;
+    pthread_mutex_unlock(&sync->lock);
+
+    /* The caller does not touch buffers that are not filled yet */
+    buf = r->base + i * r->buf_size;
+    n = csv_reader_fill(r, buf, &error);
+
+    pthread_mutex_lock(&sync->lock);
+    if (n) {
+      r->lens[i] = n;
+      r->filled++;
+    }
+    if (error) {
+      r->status = CSV_EREAD;
+      r->error = error;
+    }
+    if (n < r->buf_size || error)
+      r->eof = done = 1;
+    pthread_cond_signal(&sync->filled);
+    pthread_mutex_unlock(&sync->lock);
+  }
+  return NULL;
+}
+#endif
+
+int
+csv_reader_init_compressed(struct csv_reader *r, int fd, int format, size_t buf_size, size_t nbufs)
+{
+  /* Initialize a reader of fd with nbufs buffers of buf_size bytes, 0 for
+   * the defaults, that decompresses input in format, and start reading
+   * ahead in a background thread where threads are supported.  Returns 0
+   * on success and -1 on error.
+   */
+  size_t align = 64;
+#ifdef CSV_HAVE_POSIX_IO
+  long page = sysconf(_SC_PAGESIZE);
+#endif
+
+  if (r == NULL)
+    return -1;
+
+  r->fd = fd;
+  r->close_fd = 0;
+  r->buf_size = buf_size ? buf_size : READ_SIZE;
+  r->nbufs = nbufs ? nbufs : READER_BUFS;
+  r->mem = r->base = NULL;
+  r->lens = NULL;
+  r->filled = r->taken = r->released = 0;
+  r->eof = r->status = r->error = 0;
+  r->decomp = NULL;
+  r->sync = NULL;
+
+#ifdef CSV_HAVE_POSIX_IO
+  if (page > 0)
+    align = (size_t)page;
+  if (format != CSV_COMPRESS_NONE && format != CSV_COMPRESS_AUTO && csv_codec_find(format) == NULL) {
+    errno = CSV_ENOCODEC;
+    return -1;
+  }
+#else
+  (void)format;
+  return -1;
+#endif
+
+  /* Buffers start on a page so that the kernel can copy whole pages */
+  r->buf_size = r->buf_size > SIZE_MAX - align ? 0 : (r->buf_size + align - 1) / align * align;
+  if (r->buf_size == 0 || r->nbufs > SIZE_MAX / r->buf_size - 1 ||
+      (r->mem = malloc(r->nbufs * r->buf_size + align)) == NULL ||
+      (r->lens = malloc(r->nbufs * sizeof *r->lens)) == NULL) {
+    csv_reader_free(r);
+    return -1;
+  }
+  r->base = r->mem + (align - (size_t)r->mem % align) % align;
+
+  if (format != CSV_COMPRESS_NONE) {
+    if ((r->decomp = malloc(sizeof *r->decomp)) == NULL) {
+      csv_reader_free(r);
+      return -1;
+    }
+    r->decomp->format = format;
+    r->decomp->codec = NULL;
+    r->decomp->state = NULL;
+    r->decomp->in_pos = r->decomp->in_len = 0;
+    r->decomp->in_eof = r->decomp->ended = 0;
+    if ((r->decomp->in = malloc(r->buf_size)) == NULL) {
+      csv_reader_free(r);
+      return -1;
+    }
+  }
+
+#ifdef HAVE_PTHREAD
+  if ((r->sync = malloc(sizeof *r->sync)) == NULL) {
+    csv_reader_free(r);
+    return -1;
+  }
+  r->sync->stop = 0;
+  pthread_mutex_init(&r->sync->lock, NULL);
+  pthread_cond_init(&r->sync->filled, NULL);
+  pthread_cond_init(&r->sync->space, NULL);
+  if (pthread_create(&r->sync->thread, NULL, csv_reader_run, r) != 0) {
+    /* Read in the caller's thread instead */
+    pthread_cond_destroy(&r->sync->space);
+    pthread_cond_destroy(&r->sync->filled);
+    pthread_mutex_destroy(&r->sync->lock);
+    free(r->sync);
+    r->sync = NULL;
+  }
+#endif
+  return 0;
+}
+
+int
+csv_reader_init(struct csv_reader *r, int fd, size_t buf_size, size_t nbufs)
+{
+  /* Initialize a reader of plain input, see csv_reader_init_compressed */
+  return csv_reader_init_compressed(r, fd, CSV_COMPRESS_NONE, buf_size, nbufs);
+}
+
+int
+csv_reader_open_compressed(struct csv_reader *r, const char *filename, int format, size_t buf_size, size_t nbufs)
+{
+  /* Initialize a reader of filename, which csv_reader_free closes, returns
+     0 on success and -1 on error with errno telling why */
+#ifdef CSV_HAVE_POSIX_IO
+  int fd, e;
+
+  if (r == NULL || filename == NULL)
+    return -1;
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return -1;
+  if (csv_reader_init_compressed(r, fd, format, buf_size, nbufs) != 0) {
+    e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  r->close_fd = 1;
+  return 0;
+#else
+  (void)r, (void)filename, (void)format, (void)buf_size, (void)nbufs;
+  return -1;
+#endif
+}
+
+int
+csv_reader_open(struct csv_reader *r, const char *filename, size_t buf_size, size_t nbufs)
+{
+  /* Initialize a reader of the plain file filename, see
+     csv_reader_open_compressed */
+  return csv_reader_open_compressed(r, filename, CSV_COMPRESS_NONE, buf_size, nbufs);
+}
+
+const void *
+csv_reader_next(struct csv_reader *r, size_t *len)
+{
+  /* Return the next block of input and store its length in *len, or NULL
+   * once the input ends or reading fails.  The block stays valid until the
+   * next call, which gives it back to the read-ahead thread.
+   */
+  int error;
+
+  if (r == NULL || len == NULL || r->mem == NULL)
+    return NULL;
+  *len = 0;
+
+#ifdef HAVE_PTHREAD
+  if (r->sync) {
+    const unsigned char *buf = NULL;
+    size_t i;
+
+    pthread_mutex_lock(&r->sync->lock);
+    if (r->released < r->taken) {
+      r->released++;
+      pthread_cond_signal(&r->sync->space);
+    }
+    while (r->taken == r->filled && !r->eof)
+      pthread_cond_wait(&r->sync->filled, &r->sync->lock);
+    if (r->taken < r->filled) {
+      i = r->taken++ % r->nbufs;
+      buf = r->base + i * r->buf_size;
+      *len = r->lens[i];
+    }
+#ifdef CSV_HAVE_POSIX_IO
+    if (buf == NULL && r->status)
+      errno = r->error;
+#endif
+    pthread_mutex_unlock(&r->sync->lock);
+    return buf;
+  }
+#endif
+
+  /* No thread, read into the first buffer */
+  r->released = r->taken;
+  if (r->eof)
+    return NULL;
+  *len = csv_reader_fill(r, r->base, &error);
+  if (error) {
+    r->status = CSV_EREAD;
+    r->error = error;
+#ifdef CSV_HAVE_POSIX_IO
+    errno = error;
+#endif
+  }
+  if (*len < r->buf_size || error)
+    r->eof = 1;
+  if (*len == 0)
+    return NULL;
+  r->taken++;
+  return r->base;
+}
+
+int
+csv_reader_error(const struct csv_reader *r)
+{
+  /* Return CSV_EREAD if reading failed, CSV_SUCCESS otherwise */
+  if (r == NULL)
+    return CSV_EINVALID;
+#ifdef HAVE_PTHREAD
+  if (r->sync) {
+    int status;
+
+    pthread_mutex_lock(&r->sync->lock);
+    status = r->status;
+    pthread_mutex_unlock(&r->sync->lock);
+    return status;
+  }
+#endif
+  return r->status;
+}
+
+size_t
+csv_reader_parse(struct csv_parser *p, struct csv_reader *r, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *),
+                 void *data)
+{
+  /* Parse the blocks of the reader as they arrive, returns the number of
+   * bytes processed.  If that is short of the input, csv_error() reports
+   * why, CSV_EREAD with errno set if reading failed.
+   */
+  const void *buf;
+  size_t len, n, pos = 0;
+
+  assert(p && "received null csv_parser");
+
+  while ((buf = csv_reader_next(r, &len)) != NULL) {
+    n = csv_parse(p, buf, len, cb1, cb2, data);
+    pos += n;
+    if (n < len)
+      return pos;
+  }
+  if (csv_reader_error(r) != CSV_SUCCESS)
+    p->status = CSV_EREAD;  /* errno was set by csv_reader_next */
+  return pos;
+}
+
+void
+csv_reader_free(struct csv_reader *r)
+{
+  /* Stop reading ahead, waiting for a read in progress to finish, and free
+     the buffers of the reader */
+  if (r == NULL)
+    return;
+
+#ifdef HAVE_PTHREAD
+  if (r->sync) {
+    pthread_mutex_lock(&r->sync->lock);
+    r->sync->stop = 1;
+    pthread_cond_signal(&r->sync->space);
+    pthread_mutex_unlock(&r->sync->lock);
+    pthread_join(r->sync->thread, NULL);
+    pthread_cond_destroy(&r->sync->space);
+    pthread_cond_destroy(&r->sync->filled);
+    pthread_mutex_destroy(&r->sync->lock);
+    free(r->sync);
+  }
+#endif
+  if (r->decomp) {
+#ifdef CSV_HAVE_POSIX_IO
+    if (r->decomp->codec)
+      r->decomp->codec->free(r->decomp->state);
+#endif
+    free(r->decomp->in);
+    free(r->decomp);
+  }
+#ifdef CSV_HAVE_POSIX_IO
+  if (r->close_fd && r->fd >= 0)
+    close(r->fd);
+#endif
+  free(r->mem);
+  free(r->lens);
+  r->mem = r->base = NULL;
+  r->lens = NULL;
+  r->decomp = NULL;
+  r->sync = NULL;
+  r->fd = -1;
+  r->close_fd = 0;
+}
+
+static void
+csv_skip_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  (void)sink, (void)field, (void)len;
+}
+
+static void
+csv_skip_row(struct csv_sink *sink, int c, size_t pos)
+{
+  /* Count down the rows to skip, stop after the last one */
+  size_t *rows = sink->data;
+
+  (void)c, (void)pos;
+  if (--*rows == 0)
+    sink->stop = 1;
+}
+
+/* Rows and fields counted by csv_count */
+struct csv_counts {
+  size_t *rows;
+  size_t *fields;
+};
+
+static void
+csv_count_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  struct csv_counts *n = sink->data;
+
+  (void)field, (void)len;
+  ++*n->fields;
+}
+
+static void
+csv_count_row(struct csv_sink *sink, int c, size_t pos)
+{
+  struct csv_counts *n = sink->data;
+
+  (void)c, (void)pos;
+  ++*n->rows;
+}
+
+static void
+csv_index_row(struct csv_sink *sink, int c, size_t pos)
+{
+  /* Record where the next row starts if it is one of every step rows */
+  struct csv_index *x = sink->data;
+
+  (void)c;
+  if (++x->rows % x->step)
+    return;
+  if (csv_reserve((void **)&x->offsets, &x->size, x->count, 1, sizeof *x->offsets) != 0) {
+    sink->status = CSV_ENOMEM;
+    sink->stop = 1;
+    return;
+  }
+  x->offsets[x->count++] = sink->offset + pos;
+}
+
+static void
+csv_index_last_row(struct csv_sink *sink, int c, size_t pos)
+{
+  /* Count the row ended by csv_fini, no row starts after it */
+  struct csv_index *x = sink->data;
+
+  (void)c, (void)pos;
+  x->rows++;
+}
+
+static size_t
+csv_scan(struct csv_parser *p, const void *s, size_t len, int fd, struct csv_sink *sink)
+{
+  /* Parse s, or fd if s is null, into a sink that counts rows or fields.
+   * Fields are read in zero-copy mode so that they are only copied when
+   * they span input buffers.
+   */
+  unsigned char options = p->options;
+  struct csv_stats *stats = p->stats;  /* Nothing is delivered */
+  size_t pos;
+
+  sink->stop = sink->status = 0;
+  p->options = (unsigned char)((options | CSV_ZERO_COPY) & ~CSV_APPEND_NULL);
+  p->stats = NULL;
+  if (s)
+    pos = csv_parse_to(p, s, len, NULL, NULL, NULL, sink);
+  else
+    pos = csv_parse_fd_sink(p, fd, NULL, NULL, NULL, sink);
+  p->options = options;
+  p->stats = stats;
+  if (sink->status)
+    p->status = sink->status;
+  return pos;
+}
+
+size_t
+csv_skip_rows(struct csv_parser *p, const void *s, size_t len, size_t *n)
+{
+  /* Move past the next *n rows of s without delivering any of their
+   * fields, counting *n down for each row ended.  Returns the number of
+   * bytes processed, which stops right after the last row skipped.  If s
+   * ends before that the rest of the row is skipped by the next call of
+   * csv_skip_rows, csv_parse or csv_fini.
+   */
+  const unsigned char *us = s;
+  const unsigned char *cls, *q;
+  unsigned char set[CSV_SPAN_MAX], cl;
+  struct csv_sink sink;
+  int pstate, quoted, nset, c;
+  size_t pos = 0, spaces, start, i;
+
+  assert(p && "received null csv_parser");
+  assert(n && "received null row count");
+
+  if (s == NULL || *n == 0)
+    return 0;
+
+  CHECK_CLASSES(p);
+  p->skip_rest = 0;
+
+  if (p->options & CSV_STRICT) {
+    /* Go through the parser so that malformed data is still reported */
+    sink.field = csv_skip_field;
+    sink.row = csv_skip_row;
+    sink.data = n;
+    sink.offset = 0;
+    pos = csv_scan(p, s, len, -1, &sink);
+    p->skip_rest = p->pstate != ROW_NOT_BEGUN;
+    return pos;
+  }
+
+  /* Outside of quoted fields the row can only end at a terminator or be
+     hidden by a quote, scan for those bytes alone if the dialect gives
+     them no other meaning */
+  cls = p->classes.cls;
+  set[0] = p->quote_char;
+  nset = cls[p->quote_char] == CL_QUOTE ? 1 : -1;
+  for (c = 0; c < 256 && nset > 0; c++) {
+    if (!(cls[c] & CL_TERM))
+      continue;
+    if (cls[c] != CL_TERM || nset == CSV_SPAN_MAX)
+      nset = -1;
+    else
+      set[nset++] = (unsigned char)c;
+  }
+
+  pstate = p->pstate;
+  quoted = p->quoted;
+  spaces = p->spaces;
+  while (pos < len && *n) {
+    cl = cls[us[pos]];
+    if (pstate == ROW_NOT_BEGUN) {
+      if ((cl & CL_SPACE) && !(cl & CL_DELIM)) {
+        pos++;
+      } else if (cl & CL_TERM) {
+        /* Empty rows only count if they are reported */
+        pos++;
+        if (p->options & CSV_REPALL_NL)
+          --*n;
+      } else {
+        pstate = FIELD_NOT_BEGUN, quoted = 0;
+      }
+      continue;
+    }
+
+    if (pstate == FIELD_BEGUN && quoted) {
+      /* Quoted fields are usually short, look at the first bytes directly */
+      for (i = pos; i < len && i < pos + 16 && us[i] != p->quote_char; i++)
+        ;
+      if (i == pos + 16 && (q = memchr(us + i, p->quote_char, len - i)) != NULL)
+        i = (size_t)(q - us);
+      else if (i == pos + 16)
+        i = len;
+      pos = i < len ? i + 1 : len;
+      if (i < len)
+        pstate = FIELD_MIGHT_HAVE_ENDED, spaces = 0;
+      continue;
+    }
+
+    if (pstate == FIELD_MIGHT_HAVE_ENDED) {
+      if (cl & CL_DELIM)
+        pstate = FIELD_NOT_BEGUN, quoted = 0;
+      else if (cl & CL_TERM)
+        goto end_row;
+      else if (cl & CL_SPACE)
+        spaces++;
+      else if ((cl & CL_QUOTE) && spaces)
+        spaces = 0;  /* Kept as data, the field may still end here */
+      else
+        pstate = FIELD_BEGUN, spaces = 0;
+      pos++;
+      continue;
+    }
+
+    if (nset < 0) {
+      pos = csv_scan_row(p, us, pos, len, &pstate, &quoted, &spaces);
+      if (pos < len)
+        goto end_row;
+      continue;
+    }
+
+    /* A quote begins a quoted field only if nothing but spaces separate it
+       from the previous delimiter, or from start in a field not begun */
+    start = pos;
+    pos += csv_span(us + pos, len - pos, set, nset);
+    for (i = pos; i > start && (cls[us[i - 1]] & (CL_SPACE | CL_DELIM)) == CL_SPACE; i--)
+      ;
+    if (i > start)
+      pstate = (cls[us[i - 1]] & CL_DELIM) ? FIELD_NOT_BEGUN : FIELD_BEGUN;
+    if (pos == len)
+      break;
+    if (us[pos] != p->quote_char)
+      goto end_row;
+    if (pstate == FIELD_NOT_BEGUN)
+      quoted = 1;
+    pstate = FIELD_BEGUN;
+    pos++;
+    continue;
+
+  end_row:
+    /* pos is at the terminator that ends the row */
+    pos++;
+    pstate = ROW_NOT_BEGUN, quoted = 0;
+    --*n;
+  }
+
+  if (pstate != FIELD_MIGHT_HAVE_ENDED)
+    spaces = 0;
+  p->pstate = pstate, p->quoted = quoted, p->spaces = spaces;
+  p->entry_pos = pstate == FIELD_MIGHT_HAVE_ENDED ? spaces + 1 : 0;
+  p->column = 0;
+  p->skip_rest = pstate != ROW_NOT_BEGUN;
+  return pos;
+}
+
+size_t
+csv_count(struct csv_parser *p, const void *s, size_t len, size_t *rows, size_t *fields)
+{
+  /* Add the number of rows and fields csv_parse would deliver for s to
+   * *rows and *fields without delivering them, returns the number of bytes
+   * processed as csv_parse does.  The delimiters between two quotes or
+   * terminators are counted together from bit masks of the input.
+   */
+  const unsigned char *us = s;
+  const unsigned char *cls;
+  struct csv_marks m;
+  struct csv_counts counts;
+  struct csv_sink sink;
+  unsigned char *columns;
+  unsigned char cl;
+  int pstate, quoted, strict, c;
+  size_t spaces, entry_pos, pos, start, i;
+
+  assert(p && "received null csv_parser");
+  assert(rows && fields && "received null count");
+
+  if (s == NULL)
+    return 0;
+
+  pos = csv_skip_rest(p, s, len);
+  if (p->skip_rest)
+    return pos;
+
+  CHECK_CLASSES(p);
+  cls = p->classes.cls;
+  csv_marks_init(p, &m);
+
+  /* Each quote and terminator must have a single meaning for the marks to
+     tell where fields and rows end, otherwise go through the parser */
+  c = m.nterms >= 0 && cls[p->quote_char] == CL_QUOTE && !(cls[p->delim_char] & CL_TERM);
+  for (i = 0; i < (size_t)m.nterms && c; i++)
+    c = cls[m.term[i]] == CL_TERM;
+  if (!c) {
+    counts.rows = rows;
+    counts.fields = fields;
+    sink.field = csv_count_field;
+    sink.row = csv_count_row;
+    sink.data = &counts;
+    sink.offset = 0;
+    columns = p->columns;  /* Every field is counted */
+    p->columns = NULL;
+    pos += csv_scan(p, us + pos, len - pos, -1, &sink);
+    p->columns = columns;
+    return pos;
+  }
+
+  strict = (p->options & CSV_STRICT) != 0;
+  pstate = p->pstate;
+  quoted = p->quoted;
+  spaces = p->spaces;
+
+  while (pos < len) {
+    switch (pstate) {
+      case ROW_NOT_BEGUN:
+        cl = cls[us[pos]];
+        if ((cl & CL_SPACE) && !(cl & CL_DELIM)) {
+          pos++;
+        } else if (cl & CL_TERM) {
+          pos++;
+          if (p->options & CSV_REPALL_NL)
+            ++*rows;
+        } else {
+          pstate = FIELD_NOT_BEGUN;
+        }
+        break;
+      case FIELD_NOT_BEGUN:
+      case FIELD_BEGUN:
+        if (quoted) {
+          /* Only a quote can end a quoted field */
+          pos = csv_next_mark(p, us, len, pos, &m, CL_QUOTE);
+          if (pos < len)
+            pos++, pstate = FIELD_MIGHT_HAVE_ENDED, spaces = 0;
+          break;
+        }
+        /* Outside of quoted fields every delimiter ends a field, only the
+           state at the next quote or terminator matters, which follows
+           from the bytes before it as spaces after a delimiter leave the
+           next field not begun */
+        start = pos;
+        pos = csv_next_break(p, us, len, pos, &m, fields);
+        for (i = pos; i > start && (cls[us[i - 1]] & (CL_SPACE | CL_DELIM)) == CL_SPACE; i--)
+          ;
+        if (i > start)
+          pstate = (cls[us[i - 1]] & CL_DELIM) ? FIELD_NOT_BEGUN : FIELD_BEGUN;
+        if (pos == len)
+          break;
+        if (cls[us[pos]] & CL_TERM) {
+          ++*fields;
+          ++*rows;
+          pstate = ROW_NOT_BEGUN;
+        } else if (pstate == FIELD_NOT_BEGUN) {
+          pstate = FIELD_BEGUN, quoted = 1;
+        } else if (strict) {
+          goto malformed;  /* Quote inside a non-quoted field */
+        }
+        pos++;
+        break;
+      case FIELD_MIGHT_HAVE_ENDED:
+        cl = cls[us[pos]];
+        if (cl & CL_DELIM) {
+          ++*fields;
+          pstate = FIELD_NOT_BEGUN, quoted = 0;
+        } else if (cl & CL_TERM) {
+          ++*fields;
+          ++*rows;
+          pstate = ROW_NOT_BEGUN, quoted = 0;
+        } else if (cl & CL_SPACE) {
+          spaces++;
+        } else if ((cl & CL_QUOTE) && !spaces) {
+          pstate = FIELD_BEGUN;  /* Escaped quote */
+        } else if (strict) {
+          goto malformed;
+        } else if (cl & CL_QUOTE) {
+          spaces = 0;  /* Kept as data, the field may still end here */
+        } else {
+          pstate = FIELD_BEGUN, spaces = 0;
+        }
+        pos++;
+        break;
+    }
+  }
+
+  entry_pos = pstate == FIELD_MIGHT_HAVE_ENDED ? spaces + 1 : 0;
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  p->column = 0;
+  return pos;
+
+malformed:
+  p->status = CSV_EPARSE;
+  entry_pos = pstate == FIELD_MIGHT_HAVE_ENDED ? spaces + 1 : 0;
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  p->column = 0;
+  return pos;
+}
+
+int
+csv_count_fini(struct csv_parser *p, size_t *rows, size_t *fields)
+{
+  /* Count the last row if it has no terminator, as csv_fini delivers it */
+  struct csv_stats *stats;
+  int last, ret;
+
+  assert(rows && fields && "received null count");
+
+  if (p == NULL)
+    return -1;
+
+  last = p->pstate != ROW_NOT_BEGUN && !p->skip_rest;
+  stats = p->stats, p->stats = NULL;
+  ret = csv_fini(p, NULL, NULL, NULL);
+  p->stats = stats;
+  if (ret != 0)
+    return -1;
+  if (last)
+    ++*rows, ++*fields;
+  return 0;
+}
+
+int
+csv_index_init(struct csv_index *x, size_t step)
+{
+  /* Initialize an index that records the start of every step-th row */
+  if (x == NULL || step == 0)
+    return -1;
+
+  x->step = step;
+  x->rows = x->bytes = 0;
+  x->size = x->count = 0;
+  x->offsets = NULL;
+  if (csv_reserve((void **)&x->offsets, &x->size, 0, 1, sizeof *x->offsets) != 0)
+    return -1;
+  x->offsets[x->count++] = 0;
+  return 0;
+}
+
+void
+csv_index_free(struct csv_index *x)
+{
+  if (x == NULL)
+    return;
+
+  free(x->offsets);
+  x->offsets = NULL;
+  x->size = x->count = 0;
+}
+
+size_t
+csv_index_parse(struct csv_parser *p, const void *s, size_t len, struct csv_index *x)
+{
+  /* Index the next len bytes of the input, returns the number of bytes
+   * processed as csv_parse does
+   */
+  struct csv_sink sink;
+  size_t pos;
+
+  assert(p && "received null csv_parser");
+  assert(x && "received null csv_index");
+
+  if (s == NULL)
+    return 0;
+
+  sink.field = csv_skip_field;
+  sink.row = csv_index_row;
+  sink.data = x;
+  sink.offset = x->bytes;
+  pos = csv_scan(p, s, len, -1, &sink);
+  x->bytes += pos;
+  return pos;
+}
+
+size_t
+csv_index_fd(struct csv_parser *p, int fd, struct csv_index *x)
+{
+  /* Index everything that can be read from fd, see csv_parse_fd */
+  struct csv_sink sink;
+  size_t pos;
+
+  assert(p && "received null csv_parser");
+  assert(x && "received null csv_index");
+
+  sink.field = csv_skip_field;
+  sink.row = csv_index_row;
+  sink.data = x;
+  sink.offset = x->bytes;
+  pos = csv_scan(p, NULL, 0, fd, &sink);
+  x->bytes += pos;
+  return pos;
+}
+
+int
+csv_index_fini(struct csv_parser *p, struct csv_index *x)
+{
+  /* Count a final row that doesn't end with a terminator, as csv_fini */
+  struct csv_sink sink;
+
+  assert(x && "received null csv_index");
+
+  sink.field = csv_skip_field;
+  sink.row = csv_index_last_row;
+  sink.data = x;
+  sink.stop = sink.status = 0;
+  return csv_fini_sink(p, NULL, NULL, NULL, &sink);
+}
+
+int
+csv_index_lookup(const struct csv_index *x, size_t row, size_t *offset, size_t *skip)
+{
+  /* Find the nearest indexed row at or before row, store its offset and
+   * the number of rows between it and row, returns 0 on success and -1 if
+   * row is beyond the end of the index
+   */
+  size_t i;
+
+  assert(x && "received null csv_index");
+
+  if (row > x->rows || x->count == 0)
+    return -1;
+
+  i = row / x->step;
+  if (i >= x->count)
+    i = x->count - 1;
+  if (offset)
+    *offset = x->offsets[i];
+  if (skip)
+    *skip = row - i * x->step;
+  return 0;
+}
+
+int
+csv_seek_row(struct csv_parser *p, int fd, const struct csv_index *x, size_t row)
+{
+  /* Position fd at the start of row of the indexed file and reset the
+   * parser to read from there, returns 0 on success and -1 on error
+   */
+#ifdef CSV_HAVE_POSIX_IO
+  struct csv_sink sink;
+  size_t offset, skip;
+
+  assert(p && "received null csv_parser");
+
+  if (csv_index_lookup(x, row, &offset, &skip) != 0)
+    return -1;
+
+  p->spaces = p->quoted = p->entry_pos = p->status = 0;
+  p->column = 0;
+  p->skip_rest = 0;
+  p->pstate = ROW_NOT_BEGUN;
+
+  if (lseek(fd, (off_t)offset, SEEK_SET) < 0) {
+    p->status = CSV_EREAD;
+    return -1;
+  }
+  if (skip) {
+    sink.field = csv_skip_field;
+    sink.row = csv_skip_row;
+    sink.data = &skip;
+    sink.offset = offset;
+    csv_scan(p, NULL, 0, fd, &sink);
+    if (p->status)
+      return -1;
+    /* The last rows may have been skipped without reaching a terminator */
+    p->spaces = p->quoted = p->entry_pos = 0;
+    p->column = 0;
+    p->skip_rest = 0;
+    p->pstate = ROW_NOT_BEGUN;
+  }
+  return 0;
+#else
+  (void)fd, (void)x, (void)row;
+  assert(p && "received null csv_parser");
+  p->status = CSV_EREAD;
+  return -1;
+#endif
+}
+
+/* Index files start with this, followed by step, rows, bytes and count and
+   the differences between consecutive offsets, all as base 128 varints */
+#define INDEX_MAGIC "CSVIDX1\n"
+
+static int
+csv_put_varint(FILE *fp, size_t v)
+{
+  int c;
+
+  do {
+    c = v & 0x7f;
+    v >>= 7;
+    if (putc(v ? c | 0x80 : c, fp) == EOF)
+      return -1;
+  } while (v);
+  return 0;
+}
+
+static int
+csv_get_varint(FILE *fp, size_t *v)
+{
+  size_t shift = 0;
+  int c;
+
+  *v = 0;
+  do {
+    if ((c = getc(fp)) == EOF || shift >= sizeof *v * 8)
+      return -1;
+    *v |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+int
+csv_index_save(const struct csv_index *x, const char *filename)
+{
+  /* Write the index to filename, returns 0 on success and -1 on error */
+  FILE *fp;
+  size_t i;
+  int err;
+
+  assert(x && "received null csv_index");
+
+  if ((fp = fopen(filename, "wb")) == NULL)
+    return -1;
+
+  err = fputs(INDEX_MAGIC, fp) == EOF
+        || csv_put_varint(fp, x->step) || csv_put_varint(fp, x->rows)
+        || csv_put_varint(fp, x->bytes) || csv_put_varint(fp, x->count);
+  for (i = 0; i < x->count && !err; i++)
+    err = csv_put_varint(fp, x->offsets[i] - (i ? x->offsets[i - 1] : 0));
+
+  if (fclose(fp) == EOF || err) {
+    remove(filename);
+    return -1;
+  }
+  return 0;
+}
+
+int
+csv_index_load(struct csv_index *x, const char *filename)
+{
+  /* Initialize x from an index written by csv_index_save, returns 0 on
+   * success and -1 if the file could not be read or is not a valid index
+   */
+  char magic[sizeof INDEX_MAGIC - 1];
+  size_t i, delta, count;
+  FILE *fp;
+  int err;
+
+  assert(x && "received null csv_index");
+
+  x->offsets = NULL;
+  x->size = x->count = 0;
+  if ((fp = fopen(filename, "rb")) == NULL)
+    return -1;
+
+  err = fread(magic, 1, sizeof magic, fp) != sizeof magic || memcmp(magic, INDEX_MAGIC, sizeof magic) != 0
+        || csv_get_varint(fp, &x->step) || csv_get_varint(fp, &x->rows)
+        || csv_get_varint(fp, &x->bytes) || csv_get_varint(fp, &count)
+        || x->step == 0 || count == 0 || count - 1 > x->rows / x->step
+        || csv_reserve((void **)&x->offsets, &x->size, 0, count, sizeof *x->offsets) != 0;
+  for (i = 0; i < count && !err; i++) {
+    err = csv_get_varint(fp, &delta);
+    x->offsets[i] = (i ? x->offsets[i - 1] : 0) + delta;
+    if (x->offsets[i] > x->bytes || (i && x->offsets[i] <= x->offsets[i - 1]))
+      err = 1;
+  }
+  if (!err && getc(fp) != EOF)
+    err = 1;
+
+  fclose(fp);
+  if (err) {
+    csv_index_free(x);
+    return -1;
+  }
+  x->count = count;
+  return 0;
+}
+
+/* Cache files start with CACHE_MAGIC, followed by the header words, a table
+   of CACHE_COLUMN_WORDS words for every column and the data of the columns.
+   Everything is stored as native size_t words aligned to their size so that
+   a mapped cache is used as it is; caches written with another word size or
+   byte order are rejected like stale ones */
+#define CACHE_MAGIC "CSVCACH2"
+#define CACHE_ORDER ((size_t)0x01020304)
+
+/* Words of the header */
+#define CACHE_H_ORDER   0  /* CACHE_ORDER */
+#define CACHE_H_WIDTH   1  /* sizeof (size_t) */
+#define CACHE_H_SIZE    2  /* Size of the source */
+#define CACHE_H_MTIME   3  /* Modification time of the source */
+#define CACHE_H_HASH    4  /* Hash of the contents of the source */
+#define CACHE_H_DIALECT 5  /* Hash of the parser settings that shape the fields */
+#define CACHE_H_ROWS    6
+#define CACHE_H_COLS    7
+#define CACHE_H_BYTES   8  /* Size of the cache file */
+#define CACHE_H_STAT    9  /* Time the source was examined, its time is only
+                              trusted if it is from an earlier second */
+#define CACHE_HEADER_WORDS 10
+#define CACHE_TABLE (sizeof CACHE_MAGIC - 1 + CACHE_HEADER_WORDS * sizeof(size_t))
+
+/* Words of a column in the table: how it is stored, the offset of its data
+   in the file, the number of entries of its dictionary and the number of
+   bytes of its values */
+#define CACHE_C_KIND   0
+#define CACHE_C_START  1
+#define CACHE_C_COUNT  2
+#define CACHE_C_VALUES 3
+#define CACHE_COLUMN_WORDS 4
+
+/* A column holds a bit per row set for null and missing fields, then either
+   rows + 1 offsets into its values, or a dictionary code per row followed
+   by count + 1 offsets into the values of the dictionary */
+#define CACHE_PLAIN 0
+#define CACHE_DICT  1
+
+#define CACHE_BITS (sizeof(size_t) * CHAR_BIT)
+#define CACHE_NULL_WORDS(rows) (((rows) + CACHE_BITS - 1) / CACHE_BITS)
+#define CACHE_PAD(n) (((n) + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t))
+
+/* Options that change the fields delivered, the others only change how */
+#define CACHE_DIALECT_OPTIONS (CSV_STRICT | CSV_REPALL_NL | CSV_STRICT_FINI | CSV_EMPTY_IS_NULL)
+
+#ifdef CSV_HAVE_POSIX_IO
+/* A column of a cache being built */
+struct csv_cache_column {
+  unsigned char *values;  /* Bytes of the fields back to back */
+  size_t values_used;
+  size_t values_size;
+  size_t *offsets;        /* Field r spans offsets[r] to offsets[r + 1] of values */
+  size_t offsets_size;
+  size_t *nulls;          /* Bit r set if field r is null or missing */
+  size_t nulls_size;
+  size_t rows;            /* Fields stored so far */
+};
+
+/* Fields of a cache being built, stored by column as they are parsed */
+struct csv_cache_table {
+  struct csv_cache_column *columns;
+  size_t ncols;           /* Columns in use */
+  size_t size;            /* Columns allocated */
+  size_t rows;            /* Rows completed */
+  size_t col;             /* Column of the next field of the current row */
+};
+
+static size_t
+csv_cache_hash(size_t h, const unsigned char *s, size_t len)
+{
+  /* Mix len bytes at s into the hash h a word at a time, the multiplier is
+     the 64-bit golden ratio or its low half where size_t is 32 bits */
+  const size_t k = (((size_t)0x9e3779b9 << 16) << 16) | 0x7f4a7c15;
+  size_t w;
+
+  for (; len >= sizeof w; s += sizeof w, len -= sizeof w) {
+    memcpy(&w, s, sizeof w);
+    h = (h ^ w) * k;
+    h ^= h >> (CACHE_BITS / 2);
+  }
+  w = 0;
+  if (len)
+    memcpy(&w, s, len);
+  h = (h ^ w ^ len) * k;
+  return h ^ (h >> (CACHE_BITS / 2));
+}
+
+static size_t
+csv_cache_dialect(const struct csv_parser *p)
+{
+  /* Hash of the options, delimiter, quote, classes of the space and term
+     characters and columns the fields depend on */
+  size_t h = (size_t)(p->options & CACHE_DIALECT_OPTIONS) | (size_t)p->delim_char << 8 | (size_t)p->quote_char << 16;
+  unsigned char cls[256];
+  int c;
+
+  /* From the functions rather than p->classes, which may be stale */
+  for (c = 0; c < 256; c++)
+    cls[c] = (unsigned char)((p->is_space ? p->is_space((unsigned char)c) != 0 : c == CSV_SPACE || c == CSV_TAB)
+                             | (p->is_term ? p->is_term((unsigned char)c) != 0 : c == CSV_CR || c == CSV_LF) << 1);
+  h = csv_cache_hash(h, cls, sizeof cls);
+  return p->columns ? csv_cache_hash(h, p->columns, p->columns_size / 8 + 1) : h;
+}
+
+static int
+csv_cache_append(struct csv_cache_column *c, const unsigned char *s, size_t len)
+{
+  /* Add a field to the column, a null one if s is NULL, returns 0 on success */
+  size_t bit = c->rows % CACHE_BITS;
+
+  if (csv_reserve((void **)&c->offsets, &c->offsets_size, c->rows + 1, 1, sizeof *c->offsets) != 0
+      || (bit == 0 && csv_reserve((void **)&c->nulls, &c->nulls_size, c->rows / CACHE_BITS, 1, sizeof *c->nulls) != 0)
+      || csv_reserve((void **)&c->values, &c->values_size, c->values_used, len, 1) != 0)
+    return -1;
+
+  if (bit == 0)
+    c->nulls[c->rows / CACHE_BITS] = 0;
+  if (s == NULL)
+    c->nulls[c->rows / CACHE_BITS] |= (size_t)1 << bit;
+  else if (len)
+    memcpy(c->values + c->values_used, s, len);
+  c->values_used += len;
+  c->offsets[++c->rows] = c->values_used;
+  return 0;
+}
+
+static int
+csv_cache_fill(struct csv_cache_column *c, size_t rows)
+{
+  /* Add missing fields to the column until it has rows fields */
+  while (c->rows < rows)
+    if (csv_cache_append(c, NULL, 0) != 0)
+      return -1;
+  return 0;
+}
+
+static void
+csv_cache_put_field(struct csv_sink *sink, const unsigned char *field, size_t len)
+{
+  /* Add a field to its column, starting a column for the longest row yet */
+  struct csv_cache_table *t = sink->data;
+  struct csv_cache_column *c;
+  int err = 0;
+
+  if (t->col == t->ncols) {
+    err = csv_reserve((void **)&t->columns, &t->size, t->ncols, 1, sizeof *t->columns) != 0;
+    if (!err) {
+      c = t->columns + t->ncols++;
+      memset(c, 0, sizeof *c);
+      err = csv_reserve((void **)&c->offsets, &c->offsets_size, 0, 1, sizeof *c->offsets) != 0;
+      if (!err)
+        c->offsets[0] = 0;
+    }
+  }
+  if (!err) {
+    c = t->columns + t->col++;
+    err = csv_cache_fill(c, t->rows) != 0 || csv_cache_append(c, field, len) != 0;
+  }
+  if (err) {
+    sink->status = CSV_ENOMEM;
+    sink->stop = 1;
+  }
+}
+
+static void
+csv_cache_put_row(struct csv_sink *sink, int c, size_t pos)
+{
+  /* End the current row, its missing fields are filled in later */
+  struct csv_cache_table *t = sink->data;
+
+  (void)c, (void)pos;
+  t->rows++;
+  t->col = 0;
+}
+
+static void
+csv_cache_table_free(struct csv_cache_table *t)
+{
+  size_t i;
+
+  for (i = 0; i < t->ncols; i++) {
+    free(t->columns[i].values);
+    free(t->columns[i].offsets);
+    free(t->columns[i].nulls);
+  }
+  free(t->columns);
+}
+
+static size_t
+csv_cache_read(int fd, unsigned char *buf, size_t size, int *err)
+{
+  /* Read until buf is full or the input ends, so that the source is hashed
+     in the same blocks however reads return, sets *err on failure */
+  size_t n = 0;
+  ssize_t r;
+
+  while (n < size) {
+    r = read(fd, buf + n, size - n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      *err = r < 0;
+      break;
+    }
+    n += r;
+  }
+  return n;
+}
+
+static int
+csv_cache_hash_fd(int fd, size_t *h)
+{
+  /* Hash what can be read from fd as csv_cache_build does */
+  unsigned char *buf;
+  size_t n;
+  int err = 0;
+
+  if ((buf = malloc(READ_SIZE)) == NULL)
+    return -1;
+  *h = 0;
+  do {
+    n = csv_cache_read(fd, buf, READ_SIZE, &err);
+    *h = csv_cache_hash(*h, buf, n);
+  } while (n == READ_SIZE && !err);
+  free(buf);
+  return err ? -1 : 0;
+}
+
+static int
+csv_cache_write(FILE *fp, const void *s, size_t len, size_t *pos)
+{
+  /* Write len bytes at s, returns 0 on success */
+  if (len && fwrite(s, 1, len, fp) != len)
+    return -1;
+  *pos += len;
+  return 0;
+}
+
+static int
+csv_cache_pad(FILE *fp, size_t *pos)
+{
+  /* Pad the output to a whole number of words */
+  static const unsigned char zero[sizeof(size_t)];
+
+  return csv_cache_write(fp, zero, CACHE_PAD(*pos) - *pos, pos);
+}
+
+static int
+csv_cache_write_column(FILE *fp, const struct csv_cache_column *c, size_t *desc, size_t *pos)
+{
+  /* Write the column, replacing its values by codes into a dictionary of
+   * the distinct ones when that makes it smaller, and fill in its words of
+   * the table; returns 0 on success and -1 on error
+   */
+  const size_t *off = c->offsets;
+  size_t *slots = NULL, *entries = NULL, *codes = NULL;
+  size_t r, e, i, h, len, mask = 0, count = 0, bytes = 0, cap = c->rows / 2;
+  int dict = 0, err;
+
+  /* The dictionary holds at most half as many values as there are rows,
+     and is given up as soon as most of the rows seen have values of their
+     own; the column is written plain if there is no memory for it */
+  while (mask < 2 * cap)
+    mask = 2 * mask + 1;
+  if (cap && (slots = calloc(mask + 1, sizeof *slots)) != NULL
+      && (entries = malloc(cap * sizeof *entries)) != NULL
+      && (codes = malloc(c->rows * sizeof *codes)) != NULL) {
+    dict = 1;
+    for (r = 0; r < c->rows && dict; r++) {
+      codes[r] = 0;
+      if (c->nulls[r / CACHE_BITS] >> (r % CACHE_BITS) & 1)
+        continue;
+      len = off[r + 1] - off[r];
+      h = csv_cache_hash(0, c->values + off[r], len);
+      for (i = h & mask; slots[i]; i = (i + 1) & mask) {
+        e = entries[slots[i] - 1];
+        if (off[e + 1] - off[e] == len && memcmp(c->values + off[e], c->values + off[r], len) == 0)
+          break;
+      }
+      if (slots[i] == 0) {
+        if (count == cap || count > r / 2 + 64 || bytes + len + (count + 2) * sizeof(size_t) >= c->values_used) {
+          dict = 0;
+          break;
+        }
+        entries[count] = r;
+        slots[i] = ++count;
+        bytes += len;
+      }
+      codes[r] = slots[i] - 1;
+    }
+  }
+
+  desc[CACHE_C_KIND] = dict ? CACHE_DICT : CACHE_PLAIN;
+  desc[CACHE_C_START] = *pos;
+  desc[CACHE_C_COUNT] = dict ? count : 0;
+  desc[CACHE_C_VALUES] = dict ? bytes : c->values_used;
+
+  err = csv_cache_write(fp, c->nulls, CACHE_NULL_WORDS(c->rows) * sizeof(size_t), pos) != 0;
+  if (dict) {
+    /* The offsets of the dictionary take the place of the hash table */
+    slots[0] = 0;
+    for (e = 0; e < count; e++)
+      slots[e + 1] = slots[e] + off[entries[e] + 1] - off[entries[e]];
+    err = err || csv_cache_write(fp, codes, c->rows * sizeof *codes, pos) != 0
+          || csv_cache_write(fp, slots, (count + 1) * sizeof *slots, pos) != 0;
+    for (e = 0; e < count && !err; e++)
+      err = csv_cache_write(fp, c->values + off[entries[e]], off[entries[e] + 1] - off[entries[e]], pos) != 0;
+  } else {
+    err = err || csv_cache_write(fp, off, (c->rows + 1) * sizeof *off, pos) != 0
+          || csv_cache_write(fp, c->values, c->values_used, pos) != 0;
+  }
+  err = err || csv_cache_pad(fp, pos) != 0;
+
+  free(slots);
+  free(entries);
+  free(codes);
+  return err ? -1 : 0;
+}
+
+static unsigned long
+csv_cache_serial(void)
+{
+  /* Number the temporary caches of this process, from any thread */
+  static unsigned long serial;
+  unsigned long n;
+#ifdef HAVE_PTHREAD
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_mutex_lock(&lock);
+  n = serial++;
+  pthread_mutex_unlock(&lock);
+#else
+  n = serial++;
+#endif
+  return n;
+}
+
+static int
+csv_cache_save(struct csv_cache_table *t, const size_t *header, const char *cache)
+{
+  /* Write the cache to a temporary file renamed to cache once complete, so
+   * that readers never see a partial cache, returns 0 on success, -1 on a
+   * write error and 1 if memory ran out
+   */
+  size_t i, pos = 0, hdr[CACHE_HEADER_WORDS], *table;
+  char *tmp;
+  FILE *fp = NULL;
+  int fd, err = 0;
+
+  if ((table = calloc(t->ncols + 1, CACHE_COLUMN_WORDS * sizeof *table)) == NULL
+      || (tmp = malloc(strlen(cache) + 64)) == NULL) {
+    free(table);
+    return 1;
+  }
+  /* No other call uses the name, a file by that name was left behind by a
+     process that had the same id */
+  sprintf(tmp, "%s.%lu.%lu.tmp", cache, (unsigned long)getpid(), csv_cache_serial());
+  fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0 && errno == EEXIST && unlink(tmp) == 0)
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0 || (fp = fdopen(fd, "wb")) == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      remove(tmp);
+    }
+    free(table);
+    free(tmp);
+    return -1;
+  }
+
+
+  /* The header and table are written again once the columns are placed */
+  memcpy(hdr, header, sizeof hdr);
+  err = csv_cache_write(fp, CACHE_MAGIC, sizeof CACHE_MAGIC - 1, &pos) != 0
+        || csv_cache_write(fp, hdr, sizeof hdr, &pos) != 0
+        || csv_cache_write(fp, table, t->ncols * CACHE_COLUMN_WORDS * sizeof *table, &pos) != 0;
+  for (i = 0; i < t->ncols && !err; i++)
+    err = csv_cache_write_column(fp, t->columns + i, table + i * CACHE_COLUMN_WORDS, &pos) != 0;
+  if (!err) {
+    hdr[CACHE_H_BYTES] = pos;
+    err = fseek(fp, (long)(sizeof CACHE_MAGIC - 1), SEEK_SET) != 0
+          || csv_cache_write(fp, hdr, sizeof hdr, &pos) != 0
+          || csv_cache_write(fp, table, t->ncols * CACHE_COLUMN_WORDS * sizeof *table, &pos) != 0;
+  }
+  if (fclose(fp) != 0 || (!err && rename(tmp, cache) != 0))
+    err = 1;
+  if (err)
+    remove(tmp);
+  free(table);
+  free(tmp);
+  return err ? -1 : 0;
+}
+
+static int
+csv_cache_check(const struct csv_cache *c, const size_t *header)
+{
+  /* Check that the columns lie within the cache, so that csv_cache_field
+     only has to check the offsets it reads, returns 0 if they do */
+  const size_t *desc = (const size_t *)(c->data + CACHE_TABLE);
+  size_t i, rest, need, words = CACHE_NULL_WORDS(c->rows);
+
+  if (c->size < CACHE_TABLE || header[CACHE_H_BYTES] != c->size
+      || c->rows > c->size / sizeof(size_t) || c->cols > (c->size - CACHE_TABLE) / sizeof(size_t) / CACHE_COLUMN_WORDS)
+    return -1;
+  for (i = 0; i < c->cols; i++, desc += CACHE_COLUMN_WORDS) {
+    if (desc[CACHE_C_START] % sizeof(size_t) || desc[CACHE_C_START] > c->size
+        || desc[CACHE_C_COUNT] > c->size / sizeof(size_t))
+      return -1;
+    rest = (c->size - desc[CACHE_C_START]) / sizeof(size_t);
+    need = words + c->rows + 1;
+    if (desc[CACHE_C_KIND] == CACHE_DICT)
+      need += desc[CACHE_C_COUNT];
+    else if (desc[CACHE_C_KIND] != CACHE_PLAIN || desc[CACHE_C_COUNT])
+      return -1;
+    if (need > rest || desc[CACHE_C_VALUES] > (rest - need) * sizeof(size_t))
+      return -1;
+  }
+  return 0;
+}
+#endif
+
+int
+csv_cache_build(struct csv_parser *p, const char *source, const char *cache)
+{
+  /* Parse source and write its fields by column to the file cache, returns
+   * 0 on success and -1 on error with the parser's status telling why
+   */
+#ifdef CSV_HAVE_POSIX_IO
+  size_t header[CACHE_HEADER_WORDS], n, i, h = 0;
+  struct csv_cache_table t;
+  struct csv_sink sink;
+  unsigned char *buf;
+  struct stat st;
+  time_t now;
+  int fd, err = 0, stopped = 0;
+
+  assert(p && "received null csv_parser");
+
+  CHECK_CLASSES(p);
+  if ((fd = open(source, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    p->status = CSV_EREAD;
+    return -1;
+  }
+  now = time(NULL);
+  if ((buf = malloc(READ_SIZE)) == NULL) {
+    close(fd);
+    p->status = CSV_ENOMEM;
+    return -1;
+  }
+
+  memset(&t, 0, sizeof t);
+  sink.field = csv_cache_put_field;
+  sink.row = csv_cache_put_row;
+  sink.data = &t;
+  sink.stop = 0;
+  sink.status = 0;
+  sink.offset = 0;
+
+  /* The stat is taken before reading.  A source changed meanwhile gets a
+     later time, or keeps its time if that is the second of the stat, in
+     which case csv_cache_load compares the hash; either way it no longer
+     matches and the cache is rebuilt when next loaded */
+  do {
+    n = csv_cache_read(fd, buf, READ_SIZE, &err);
+    h = csv_cache_hash(h, buf, n);
+    stopped = csv_parse_to(p, buf, n, NULL, NULL, NULL, &sink) < n;
+  } while (n == READ_SIZE && !err && !stopped);
+  free(buf);
+  close(fd);
+
+  if (err || stopped || csv_fini_sink(p, NULL, NULL, NULL, &sink) != 0 || sink.status) {
+    if (err)
+      p->status = CSV_EREAD;
+    if (sink.status)
+      p->status = sink.status;
+    csv_cache_table_free(&t);
+    return -1;
+  }
+
+  for (i = 0; i < t.ncols && !err; i++)
+    err = csv_cache_fill(t.columns + i, t.rows) != 0;
+  if (!err) {
+    header[CACHE_H_ORDER] = CACHE_ORDER;
+    header[CACHE_H_WIDTH] = sizeof(size_t);
+    header[CACHE_H_SIZE] = (size_t)st.st_size;
+    header[CACHE_H_MTIME] = (size_t)st.st_mtime;
+    header[CACHE_H_HASH] = h;
+    header[CACHE_H_DIALECT] = csv_cache_dialect(p);
+    header[CACHE_H_ROWS] = t.rows;
+    header[CACHE_H_COLS] = t.ncols;
+    header[CACHE_H_BYTES] = 0;
+    header[CACHE_H_STAT] = (size_t)now;
+    err = csv_cache_save(&t, header, cache);
+  }
+  csv_cache_table_free(&t);
+  if (err)
+    p->status = err > 0 ? CSV_ENOMEM : CSV_EWRITE;
+  return err ? -1 : 0;
+#else
+  (void)source, (void)cache;
+  assert(p && "received null csv_parser");
+  p->status = CSV_EREAD;
+  return -1;
+#endif
+}
+
+int
+csv_cache_load(struct csv_cache *c, const struct csv_parser *p, const char *source, const char *cache, int options)
+{
+  /* Map the cache of source written by csv_cache_build, returns 0 on
+   * success and -1 if it is missing, invalid, was built with other parser
+   * settings or source changed since; with CSV_CACHE_VERIFY the contents of
+   * source are always compared, otherwise only if its time changed or is
+   * not older than the build
+   */
+#ifdef CSV_HAVE_POSIX_IO
+  struct stat st, src;
+  const size_t *header;
+  unsigned char *buf;
+  size_t h;
+  int fd, ok = 0, err = 0;
+#ifdef HAVE_SYS_MMAN_H
+  void *m;
+#endif
+
+  assert(c && "received null csv_cache");
+  assert(p && "received null csv_parser");
+
+  c->data = NULL;
+  c->size = c->rows = c->cols = 0;
+  c->mapped = 0;
+  if (stat(source, &src) != 0 || (fd = open(cache, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= CACHE_TABLE) {
+    c->size = (size_t)st.st_size;
+#ifdef HAVE_SYS_MMAN_H
+    if ((m = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+      c->data = m;
+      c->mapped = 1;
+    }
+#endif
+    /* Read the cache where it can't be mapped */
+    if (c->data == NULL && (buf = malloc(c->size)) != NULL) {
+      if (csv_cache_read(fd, buf, c->size, &err) == c->size && !err)
+        c->data = buf;
+      else
+        free(buf);
     }
   }
-  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-  return pos;
+  close(fd);
+  if (c->data == NULL) {
+    c->size = 0;
+    return -1;
+  }
+
+  header = (const size_t *)(c->data + sizeof CACHE_MAGIC - 1);
+  c->rows = header[CACHE_H_ROWS];
+  c->cols = header[CACHE_H_COLS];
+  if (memcmp(c->data, CACHE_MAGIC, sizeof CACHE_MAGIC - 1) == 0 && header[CACHE_H_ORDER] == CACHE_ORDER
+      && header[CACHE_H_WIDTH] == sizeof(size_t) && header[CACHE_H_DIALECT] == csv_cache_dialect(p)
+      && csv_cache_check(c, header) == 0 && header[CACHE_H_SIZE] == (size_t)src.st_size) {
+    ok = header[CACHE_H_MTIME] == (size_t)src.st_mtime && header[CACHE_H_MTIME] < header[CACHE_H_STAT]
+         && !(options & CSV_CACHE_VERIFY);
+    if (!ok && (fd = open(source, O_RDONLY)) >= 0) {
+      ok = csv_cache_hash_fd(fd, &h) == 0 && h == header[CACHE_H_HASH];
+      close(fd);
+    }
+  }
+  if (!ok) {
+    csv_cache_free(c);
+    return -1;
+  }
+  return 0;
+#else
+  (void)p, (void)source, (void)cache, (void)options;
+  assert(c && "received null csv_cache");
+  c->data = NULL;
+  c->size = c->rows = c->cols = 0;
+  c->mapped = 0;
+  return -1;
+#endif
+}
+
+int
+csv_cache_open(struct csv_cache *c, struct csv_parser *p, const char *source, const char *cache, int options)
+{
+  /* Load the cache of source, building it first if it is missing or stale,
+     returns 0 on success and -1 on error with the parser's status telling
+     why */
+  if (csv_cache_load(c, p, source, cache, options) == 0)
+    return 0;
+  if (csv_cache_build(p, source, cache) != 0)
+    return -1;
+  if (csv_cache_load(c, p, source, cache, 0) != 0) {
+    p->status = CSV_EREAD;
+    return -1;
+  }
+  return 0;
+}
+
+const void *
+csv_cache_field(const struct csv_cache *c, size_t row, size_t col, size_t *len)
+{
+  /* Return field col of row and store its length in len, NULL for null and
+   * missing fields, fields outside the table and offsets of a damaged cache
+   */
+  const size_t *desc, *nulls, *off;
+  size_t n = c ? c->rows + 1 : 0;
+
+  if (len)
+    *len = 0;
+  if (c == NULL || row >= c->rows || col >= c->cols)
+    return NULL;
+
+  desc = (const size_t *)(c->data + CACHE_TABLE) + col * CACHE_COLUMN_WORDS;
+  nulls = (const size_t *)(c->data + desc[CACHE_C_START]);
+  if (nulls[row / CACHE_BITS] >> (row % CACHE_BITS) & 1)
+    return NULL;
+  off = nulls + CACHE_NULL_WORDS(c->rows);
+  if (desc[CACHE_C_KIND] == CACHE_DICT) {
+    row = off[row];
+    off += c->rows;
+    n = desc[CACHE_C_COUNT] + 1;
+    if (row >= desc[CACHE_C_COUNT])
+      return NULL;
+  }
+  if (off[row] > off[row + 1] || off[row + 1] > desc[CACHE_C_VALUES])
+    return NULL;
+  if (len)
+    *len = off[row + 1] - off[row];
+  return (const unsigned char *)(off + n) + off[row];
+}
+
+void
+csv_cache_free(struct csv_cache *c)
+{
+  /* Unmap or free the cache */
+  if (c == NULL || c->data == NULL)
+    return;
+
+#ifdef HAVE_SYS_MMAN_H
+  if (c->mapped)
+    munmap((void *)c->data, c->size);
+  else
+#endif
+    free((void *)c->data);
+  c->data = NULL;
+  c->size = c->rows = c->cols = 0;
+  c->mapped = 0;
 }
 
 size_t
@@ -481,9 +5257,14 @@ csv_fwrite (FILE *fp, const void *src, size_t src_size)
 size_t
 csv_write2 (void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char quote)
 {
+  /* The size of the output is known from a count of the quotes, the data
+   * is then copied in runs that end with a quote, which is doubled.  If
+   * dest is too small as much of the output as fits is written.
+   */
   unsigned char *cdest = dest;
   const unsigned char *csrc = src;
-  size_t chars = 0;
+  const unsigned char *q;
+  size_t chars, quotes, run, n, out = 0;
 
   if (src == NULL)
     return 0;
@@ -491,26 +5272,43 @@ csv_write2 (void *dest, size_t dest_size, const void *src, size_t src_size, unsi
   if (dest == NULL)
     dest_size = 0;
 
-  if (dest_size > 0)
-    *cdest++ = quote;
-  chars++;
+  quotes = csv_count_byte(csrc, src_size, quote);
+  if (src_size > SIZE_MAX - 2 || quotes > SIZE_MAX - 2 - src_size)
+    chars = SIZE_MAX;
+  else
+    chars = src_size + quotes + 2;
 
-  while (src_size) {
-    if (*csrc == quote) {
-      if (dest_size > chars)
-        *cdest++ = quote;
-      if (chars < SIZE_MAX) chars++;
+  if (dest_size == 0)
+    return chars;
+
+  if (chars < SIZE_MAX && dest_size >= chars) {
+    cdest[0] = quote;
+    csv_escape(cdest + 1, csrc, src_size, quote, quotes);
+    cdest[chars - 1] = quote;
+    return chars;
+  }
+
+  /* Only part of the output fits */
+  cdest[out++] = quote;
+  while (src_size && out < dest_size) {
+    q = quotes ? memchr(csrc, quote, src_size) : NULL;
+    run = q ? (size_t)(q - csrc) + 1 : src_size;
+    n = run < dest_size - out ? run : dest_size - out;
+    memcpy(cdest + out, csrc, n);
+    out += n;
+    if (n < run)
+      return chars;
+    if (q) {
+      quotes--;
+      if (out < dest_size)
+        cdest[out++] = quote;
     }
-    if (dest_size > chars)
-      *cdest++ = *csrc;
-    if (chars < SIZE_MAX) chars++;
-    src_size--;
-    csrc++;
+    csrc += run;
+    src_size -= run;
   }
 
-  if (dest_size > chars)
-    *cdest = quote;
-  if (chars < SIZE_MAX) chars++;
+  if (src_size == 0 && out < dest_size)
+    cdest[out] = quote;
 
   return chars;
 }
@@ -519,6 +5317,8 @@ int
 csv_fwrite2 (FILE *fp, const void *src, size_t src_size, unsigned char quote)
 {
   const unsigned char *csrc = src;
+  const unsigned char *q;
+  size_t run;
 
   if (fp == NULL || src == NULL)
     return 0;
@@ -526,15 +5326,16 @@ csv_fwrite2 (FILE *fp, const void *src, size_t src_size, unsigned char quote)
   if (fputc(quote, fp) == EOF)
     return EOF;
 
+  /* Write runs that end with a quote, then double the quote */
   while (src_size) {
-    if (*csrc == quote) {
-      if (fputc(quote, fp) == EOF)
-        return EOF;
-    }
-    if (fputc(*csrc, fp) == EOF)
+    q = memchr(csrc, quote, src_size);
+    run = q ? (size_t)(q - csrc) + 1 : src_size;
+    if (fwrite(csrc, 1, run, fp) != run)
       return EOF;
-    src_size--;
-    csrc++;
+    if (q && fputc(quote, fp) == EOF)
+      return EOF;
+    csrc += run;
+    src_size -= run;
   }
 
   if (fputc(quote, fp) == EOF) {
@@ -543,3 +5344,463 @@ csv_fwrite2 (FILE *fp, const void *src, size_t src_size, unsigned char quote)
 
   return 0;
 }
+
+static int
+csv_writer_setup(struct csv_writer *w, int out, unsigned char options)
+{
+  /* Initialize the writer for output out, returns 0 on success */
+  if (w == NULL)
+    return -1;
+
+  w->out = out;
+  w->fp = NULL;
+  w->fd = -1;
+  w->used = w->size = 0;
+  w->fields = 0;
+  w->blank = 1;
+  w->status = 0;
+  w->options = options;
+  w->quote_char = CSV_QUOTE;
+  w->delim_char = CSV_COMMA;
+
+  if (out == CSV_OUT_MEM) {
+    w->buf = NULL;
+    return 0;
+  }
+  if ((w->buf = malloc(WRITE_SIZE)) == NULL)
+    return -1;
+  w->size = WRITE_SIZE;
+  return 0;
+}
+
+int
+csv_writer_init(struct csv_writer *w, unsigned char options)
+{
+  /* Initialize a writer that collects its output in memory */
+  return csv_writer_setup(w, CSV_OUT_MEM, options);
+}
+
+int
+csv_writer_init_fp(struct csv_writer *w, FILE *fp, unsigned char options)
+{
+  /* Initialize a writer to the stream fp */
+  if (fp == NULL || csv_writer_setup(w, CSV_OUT_FILE, options) != 0)
+    return -1;
+  w->fp = fp;
+  return 0;
+}
+
+int
+csv_writer_init_fd(struct csv_writer *w, int fd, unsigned char options)
+{
+  /* Initialize a writer to the file descriptor fd */
+#ifdef CSV_HAVE_POSIX_IO
+  if (fd < 0 || csv_writer_setup(w, CSV_OUT_FD, options) != 0)
+    return -1;
+  w->fd = fd;
+  return 0;
+#else
+  (void)w, (void)fd, (void)options;
+  return -1;
+#endif
+}
+
+void
+csv_writer_set_delim(struct csv_writer *w, unsigned char c)
+{
+  /* Set the delimiter */
+  if (w) w->delim_char = c;
+}
+
+void
+csv_writer_set_quote(struct csv_writer *w, unsigned char c)
+{
+  /* Set the quote character */
+  if (w) w->quote_char = c;
+}
+
+int
+csv_writer_error(const struct csv_writer *w)
+{
+  assert(w && "received null csv_writer");
+
+  /* Return the current status of the writer */
+  return w->status;
+}
+
+const void *
+csv_writer_data(const struct csv_writer *w, size_t *len)
+{
+  /* Return the output of a memory writer and store its size in len */
+  assert(w && "received null csv_writer");
+
+  if (len)
+    *len = w->used;
+  return w->buf;
+}
+
+void
+csv_writer_free(struct csv_writer *w)
+{
+  /* Free the output buffer, buffered output that wasn't flushed is lost */
+  if (w == NULL)
+    return;
+
+  free(w->buf);
+  w->buf = NULL;
+  w->used = w->size = 0;
+}
+
+static int
+csv_writer_out(struct csv_writer *w, const unsigned char *s, size_t len)
+{
+  /* Write the buffered output followed by len bytes at s to the stream or
+   * descriptor of the writer and empty the buffer, returns 0 on success
+   */
+  if (w->out == CSV_OUT_FILE) {
+    if ((w->used && fwrite(w->buf, 1, w->used, w->fp) != w->used)
+        || (len && fwrite(s, 1, len, w->fp) != len)) {
+      w->status = CSV_EWRITE;
+      return -1;
+    }
+  }
+#ifdef CSV_HAVE_POSIX_IO
+  else if (w->out == CSV_OUT_FD) {
+    /* Both parts go out with a single writev where possible */
+    const unsigned char *part[2];
+    size_t part_len[2];
+    ssize_t r;
+    size_t n;
+    int i = 0;
+#ifdef HAVE_SYS_UIO_H
+    struct iovec iov[2];
+    int j;
+#endif
+
+    part[0] = w->buf, part_len[0] = w->used;
+    part[1] = s, part_len[1] = len;
+    for (;;) {
+      while (i < 2 && part_len[i] == 0)
+        i++;
+      if (i == 2)
+        break;
+#ifdef HAVE_SYS_UIO_H
+      for (j = i; j < 2; j++) {
+        iov[j - i].iov_base = (void *)part[j];
+        iov[j - i].iov_len = part_len[j];
+      }
+      r = writev(w->fd, iov, 2 - i);
+#else
+      r = write(w->fd, part[i], part_len[i]);
+#endif
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        w->status = CSV_EWRITE;
+        return -1;
+      }
+      while (r > 0) {
+        n = (size_t)r < part_len[i] ? (size_t)r : part_len[i];
+        part[i] += n, part_len[i] -= n;
+        r -= n;
+        if (part_len[i] == 0)
+          i++;
+      }
+    }
+  }
+#endif
+  w->used = 0;
+  return 0;
+}
+
+static int
+csv_writer_put(struct csv_writer *w, const unsigned char *s, size_t len)
+{
+  /* Append len bytes at s to the output, returns 0 on success */
+  if (len <= w->size - w->used) {
+    memcpy(w->buf + w->used, s, len);
+    w->used += len;
+    return 0;
+  }
+
+  if (w->out == CSV_OUT_MEM) {
+    if (csv_reserve((void **)&w->buf, &w->size, w->used, len, 1) != 0) {
+      w->status = CSV_ENOMEM;
+      return -1;
+    }
+    memcpy(w->buf + w->used, s, len);
+    w->used += len;
+    return 0;
+  }
+
+  /* Data that doesn't fit in the buffer is written straight out */
+  if (len >= w->size)
+    return csv_writer_out(w, s, len);
+  if (csv_writer_out(w, NULL, 0) != 0)
+    return -1;
+  memcpy(w->buf, s, len);
+  w->used = len;
+  return 0;
+}
+
+int
+csv_writer_field(struct csv_writer *w, const void *s, size_t len)
+{
+  /* Write a field of the current record, quoting it if needed or with the
+   * CSV_QUOTE_ALL option.  A null s writes an empty field that is never
+   * quoted, which CSV_EMPTY_IS_NULL reads back as null, an empty field is
+   * always quoted.
+   * Returns 0 on success and -1 on error.
+   */
+  const unsigned char *us = s;
+  unsigned char set[4];
+  const unsigned char *q;
+  size_t quotes, need;
+  int quote;
+
+  assert(w && "received null csv_writer");
+
+  if (w->status)
+    return -1;
+
+  if (w->fields++ && csv_writer_put(w, &w->delim_char, 1) != 0)
+    return -1;
+
+  if (us == NULL)
+    return 0;
+
+  if (w->options & CSV_QUOTE_ALL || len == 0)
+    quote = 1;
+  else if (us[0] == CSV_SPACE || us[0] == CSV_TAB || us[len - 1] == CSV_SPACE || us[len - 1] == CSV_TAB)
+    quote = 1;  /* Surrounding spaces would be trimmed */
+  else {
+    set[0] = w->delim_char, set[1] = w->quote_char, set[2] = CSV_CR, set[3] = CSV_LF;
+    quote = csv_span(us, len, set, 4) < len;
+  }
+
+  w->blank = 0;
+  if (!quote)
+    return csv_writer_put(w, us, len);
+
+  quotes = csv_count_byte(us, len, w->quote_char);
+  need = len < SIZE_MAX - 2 - quotes ? len + quotes + 2 : SIZE_MAX;
+  if (need > w->size - w->used) {
+    if (w->out == CSV_OUT_MEM) {
+      if (csv_reserve((void **)&w->buf, &w->size, w->used, need, 1) != 0) {
+        w->status = CSV_ENOMEM;
+        return -1;
+      }
+    } else if (need <= w->size && csv_writer_out(w, NULL, 0) != 0)
+      return -1;
+  }
+
+  /* Fields that fit in the buffer are escaped straight into it */
+  if (need <= w->size - w->used) {
+    w->buf[w->used] = w->quote_char;
+    w->used += csv_escape(w->buf + w->used + 1, us, len, w->quote_char, quotes) + 2;
+    w->buf[w->used - 1] = w->quote_char;
+    return 0;
+  }
+
+  if (csv_writer_put(w, &w->quote_char, 1) != 0)
+    return -1;
+  /* Copy runs that end with a quote, then double the quote */
+  while (len && (q = memchr(us, w->quote_char, len)) != NULL) {
+    if (csv_writer_put(w, us, (size_t)(q - us) + 1) != 0 || csv_writer_put(w, q, 1) != 0)
+      return -1;
+    len -= (size_t)(q - us) + 1;
+    us = q + 1;
+  }
+  if (csv_writer_put(w, us, len) != 0 || csv_writer_put(w, &w->quote_char, 1) != 0)
+    return -1;
+  return 0;
+}
+
+int
+csv_writer_end_row(struct csv_writer *w)
+{
+  /* End the current record.  A record of a single null field is written
+   * as a quoted empty field, an empty line would not be read back as a
+   * record.  Returns 0 on success and -1 on error.
+   */
+  static const unsigned char crlf[2] = {CSV_CR, CSV_LF};
+  unsigned char empty[2];
+
+  assert(w && "received null csv_writer");
+
+  if (w->status)
+    return -1;
+
+  if (w->fields == 1 && w->blank) {
+    empty[0] = empty[1] = w->quote_char;
+    if (csv_writer_put(w, empty, 2) != 0)
+      return -1;
+  }
+  w->fields = 0;
+  w->blank = 1;
+
+  if (w->options & CSV_WRITE_CRLF)
+    return csv_writer_put(w, crlf, 2);
+  return csv_writer_put(w, crlf + 1, 1);
+}
+
+int
+csv_writer_flush(struct csv_writer *w)
+{
+  /* Write out the buffered output, streams are flushed as well.  Returns 0
+   * on success and -1 on error.
+   */
+  assert(w && "received null csv_writer");
+
+  if (w->status)
+    return -1;
+  if (w->out == CSV_OUT_MEM)
+    return 0;
+  if (csv_writer_out(w, NULL, 0) != 0)
+    return -1;
+  if (w->out == CSV_OUT_FILE && fflush(w->fp) == EOF) {
+    w->status = CSV_EWRITE;
+    return -1;
+  }
+  return 0;
+}
+
+static int
+csv_writer_slice(struct csv_writer *w, const void *const *fields, const size_t *lens, size_t rows, size_t cols)
+{
+  /* Write rows records of cols fields each, see csv_writer_rows */
+  const char *s;
+  size_t r, c, i, len;
+
+  for (r = 0, i = 0; r < rows; r++) {
+    for (c = 0; c < cols; c++, i++) {
+      s = fields[i];
+      len = lens ? lens[i] : s ? strlen(s) : 0;
+      if (csv_writer_field(w, s, len) != 0)
+        return -1;
+    }
+    if (csv_writer_end_row(w) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+#ifdef HAVE_PTHREAD
+#define WRITE_FIELDS_MIN 4096       /* Fields formatted by a thread at least */
+#define WRITE_BLOCK_FIELDS (1 << 20) /* Fields formatted by a thread at most per round */
+
+/* Rows formatted by a worker thread of csv_writer_rows */
+struct csv_write_job {
+  pthread_t thread;
+  int started;
+  struct csv_writer w;          /* Memory writer the rows are formatted into */
+  const void *const *fields;
+  const size_t *lens;
+  size_t rows;
+  size_t cols;
+};
+
+static void *
+csv_write_run(void *arg)
+{
+  struct csv_write_job *job = arg;
+
+  csv_writer_slice(&job->w, job->fields, job->lens, job->rows, job->cols);
+  return NULL;
+}
+#endif
+
+int
+csv_writer_rows(struct csv_writer *w, const void *const *fields, const size_t *lens, size_t rows, size_t cols,
+                unsigned int nthreads)
+{
+  /* Write rows records of cols fields, field c of row r is fields[r * cols
+   * + c] of length lens[r * cols + c], as csv_writer_field and
+   * csv_writer_end_row would.  Blocks of rows are formatted by up to
+   * nthreads threads, 0 for one per CPU, into buffers of their own that are
+   * then written out in order.  Returns 0 on success and -1 on error.
+   */
+#ifdef HAVE_PTHREAD
+  struct csv_write_job *jobs;
+  size_t done = 0, per, n;
+  unsigned int i, njobs;
+  const unsigned char *out;
+  int failed = 0;
+#endif
+
+  assert(w && "received null csv_writer");
+
+  if (w->status || w->fields || (fields == NULL && rows && cols))
+    return -1;
+
+#ifdef HAVE_PTHREAD
+  if (nthreads == 0)
+    nthreads = csv_cpu_count();
+  if (nthreads > MAX_THREADS)
+    nthreads = MAX_THREADS;
+  if (nthreads < 2 || cols == 0 || rows < 2 * (WRITE_FIELDS_MIN / cols + 1) ||
+      (jobs = calloc(nthreads, sizeof *jobs)) == NULL)
+    return csv_writer_slice(w, fields, lens, rows, cols);
+
+  for (i = 1; i < nthreads; i++) {
+    csv_writer_init(&jobs[i].w, w->options);
+    jobs[i].w.delim_char = w->delim_char;
+    jobs[i].w.quote_char = w->quote_char;
+    jobs[i].lens = lens;
+    jobs[i].cols = cols;
+  }
+
+  while (!failed && done < rows) {
+    /* Every thread takes the same number of rows, the calling thread the
+       first of them, which it writes straight to the output */
+    per = (rows - done + nthreads - 1) / nthreads;
+    if (per < WRITE_FIELDS_MIN / cols + 1)
+      per = WRITE_FIELDS_MIN / cols + 1;
+    if (per > WRITE_BLOCK_FIELDS / cols + 1)
+      per = WRITE_BLOCK_FIELDS / cols + 1;
+
+    n = per < rows - done ? per : rows - done;
+    for (njobs = 1; njobs < nthreads && done + njobs * per < rows; njobs++) {
+      struct csv_write_job *job = jobs + njobs;
+      size_t first = done + njobs * per;
+
+      job->fields = fields + first * cols;
+      job->lens = lens ? lens + first * cols : NULL;
+      job->rows = per < rows - first ? per : rows - first;
+      job->w.used = 0;
+      job->started = pthread_create(&job->thread, NULL, csv_write_run, job) == 0;
+      if (!job->started)
+        csv_write_run(job);
+    }
+
+    failed = csv_writer_slice(w, fields + done * cols, lens ? lens + done * cols : NULL, n, cols) != 0;
+    done += n;
+
+    for (i = 1; i < njobs; i++) {
+      struct csv_write_job *job = jobs + i;
+
+      if (job->started)
+        pthread_join(job->thread, NULL);
+      if (failed)
+        continue;
+      if (job->w.status) {
+        w->status = job->w.status;
+        failed = 1;
+        continue;
+      }
+      /* Large buffers go out with the output buffered so far in one writev */
+      out = csv_writer_data(&job->w, &n);
+      failed = csv_writer_put(w, out, n) != 0;
+      done += job->rows;
+    }
+  }
+
+  for (i = 1; i < nthreads; i++)
+    csv_writer_free(&jobs[i].w);
+  free(jobs);
+  return failed ? -1 : 0;
+#else
+  (void)nthreads;
+  return csv_writer_slice(w, fields, lens, rows, cols);
+#endif
+}
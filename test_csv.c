@@ -2,7 +2,19 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
 #include "./csv.h"
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#  include <utime.h>
+#  include <sys/stat.h>
+#endif
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
 
 #define CSV_END 0
 #define CSV_COL 1
@@ -86,9 +98,33 @@ cb2 (int c, void *t)
   row++;
 }
 
+int
+custom_space (unsigned char c)
+{
+  return c == '_';
+}
+
+int
+custom_term (unsigned char c)
+{
+  return c == '|' || c == CSV_LF;
+}
+
+int
+custom_space_many (unsigned char c)
+{
+  return c == '_' || c == '~';
+}
+
+int
+custom_term_many (unsigned char c)
+{
+  return c == '!' || c == '#' || c == CSV_CR || c == CSV_LF;
+}
+
 void
-test_parser (char *test_name, unsigned char options, void *input, size_t len, struct event expected[],
-             char delimiter, char quote, int (*space_func)(unsigned char), int (*term_func)(unsigned char))
+run_parser (char *test_name, unsigned char options, void *input, size_t len, struct event expected[],
+            char delimiter, char quote, int (*space_func)(unsigned char), int (*term_func)(unsigned char))
 {
   int result = 0;
   size_t retval;
@@ -139,6 +175,1257 @@ test_parser (char *test_name, unsigned char options, void *input, size_t len, st
   }
 }
 
+void
+test_parser (char *test_name, unsigned char options, void *input, size_t len, struct event expected[],
+             char delimiter, char quote, int (*space_func)(unsigned char), int (*term_func)(unsigned char))
+{
+  /* Both parser cores must give the same results */
+  run_parser(test_name, options, input, len, expected, delimiter, quote, space_func, term_func);
+  run_parser(test_name, options | CSV_DFA, input, len, expected, delimiter, quote, space_func, term_func);
+}
+
+void
+zc_cb1 (void *data, size_t len, void *t)
+{
+  const char **fields = t;
+
+  /* Record where each field was delivered from */
+  while (*fields)
+    fields++;
+  *fields = data;
+  (void)len;
+}
+
+void
+join_cb1 (void *data, size_t len, void *t)
+{
+  strncat(t, data, len);
+  strcat(t, "/");
+}
+
+void
+join_cb2 (int c, void *t)
+{
+  (void)c;
+  strcat(t, "|");
+}
+
+void
+test_dialect_fields (void)
+{
+  char input[] = "a;b|c,d";
+  char out[32] = "";
+  struct csv_parser p;
+
+  /* The dialect can still be changed through the structure directly */
+  csv_init(&p, 0);
+  p.delim_char = ';';
+  p.is_term = custom_term;
+  csv_parse(&p, input, sizeof input - 1, join_cb1, join_cb2, out);
+  csv_fini(&p, join_cb1, join_cb2, out);
+  csv_free(&p);
+  if (strcmp(out, "a/b/|c,d/|") != 0)
+    fail_parser("dialect_fields", "changed dialect was not used");
+}
+
+void
+test_zero_copy (void)
+{
+  char input[] = "abc, \"d,e\" ,\"f\"\"g\"\x0a";
+  const char *fields[4] = {NULL, NULL, NULL, NULL};
+  struct csv_parser p;
+
+  /* Fields that don't need unescaping are passed straight from the input */
+  csv_init(&p, CSV_ZERO_COPY);
+  if (csv_parse(&p, input, sizeof input - 1, zc_cb1, NULL, fields) != sizeof input - 1)
+    fail_parser("zero_copy", "unexpected parse error occurred");
+  if (fields[0] != input || fields[1] != input + 6)
+    fail_parser("zero_copy", "field was not passed from the input buffer");
+  if (fields[2] == NULL || (fields[2] >= input && fields[2] < input + sizeof input))
+    fail_parser("zero_copy", "escaped field was passed from the input buffer");
+  csv_free(&p);
+}
+
+void
+test_allocator (void)
+{
+  static unsigned char mem[4096];
+  char input[1000];
+  struct csv_arena arena;
+  struct csv_allocator alloc;
+  struct csv_parser p;
+
+  memset(input, 'x', sizeof input);
+
+  /* Buffer memory comes from the arena and grows geometrically */
+  csv_arena_init(&arena, mem, sizeof mem);
+  alloc.realloc_func = csv_arena_realloc;
+  alloc.free_func = csv_arena_free;
+  alloc.ctx = &arena;
+
+  csv_init(&p, 0);
+  csv_set_allocator(&p, &alloc);
+  csv_set_blk_size(&p, 16);
+  csv_set_growth(&p, CSV_GROW_GEOMETRIC, 512);
+  csv_set_shrink_size(&p, 64);
+
+  if (csv_parse(&p, input, sizeof input, NULL, NULL, NULL) != sizeof input)
+    fail_parser("allocator", "unexpected parse error occurred");
+  if (csv_get_buffer_size(&p) != 1024)
+    fail_parser("allocator", "buffer did not grow geometrically up to the cap");
+  if ((unsigned char *)p.entry_buf < mem || (unsigned char *)p.entry_buf >= mem + sizeof mem)
+    fail_parser("allocator", "buffer was not allocated from the arena");
+
+  csv_fini(&p, NULL, NULL, NULL);
+  if (csv_get_buffer_size(&p) != 64)
+    fail_parser("allocator", "buffer was not shrunk by csv_fini");
+
+  csv_free(&p);
+  if (arena.used != 0)
+    fail_parser("allocator", "buffer was not returned to the arena");
+}
+
+size_t
+check_batch (struct csv_batch *b, size_t row)
+{
+  /* Columns 0 and 1 of each row, NULL marks a missing or null field */
+  const char *expected[][2] = { {"a", "b"}, {"1", NULL}, {"longer field", NULL}, {NULL, ""} };
+  size_t expected_cols[] = {3, 3, 1, 2};
+  size_t r, c;
+
+  for (r = 0; r < b->rows; r++, row++) {
+    if (row >= 4 || b->ncols[r] != expected_cols[row])
+      fail_parser("batch", "row has the wrong number of fields");
+    for (c = 0; c < 2; c++) {
+      size_t i = c * b->max_rows + r;
+      const char *e = expected[row][c];
+      if (b->nulls[i] != (e == NULL))
+        fail_parser("batch", "null flag doesn't match expected value");
+      if (e && (b->lengths[i] != strlen(e) || memcmp(b->values + b->offsets[i], e, b->lengths[i]) != 0))
+        fail_parser("batch", "actual data doesn't match expected data");
+    }
+  }
+
+  csv_batch_clear(b);
+  return row;
+}
+
+void
+test_batch (void)
+{
+  char input[] = "a,b,c\x0a" "1, ,\"x\"\"y\"\x0a\x0alonger field\x0a,\"\"";
+  size_t len = sizeof input - 1;
+  size_t size, row;
+  struct csv_batch b;
+  struct csv_parser p;
+
+  if (csv_batch_init(&b, 2, 2) != 0)
+    fail_parser("batch", "failed to initialize batch");
+
+  for (size = 1; size <= len; size++) {
+    size_t bytes_processed = 0;
+    row = 0;
+    csv_init(&p, CSV_EMPTY_IS_NULL);
+
+    /* The batch is drained after every call so it never stays full */
+    do {
+      size_t bytes = size < len - bytes_processed ? size : len - bytes_processed;
+      size_t done = 0;
+      while (done < bytes) {
+        done += csv_parse_batch(&p, input + bytes_processed + done, bytes - done, &b);
+        if (csv_error(&p) != CSV_SUCCESS)
+          fail_parser("batch", "unexpected parse error occurred");
+        row = check_batch(&b, row);
+      }
+      bytes_processed += bytes;
+    } while (bytes_processed < len);
+
+    if (csv_fini_batch(&p, &b) != 0)
+      fail_parser("batch", "unexpected error in csv_fini_batch");
+    row = check_batch(&b, row);
+
+    if (row != 4)
+      fail_parser("batch", "wrong number of rows");
+    csv_free(&p);
+  }
+
+  csv_batch_free(&b);
+}
+
+struct digest {
+  unsigned long hash;
+  size_t events;
+};
+
+void
+digest_add (struct digest *d, const void *data, size_t len)
+{
+  const unsigned char *s = data;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    d->hash = (d->hash ^ s[i]) * 16777619UL;
+}
+
+void
+digest_cb1 (void *data, size_t len, void *t)
+{
+  struct digest *d = t;
+
+  digest_add(d, data ? "F" : "N", 1);
+  digest_add(d, &len, sizeof len);
+  if (data)
+    digest_add(d, data, len);
+  d->events++;
+}
+
+void
+digest_cb2 (int c, void *t)
+{
+  struct digest *d = t;
+
+  digest_add(d, "R", 1);
+  digest_add(d, &c, sizeof c);
+  d->events++;
+}
+
+char *
+generate_input (size_t size, size_t *len)
+{
+  /* Generate at least size bytes of fields of all kinds, quoted fields
+     spanning lines make some chunks of parallel parsing start inside a field
+     and the long one makes the parser grow its buffer */
+  static const char *pieces[] = {"abc", "  spaced  ", "\"quoted\"", "\"with,comma\"",
+                                 "\"two\x0alines\"", "\"x\"\"y\"", "", "\"\"", "12345678",
+                                 "a long field that doesn't fit in the first buffer of the parser, "
+                                 "which holds 128 bytes, so that the buffer is grown while the field "
+                                 "is parsed"};
+  unsigned long seed = 1;
+  char *input = malloc(size + 256);
+
+  if (input == NULL) {
+    fprintf(stderr, "Failed to allocate memory in generate_input!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *len = 0;
+  while (*len < size) {
+    const char *piece;
+    seed = seed * 1103515245UL + 12345UL;
+    piece = pieces[(seed >> 16) % (sizeof pieces / sizeof *pieces)];
+    memcpy(input + *len, piece, strlen(piece));
+    *len += strlen(piece);
+    switch ((seed >> 8) % 8) {
+      case 0: memcpy(input + *len, "\x0d\x0a", 2); *len += 2; break;
+      case 1: memcpy(input + *len, "\x0a\x0a", 2); *len += 2; break;
+      case 2: input[(*len)++] = '\x0a'; break;
+      default: input[(*len)++] = ','; break;
+    }
+  }
+  return input;
+}
+
+/* Options the digest tests are run with, the strict ones last since they
+   fail on the input of test_parallel */
+static const unsigned char digest_options[] = {0, CSV_ZERO_COPY, CSV_APPEND_NULL, CSV_EMPTY_IS_NULL | CSV_APPEND_NULL,
+                                               CSV_APPEND_NULL | CSV_ZERO_COPY | CSV_DFA, CSV_REPALL_NL | CSV_ZERO_COPY,
+                                               CSV_REPALL_NL | CSV_EMPTY_IS_NULL | CSV_DFA,
+                                               CSV_STRICT | CSV_REPALL_NL | CSV_ZERO_COPY, CSV_STRICT | CSV_DFA};
+
+/* Sizes of the chunks input is given to the parser in, 0 for all of it */
+static const size_t digest_chunks[] = {1, 7, 4096, 0};
+
+void
+digest_init (struct digest *d)
+{
+  d->hash = 2166136261UL;
+  d->events = 0;
+}
+
+size_t
+digest_parse (struct csv_parser *p, const char *s, size_t len, size_t chunk, struct digest *d)
+{
+  /* Digest the fields and rows of len bytes at s given to csv_parse chunk
+     bytes at a time and, if they all parse, csv_fini; returns the number of
+     bytes parsed */
+  size_t pos, part, ret, n = chunk ? chunk : len;
+
+  digest_init(d);
+  for (pos = 0; pos < len; pos += ret) {
+    part = len - pos < n ? len - pos : n;
+    ret = csv_parse(p, s + pos, part, digest_cb1, digest_cb2, d);
+    if (ret < part)
+      return pos + ret;
+  }
+  csv_fini(p, digest_cb1, digest_cb2, d);
+  return pos;
+}
+
+void
+test_parallel (void)
+{
+  size_t len, ret1, ret2, i;
+  unsigned int threads;
+  struct digest d1, d2;
+  struct csv_parser p;
+  char *input = generate_input(600000, &len);
+
+  for (i = 0; i < sizeof digest_options; i++) {
+    /* Strict mode fails on an unescaped quote near the end */
+    if (digest_options[i] & CSV_STRICT)
+      memcpy(input + len - 100, "\x0a" "a\"b,", 5);
+
+    for (threads = 2; threads <= 7; threads += 5) {
+      csv_init(&p, digest_options[i]);
+      ret1 = digest_parse(&p, input, len, 0, &d1);
+      csv_free(&p);
+
+      digest_init(&d2);
+      csv_init(&p, digest_options[i]);
+      ret2 = csv_parse_parallel(&p, input, len, digest_cb1, digest_cb2, &d2, threads);
+      if (ret2 == len)
+        csv_fini(&p, digest_cb1, digest_cb2, &d2);
+      csv_free(&p);
+
+      if (ret1 != ret2)
+        fail_parser("parallel", "wrong number of bytes processed");
+      if (d1.events != d2.events || d1.hash != d2.hash)
+        fail_parser("parallel", "results differ from csv_parse");
+    }
+  }
+
+  free(input);
+}
+
+int
+next_events (struct csv_parser *p, struct digest *d)
+{
+  /* Add the events csv_next returns to d until it needs input or fails,
+     returns the event that stopped it */
+  const void *field;
+  size_t len;
+  int c, event;
+
+  while ((event = csv_next(p, &field, &len, &c)) == CSV_EVENT_FIELD || event == CSV_EVENT_ROW) {
+    if (event == CSV_EVENT_FIELD)
+      digest_cb1((void *)field, len, d);
+    else
+      digest_cb2(c, d);
+  }
+  return event;
+}
+
+void
+test_next (void)
+{
+  /* Pulling events gives the fields and rows of csv_parse, whatever the
+     size of the blocks fed to the parser */
+  size_t len, pos, n, i, j;
+  struct digest d1, d2;
+  struct csv_parser p;
+  char *input = generate_input(100000, &len);
+  const char *bad = "a,b\x0a\"c\"d,e\x0a";
+
+  for (i = 0; i < sizeof digest_options; i++) {
+    csv_init(&p, digest_options[i]);
+    digest_parse(&p, input, len - 3, 0, &d1);
+    csv_free(&p);
+
+    for (j = 0; j < sizeof digest_chunks / sizeof *digest_chunks; j++) {
+      digest_init(&d2);
+      csv_init(&p, digest_options[i]);
+      csv_set_shrink_size(&p, 16);
+      for (pos = 0; pos < len - 3; pos += n) {
+        n = digest_chunks[j] && digest_chunks[j] < len - 3 - pos ? digest_chunks[j] : len - 3 - pos;
+        csv_feed(&p, input + pos, n);
+        if (next_events(&p, &d2) != CSV_EVENT_NEED_INPUT || csv_next_offset(&p) != n)
+          fail_parser("next", "input was not used up");
+      }
+      csv_feed(&p, NULL, 0);
+      if (next_events(&p, &d2) != CSV_EVENT_END || csv_next(&p, NULL, NULL, NULL) != CSV_EVENT_END)
+        fail_parser("next", "end of input was not reported");
+      if (d1.events != d2.events || d1.hash != d2.hash)
+        fail_parser("next", "results differ from csv_parse");
+
+      /* The parser starts over after the end */
+      csv_feed(&p, "x\x0a", 2);
+      if (next_events(&p, &d2) != CSV_EVENT_NEED_INPUT || d2.events != d1.events + 2)
+        fail_parser("next", "parser did not start over");
+      csv_free(&p);
+    }
+  }
+
+  /* A parse error stops at the offending byte */
+  csv_init(&p, CSV_STRICT);
+  csv_feed(&p, bad, strlen(bad));
+  if (next_events(&p, &d2) != CSV_EVENT_ERROR || csv_error(&p) != CSV_EPARSE || csv_next_offset(&p) != 7)
+    fail_parser("next", "parse error was not reported");
+  if (csv_next(&p, NULL, NULL, NULL) != CSV_EVENT_ERROR || csv_next_offset(&p) != 7)
+    fail_parser("next", "parse error was not repeated");
+  csv_free(&p);
+  free(input);
+}
+
+struct filter {
+  struct digest d;  /* Digest of the fields of columns 1, 3 and 6 */
+  size_t col;       /* Column of the next field */
+};
+
+void
+filter_cb1 (void *data, size_t len, void *t)
+{
+  struct filter *f = t;
+  if (f->col == 1 || f->col == 3 || f->col == 6)
+    digest_cb1(data, len, &f->d);
+  f->col++;
+}
+
+void
+filter_cb2 (int c, void *t)
+{
+  struct filter *f = t;
+  digest_cb2(c, &f->d);
+  f->col = 0;
+}
+
+void
+test_projection (void)
+{
+  /* Only the selected columns are delivered, whatever the chunks */
+  static const size_t cols[] = {6, 3, 1, 3};
+  size_t len, ret1, ret2, i, j;
+  struct filter f;
+  struct digest d;
+  struct csv_parser p;
+  char *input = generate_input(300000, &len);
+
+  for (i = 0; i < sizeof digest_options; i++) {
+    digest_init(&f.d);
+    f.col = 0;
+    csv_init(&p, digest_options[i]);
+    ret1 = csv_parse(&p, input, len, filter_cb1, filter_cb2, &f);
+    csv_fini(&p, filter_cb1, filter_cb2, &f);
+
+    for (j = 0; j < sizeof digest_chunks / sizeof *digest_chunks; j++) {
+      if (csv_set_columns(&p, cols, sizeof cols / sizeof *cols) != 0)
+        fail_parser("projection", "failed to set columns");
+      ret2 = digest_parse(&p, input, len, digest_chunks[j], &d);
+      if (ret1 != ret2 || d.events != f.d.events || d.hash != f.d.hash)
+        fail_parser("projection", "results differ from filtered csv_parse");
+    }
+
+    digest_init(&d);
+    if (csv_parse_parallel(&p, input, len, digest_cb1, digest_cb2, &d, 3) != ret1)
+      fail_parser("projection", "wrong number of bytes processed in parallel");
+    csv_fini(&p, digest_cb1, digest_cb2, &d);
+    if (d.events != f.d.events || d.hash != f.d.hash)
+      fail_parser("projection", "parallel results differ from filtered csv_parse");
+    csv_free(&p);
+  }
+
+  /* A quote after spaces after a closing quote is data, the field still
+     ends at the next delimiter */
+  csv_init(&p, 0);
+  csv_set_columns(&p, cols + 2, 1);
+  digest_init(&d);
+  digest_init(&f.d);
+  digest_cb1("b", 1, &f.d);
+  digest_cb2(CSV_LF, &f.d);
+  digest_cb1("d", 1, &f.d);
+  digest_cb2(CSV_LF, &f.d);
+  csv_parse(&p, "a,b,\"l\" \",m\x0a" "c,d\x0a", 16, digest_cb1, digest_cb2, &d);
+  csv_fini(&p, digest_cb1, digest_cb2, &d);
+  if (d.events != f.d.events || d.hash != f.d.hash)
+    fail_parser("projection", "quote after a quoted field started another one");
+  csv_free(&p);
+
+  /* Without a projection every field is delivered again */
+  csv_init(&p, 0);
+  csv_set_columns(&p, cols, 1);
+  csv_set_columns(&p, NULL, 0);
+  digest_init(&d);
+  csv_parse(&p, "a,b\x0a", 4, digest_cb1, digest_cb2, &d);
+  if (d.events != 3)
+    fail_parser("projection", "removed projection still applies");
+  csv_free(&p);
+  free(input);
+}
+
+struct drop {
+  struct digest d;  /* Digest of the rows after the first ones */
+  size_t rows;      /* Number of rows still to drop */
+};
+
+void
+drop_cb1 (void *data, size_t len, void *t)
+{
+  struct drop *r = t;
+  if (r->rows == 0)
+    digest_cb1(data, len, &r->d);
+}
+
+void
+drop_cb2 (int c, void *t)
+{
+  struct drop *r = t;
+  if (r->rows == 0)
+    digest_cb2(c, &r->d);
+  else
+    r->rows--;
+}
+
+int
+space_is_term (unsigned char c)
+{
+  return c == CSV_CR || c == CSV_LF || c == CSV_SPACE;
+}
+
+void
+test_skip_rows (void)
+{
+  /* Parsing after skipping rows gives the rows csv_parse gives after them */
+  static const size_t counts[] = {1, 2, 7, 1000, (size_t)-1};
+  static const char odd[] = "a\"b,\"c\x0a\"  , \"d\"\"\x0a\" x\x0d\x0a\"l\" \",m\x0a\"e\" \"f,\tg\x0a\x0a  \"h\",i\x0a\t\"j\"\tk\x0a";
+  size_t len, i, j, k, dialect, pos, n, left, ret;
+  struct drop r;
+  struct digest d;
+  struct csv_parser p;
+  char *input = generate_input(60000, &len);
+  const char *s;
+
+  for (dialect = 0; dialect < 6; dialect++) {
+    s = dialect % 2 ? odd : input;
+    n = dialect % 2 ? sizeof odd - 1 : len;
+    for (i = 0; i < sizeof digest_options; i++) {
+      if ((digest_options[i] & CSV_STRICT) && dialect != 0)
+        continue;
+      for (k = 0; k < sizeof counts / sizeof *counts; k++) {
+        csv_init(&p, digest_options[i]);
+        if (dialect / 2 == 1)
+          csv_set_delim(&p, CSV_TAB);
+        else if (dialect / 2 == 2)
+          csv_set_term_func(&p, space_is_term);
+        digest_init(&r.d);
+        r.rows = counts[k];
+        csv_parse(&p, s, n, drop_cb1, drop_cb2, &r);
+        csv_fini(&p, drop_cb1, drop_cb2, &r);
+
+        for (j = 0; j < sizeof digest_chunks / sizeof *digest_chunks; j++) {
+          size_t size = digest_chunks[j] ? digest_chunks[j] : n;
+          digest_init(&d);
+          left = counts[k];
+          for (pos = 0; pos < n; pos += size) {
+            size_t part = n - pos < size ? n - pos : size;
+            ret = left ? csv_skip_rows(&p, s + pos, part, &left) : 0;
+            if (ret < part && left)
+              fail_parser("skip_rows", "stopped before the rows were skipped");
+            csv_parse(&p, s + pos + ret, part - ret, digest_cb1, digest_cb2, &d);
+          }
+          csv_fini(&p, digest_cb1, digest_cb2, &d);
+          if (d.events != r.d.events || d.hash != r.d.hash)
+            fail_parser("skip_rows", "rows after the skipped ones differ from csv_parse");
+        }
+        csv_free(&p);
+      }
+    }
+  }
+
+  /* A row left partly skipped is not delivered by csv_parse or csv_fini */
+  csv_init(&p, 0);
+  digest_init(&d);
+  left = 1;
+  if (csv_skip_rows(&p, "a,\"b", 4, &left) != 4 || left != 1)
+    fail_parser("skip_rows", "wrong result for a partial row");
+  csv_parse(&p, "\x0a,c\"\x0a" "d\x0a", 7, digest_cb1, digest_cb2, &d);
+  if (d.events != 2)
+    fail_parser("skip_rows", "rest of a partly skipped row delivered");
+  if (csv_skip_rows(&p, "e,f", 3, &left) != 3 || left != 1)
+    fail_parser("skip_rows", "wrong result for a partial last row");
+  csv_fini(&p, digest_cb1, digest_cb2, &d);
+  if (d.events != 2)
+    fail_parser("skip_rows", "partly skipped last row delivered");
+  csv_free(&p);
+  free(input);
+}
+
+void
+test_validate (void)
+{
+  /* Validation stops at the byte where strict parsing fails */
+  static const char bytes[] = "\"x ,\x0a";
+  size_t len, i, j, k, pos, n, ret1, ret2;
+  int dialect, err1, err2;
+  struct csv_parser p;
+  char *input = generate_input(4000, &len);
+  char *s = malloc(len);
+  const char *name = "test_csv.tmp";
+  FILE *fp;
+
+  if (s == NULL) {
+    fprintf(stderr, "Failed to allocate memory in test_validate!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (dialect = 0; dialect < 3; dialect++) {
+    for (i = 0; i < len; i += 37) {
+      for (k = 0; k < sizeof bytes - 1; k++) {
+        memcpy(s, input, len);
+        s[i] = bytes[k];
+        csv_init(&p, CSV_STRICT);
+        if (dialect == 1)
+          csv_set_quote(&p, 'x');
+        else if (dialect == 2)
+          csv_set_term_func(&p, space_is_term);
+        ret1 = csv_parse(&p, s, len, NULL, NULL, NULL);
+        err1 = csv_error(&p);
+        csv_fini(&p, NULL, NULL, NULL);
+
+        for (j = 0; j < sizeof digest_chunks / sizeof *digest_chunks; j++) {
+          n = digest_chunks[j] ? digest_chunks[j] : len;
+          for (pos = ret2 = 0; pos < len; pos += n) {
+            size_t part = len - pos < n ? len - pos : n;
+            size_t r = csv_validate(&p, s + pos, part);
+            ret2 += r;
+            if (r < part)
+              break;
+          }
+          err2 = csv_error(&p);
+          csv_fini(&p, NULL, NULL, NULL);
+          if (ret1 != ret2 || err1 != err2)
+            fail_parser("validate", "result differs from strict csv_parse");
+        }
+        csv_free(&p);
+      }
+    }
+  }
+
+  /* Files are validated in one pass */
+  memcpy(s, input, len);
+  memcpy(s + len / 2, ",a\"b,", 5);
+  csv_init(&p, CSV_STRICT);
+  ret1 = csv_parse(&p, s, len, NULL, NULL, NULL);
+  csv_fini(&p, NULL, NULL, NULL);
+  fp = fopen(name, "wb");
+  if (fp == NULL || fwrite(s, 1, len, fp) != len || fclose(fp) != 0)
+    fail_parser("validate", "failed to write test file");
+  ret2 = csv_validate_file(&p, name);
+  if (ret1 != ret2 || ret2 == len || csv_error(&p) != CSV_EPARSE)
+    fail_parser("validate", "file result differs from strict csv_parse");
+  remove(name);
+  csv_fini(&p, NULL, NULL, NULL);
+  csv_free(&p);
+  free(input);
+  free(s);
+}
+
+struct tally {
+  size_t rows;
+  size_t fields;
+};
+
+void
+tally_cb1 (void *data, size_t len, void *t)
+{
+  (void)data, (void)len;
+  ((struct tally *)t)->fields++;
+}
+
+void
+tally_cb2 (int c, void *t)
+{
+  (void)c;
+  ((struct tally *)t)->rows++;
+}
+
+void
+test_count (void)
+{
+  /* Counting gives the numbers of rows and fields csv_parse delivers */
+  static const char odd[] = "a\"b,\"c\x0a\"  , \"d\"\"\x0a\" x\x0d\x0a\"l\" \",m\x0a\"e\" \"f,\tg\x0a\x0a  \"h\",i\x0a\t\"j\"\tk";
+  static const size_t cols[] = {1};
+  size_t len, i, j, dialect, pos, n, size, ret1, ret2, rows, fields;
+  int err1, err2;
+  struct tally t;
+  struct csv_parser p;
+  char *input = generate_input(60000, &len);
+  const char *s;
+
+  for (dialect = 0; dialect < 8; dialect++) {
+    s = dialect % 2 ? odd : input;
+    n = dialect % 2 ? sizeof odd - 1 : len;
+    for (i = 0; i < sizeof digest_options; i++) {
+      csv_init(&p, digest_options[i]);
+      if (dialect / 2 == 1)
+        csv_set_delim(&p, CSV_TAB);
+      else if (dialect / 2 == 2)
+        csv_set_term_func(&p, space_is_term);
+      else if (dialect / 2 == 3)
+        csv_set_quote(&p, CSV_COMMA);
+      t.rows = t.fields = 0;
+      ret1 = csv_parse(&p, s, n, tally_cb1, tally_cb2, &t);
+      err1 = csv_error(&p);
+      if (ret1 == n)
+        csv_fini(&p, tally_cb1, tally_cb2, &t);
+      else
+        csv_fini(&p, NULL, NULL, NULL);
+
+      /* A projection only changes which fields are delivered */
+      csv_set_columns(&p, cols, 1);
+      for (j = 0; j < sizeof digest_chunks / sizeof *digest_chunks; j++) {
+        size = digest_chunks[j] ? digest_chunks[j] : n;
+        rows = fields = ret2 = 0;
+        for (pos = 0; pos < n; pos += size) {
+          size_t part = n - pos < size ? n - pos : size;
+          size_t r = csv_count(&p, s + pos, part, &rows, &fields);
+          ret2 += r;
+          if (r < part)
+            break;
+        }
+        err2 = csv_error(&p);
+        if (ret2 == n && csv_count_fini(&p, &rows, &fields) != 0)
+          fail_parser("count", "failed to finish counting");
+        else if (ret2 < n)
+          csv_fini(&p, NULL, NULL, NULL);
+        if (ret1 != ret2 || err1 != err2 || rows != t.rows || fields != t.fields)
+          fail_parser("count", "counts differ from csv_parse");
+      }
+      csv_free(&p);
+    }
+  }
+
+  /* A field spanning calls of the fallback parser, with CSV_APPEND_NULL */
+  memset(input, 'x', 128);
+  csv_init(&p, CSV_APPEND_NULL);
+  csv_set_delim(&p, '\'');
+  csv_set_quote(&p, '\'');
+  rows = fields = 0;
+  if (csv_count(&p, input, 124, &rows, &fields) != 124 || csv_count(&p, input + 124, 4, &rows, &fields) != 4
+      || csv_count_fini(&p, &rows, &fields) != 0 || rows != 1 || fields != 1)
+    fail_parser("count", "unexpected error counting a field spanning calls");
+  csv_free(&p);
+  free(input);
+}
+
+#ifdef LLONG_MAX
+struct typed_log {
+  char text[1024];
+  size_t len;
+};
+
+void
+typed_cb (const struct csv_value *v, void *t)
+{
+  struct typed_log *l = t;
+  char *out = l->text + l->len;
+  size_t room = sizeof l->text - l->len;
+
+  if (v->status != CSV_VALUE_OK)
+    snprintf(out, room, "%lu%s ", (unsigned long)v->col, v->status == CSV_VALUE_NULL ? "N" : "X");
+  else if (v->type == CSV_TYPE_DOUBLE)
+    snprintf(out, room, "%lu=%g ", (unsigned long)v->col, v->v.d);
+  else if (v->type == CSV_TYPE_BOOL)
+    snprintf(out, room, "%lu=%d ", (unsigned long)v->col, v->v.b);
+  else if (v->type == CSV_TYPE_STRING)
+    snprintf(out, room, "%lu='%.*s' ", (unsigned long)v->col, (int)v->len, v->str);
+  else
+    snprintf(out, room, "%lu=%lld ", (unsigned long)v->col, v->v.i);
+  l->len += strlen(out);
+}
+
+void
+typed_row_cb (int c, void *t)
+{
+  struct typed_log *l = t;
+
+  (void)c;
+  if (l->len < sizeof l->text - 2)
+    l->text[l->len++] = '|', l->text[l->len] = '\0';
+}
+
+void
+test_typed (void)
+{
+  /* Fields are decoded as the type of their column, whatever the chunks */
+  static const char input[] = "1,2.5,true,2021-03-04,2021-03-04T05:06:07.5Z,x,skipped\x0a"
+                              "-9223372036854775808,\"1e-3\",NO,1969-12-31,1970-01-01 00:00-01:00,\"a,b\"\x0a"
+                              "12x,abc,maybe,2021-02-29,2021-13-01T00:00,,z\x0a"
+                              ",,,\x0a" "7\x0a" "8,1.5";
+  static const char expected[] = "0=1 1=2.5 2=1 3=18690 4=1614834367500000 5='x' |"
+                                 "0=-9223372036854775808 1=0.001 2=0 3=-1 4=3600000000 5='a,b' |"
+                                 "0X 1X 2X 3X 4X 5='' |"
+                                 "0N 1N 2N 3N 4N 5N |"
+                                 "0=7 1N 2N 3N 4N 5N |"
+                                 "0=8 1=1.5 2N 3N 4N 5N |";
+  /* Empty strings are only null with CSV_EMPTY_IS_NULL */
+  static const char expected_null[] = "0=1 1=2.5 2=1 3=18690 4=1614834367500000 5='x' |"
+                                      "0=-9223372036854775808 1=0.001 2=0 3=-1 4=3600000000 5='a,b' |"
+                                      "0X 1X 2X 3X 4X 5N |"
+                                      "0N 1N 2N 3N 4N 5N |"
+                                      "0=7 1N 2N 3N 4N 5N |"
+                                      "0=8 1=1.5 2N 3N 4N 5N |";
+  static const int types[] = {CSV_TYPE_INT64, CSV_TYPE_DOUBLE, CSV_TYPE_BOOL, CSV_TYPE_DATE,
+                              CSV_TYPE_TIMESTAMP, CSV_TYPE_STRING, CSV_TYPE_SKIP};
+  static const size_t chunks[] = {1, 7, 0};
+  size_t i, j, pos, n, len = sizeof input - 1;
+  struct typed_log l;
+  struct csv_schema sc;
+  struct csv_parser p;
+
+  if (csv_schema_init(&sc, typed_row_cb, &l) != 0)
+    fail_parser("typed", "failed to initialize schema");
+  for (i = 0; i < sizeof types / sizeof *types; i++)
+    if (csv_schema_set(&sc, i, types[i], typed_cb) != 0)
+      fail_parser("typed", "failed to set column type");
+  if (csv_schema_set(&sc, 9, CSV_TYPE_INT64, NULL) == 0 || csv_schema_set(&sc, 0, 99, typed_cb) == 0)
+    fail_parser("typed", "accepted a column without handler or type");
+
+  for (i = 0; i < 2; i++) {
+    csv_init(&p, i ? CSV_ZERO_COPY | CSV_EMPTY_IS_NULL : 0);
+    for (j = 0; j < sizeof chunks / sizeof *chunks; j++) {
+      l.len = 0;
+      l.text[0] = '\0';
+      n = chunks[j] ? chunks[j] : len;
+      for (pos = 0; pos < len; pos += n)
+        if (csv_parse_typed(&p, input + pos, len - pos < n ? len - pos : n, &sc) != (len - pos < n ? len - pos : n))
+          fail_parser("typed", "stopped before the end of the data");
+      if (csv_fini_typed(&p, &sc) != 0)
+        fail_parser("typed", "failed to finish the last row");
+      if (strcmp(l.text, i ? expected_null : expected) != 0)
+        fail_parser("typed", "decoded values differ from the expected ones");
+    }
+    csv_free(&p);
+  }
+  csv_schema_free(&sc);
+}
+#endif
+
+void
+test_stats (void)
+{
+  /* Statistics count what the parser delivers without changing it */
+  static const char small[] = "a,\"b\"\"c\",\x0a\"d\"\x0a";
+  size_t len, i, ret1, ret2;
+  struct digest d1, d2;
+  struct csv_stats st;
+  struct csv_parser p;
+  char *input = generate_input(100000, &len);
+  char *big;
+
+  for (i = 0; i < sizeof digest_options; i++) {
+    csv_init(&p, digest_options[i]);
+    ret1 = digest_parse(&p, input, len, 0, &d1);
+    if (csv_get_stats(&p, &st) == 0)
+      fail_parser("stats", "statistics returned while disabled");
+    if (csv_set_stats(&p, CSV_STATS_TIMING) != 0)
+      fail_parser("stats", "failed to enable statistics");
+    ret2 = digest_parse(&p, input, len, 4096, &d2);
+    if (ret1 != ret2 || d1.events != d2.events || d1.hash != d2.hash)
+      fail_parser("stats", "results differ with statistics enabled");
+    if (csv_get_stats(&p, &st) != 0 || st.bytes != len || st.rows + st.fields != d2.events ||
+        st.callback_seconds < 0 || st.peak_buffer_size < st.max_field)
+      fail_parser("stats", "wrong statistics for the generated input");
+    csv_free(&p);
+  }
+
+  /* Each counter on a small input */
+  csv_init(&p, 0);
+  csv_set_stats(&p, CSV_STATS_COUNT);
+  csv_parse(&p, small, sizeof small - 1, NULL, NULL, NULL);
+  csv_fini(&p, NULL, NULL, NULL);
+  csv_get_stats(&p, &st);
+  if (st.bytes != sizeof small - 1 || st.rows != 2 || st.fields != 4 || st.quoted_fields != 2 ||
+      st.doubled_quotes != 1 || st.max_field != 3 || st.strict_errors != 0)
+    fail_parser("stats", "wrong counters for a small input");
+
+  big = malloc(10000);
+  if (big == NULL) {
+    fprintf(stderr, "Failed to allocate memory in test_stats!\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(big, 'x', 10000);
+  csv_reset_stats(&p);
+  csv_parse(&p, big, 10000, NULL, NULL, NULL);
+  csv_fini(&p, NULL, NULL, NULL);
+  csv_get_stats(&p, &st);
+  if (st.reallocs == 0 || st.peak_buffer_size <= 10000 || st.buffer_size != csv_get_buffer_size(&p) ||
+      st.rows != 1 || st.max_field != 10000)
+    fail_parser("stats", "wrong buffer counters for a large field");
+
+  csv_set_opts(&p, CSV_STRICT);
+  csv_parse(&p, "a\"b\x0a", 4, NULL, NULL, NULL);
+  csv_fini(&p, NULL, NULL, NULL);
+  csv_get_stats(&p, &st);
+  if (st.strict_errors != 1)
+    fail_parser("stats", "strict error not counted");
+  if (csv_set_stats(&p, 0) != 0 || csv_get_stats(&p, &st) == 0)
+    fail_parser("stats", "statistics kept after disabling them");
+  csv_free(&p);
+  free(big);
+  free(input);
+}
+
+void
+test_file (void)
+{
+  char input[] = "a,\"b\x0a" "c\",d\x0d\x0a" "e, f ,\"g\"\"h\"\x0a" "last";
+  const char *name = "test_csv.tmp";
+  struct digest d1, d2;
+  struct csv_parser p;
+  size_t ret;
+  FILE *fp;
+
+  csv_init(&p, CSV_ZERO_COPY);
+  digest_parse(&p, input, sizeof input - 1, 0, &d1);
+
+  fp = fopen(name, "wb");
+  if (fp == NULL || fwrite(input, 1, sizeof input - 1, fp) != sizeof input - 1 || fclose(fp) != 0)
+    fail_parser("file", "failed to write test file");
+
+  digest_init(&d2);
+  ret = csv_parse_file(&p, name, digest_cb1, digest_cb2, &d2);
+  if (ret != sizeof input - 1 || csv_error(&p) != CSV_SUCCESS)
+    fail_parser("file", "unexpected error parsing file");
+  csv_fini(&p, digest_cb1, digest_cb2, &d2);
+  remove(name);
+  if (d1.events != d2.events || d1.hash != d2.hash)
+    fail_parser("file", "results differ from csv_parse");
+
+#ifdef HAVE_UNISTD_H
+  {
+    /* Pipes can't be mapped and are read instead */
+    int fds[2];
+    digest_init(&d2);
+    if (pipe(fds) != 0 || write(fds[1], input, sizeof input - 1) != sizeof input - 1)
+      fail_parser("file", "failed to write to pipe");
+    close(fds[1]);
+    ret = csv_parse_fd(&p, fds[0], digest_cb1, digest_cb2, &d2);
+    close(fds[0]);
+    if (ret != sizeof input - 1 || csv_error(&p) != CSV_SUCCESS)
+      fail_parser("file", "unexpected error parsing pipe");
+    csv_fini(&p, digest_cb1, digest_cb2, &d2);
+    if (d1.events != d2.events || d1.hash != d2.hash)
+      fail_parser("file", "results from pipe differ from csv_parse");
+  }
+#endif
+
+  if (csv_parse_file(&p, name, digest_cb1, digest_cb2, &d2) != 0 || csv_error(&p) != CSV_EREAD)
+    fail_parser("file", "missing file was not reported");
+  csv_free(&p);
+}
+
+struct first_field {
+  size_t skip;      /* Rows to ignore before the wanted one */
+  size_t fields;    /* Fields seen of the wanted row */
+  char value[16];   /* First field of the wanted row */
+};
+
+void
+first_cb1 (void *data, size_t len, void *t)
+{
+  struct first_field *f = t;
+  if (f->skip == 0 && f->fields++ == 0 && len < sizeof f->value) {
+    memcpy(f->value, data, len);
+    f->value[len] = '\0';
+  }
+}
+
+void
+first_cb2 (int c, void *t)
+{
+  struct first_field *f = t;
+  (void)c;
+  if (f->skip)
+    f->skip--;
+  else
+    f->fields = 1;  /* Ignore the fields of later rows */
+}
+
+void
+test_reader (void)
+{
+#ifdef HAVE_UNISTD_H
+  /* Reading ahead gives the parser the bytes of the file in order */
+  static const size_t sizes[][2] = {{4096, 3}, {1000, 1}, {0, 0}};
+  const char *name = "test_csv.tmp";
+  size_t len, i, k, pos, ret, n;
+  struct digest d1, d2;
+  struct csv_reader r;
+  struct csv_parser p;
+  char *input = generate_input(300000, &len);
+  const char *buf;
+  FILE *fp;
+
+  fp = fopen(name, "wb");
+  if (fp == NULL || fwrite(input, 1, len, fp) != len || fclose(fp) != 0)
+    fail_parser("reader", "failed to write test file");
+
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+    for (k = 0; k < sizeof digest_options; k++) {
+      csv_init(&p, digest_options[k]);
+      digest_parse(&p, input, len, 0, &d1);
+      digest_init(&d2);
+      if (csv_reader_open(&r, name, sizes[i][0], sizes[i][1]) != 0)
+        fail_parser("reader", "failed to open test file");
+      ret = csv_reader_parse(&p, &r, digest_cb1, digest_cb2, &d2);
+      if (ret != len || csv_error(&p) != CSV_SUCCESS || csv_reader_error(&r) != CSV_SUCCESS)
+        fail_parser("reader", "unexpected error parsing file");
+      csv_fini(&p, digest_cb1, digest_cb2, &d2);
+      csv_reader_free(&r);
+      csv_free(&p);
+      if (d1.events != d2.events || d1.hash != d2.hash)
+        fail_parser("reader", "results differ from csv_parse");
+    }
+
+    if (csv_reader_open(&r, name, sizes[i][0], sizes[i][1]) != 0)
+      fail_parser("reader", "failed to open test file");
+    for (pos = 0; (buf = csv_reader_next(&r, &n)) != NULL; pos += n)
+      if (pos + n > len || memcmp(buf, input + pos, n) != 0)
+        fail_parser("reader", "blocks differ from the file");
+    if (pos != len || csv_reader_next(&r, &n) != NULL)
+      fail_parser("reader", "wrong length read");
+    csv_reader_free(&r);
+  }
+
+  /* Freeing stops the thread while it waits for room */
+  if (csv_reader_open(&r, name, 4096, 2) != 0 || csv_reader_next(&r, &n) == NULL)
+    fail_parser("reader", "failed to read test file");
+  csv_reader_free(&r);
+
+  /* Read errors are reported */
+  csv_init(&p, 0);
+  if (csv_reader_init(&r, -1, 0, 0) != 0)
+    fail_parser("reader", "failed to initialize reader");
+  if (csv_reader_parse(&p, &r, digest_cb1, digest_cb2, &d2) != 0 || csv_error(&p) != CSV_EREAD ||
+      csv_reader_error(&r) != CSV_EREAD)
+    fail_parser("reader", "read error was not reported");
+  csv_reader_free(&r);
+  remove(name);
+  if (csv_reader_open(&r, name, 0, 0) == 0)
+    fail_parser("reader", "missing file was not reported");
+  csv_free(&p);
+  free(input);
+#endif
+}
+
+size_t
+compress_input (int format, unsigned char *out, size_t size, const char *in, size_t len)
+{
+  /* Compress in as a single gzip member or zstd frame, returns the
+     compressed size or 0 if the format is not available */
+#ifdef HAVE_ZLIB
+  if (format == CSV_COMPRESS_GZIP) {
+    z_stream z;
+    size_t n;
+
+    memset(&z, 0, sizeof z);
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return 0;
+    z.next_in = (Bytef *)in;
+    z.avail_in = (uInt)len;
+    z.next_out = out;
+    z.avail_out = (uInt)size;
+    n = deflate(&z, Z_FINISH) == Z_STREAM_END ? z.total_out : 0;
+    deflateEnd(&z);
+    return n;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (format == CSV_COMPRESS_ZSTD) {
+    size_t n = ZSTD_compress(out, size, in, len, 3);
+    return ZSTD_isError(n) ? 0 : n;
+  }
+#endif
+  (void)format, (void)out, (void)size, (void)in, (void)len;
+  return 0;
+}
+
+int
+parse_compressed (const void *data, size_t len, int format, size_t buf_size, struct digest *d)
+{
+  /* Parse data from a file through a reader of format, returns the error
+     of the reader */
+  const char *name = "test_csv.tmp";
+  struct csv_reader r;
+  struct csv_parser p;
+  int error;
+  FILE *fp;
+
+  fp = fopen(name, "wb");
+  if (fp == NULL || fwrite(data, 1, len, fp) != len || fclose(fp) != 0)
+    fail_parser("compressed", "failed to write test file");
+  if (csv_reader_open_compressed(&r, name, format, buf_size, 0) != 0)
+    fail_parser("compressed", "failed to open test file");
+  digest_init(d);
+  csv_init(&p, 0);
+  csv_reader_parse(&p, &r, digest_cb1, digest_cb2, d);
+  error = csv_reader_error(&r);
+  if (error != csv_error(&p))
+    fail_parser("compressed", "reader and parser errors differ");
+  csv_fini(&p, digest_cb1, digest_cb2, d);
+  csv_reader_free(&r);
+  csv_free(&p);
+  remove(name);
+  return error;
+}
+
+void
+test_compressed (void)
+{
+#ifdef HAVE_UNISTD_H
+  /* Each compressed file is made of two streams, sizes of the reader's
+     buffers that split the input at many places and the default */
+  static const int formats[] = {CSV_COMPRESS_NONE, CSV_COMPRESS_GZIP, CSV_COMPRESS_ZSTD};
+  static const size_t sizes[] = {4096, 0};
+  size_t len, half, first, clen, size, i, j;
+  struct csv_reader r;
+  struct csv_parser p;
+  struct digest d1, d2;
+  char *input = generate_input(300000, &len);
+  unsigned char *packed;
+
+  size = len * 2 + 1024;
+  if ((packed = malloc(size)) == NULL)
+    fail_parser("compressed", "failed to allocate memory");
+
+  csv_init(&p, 0);
+  digest_parse(&p, input, len, 0, &d1);
+  csv_free(&p);
+
+  for (i = 0; i < sizeof formats / sizeof *formats; i++) {
+    half = len / 2;
+    if (formats[i] == CSV_COMPRESS_NONE) {
+      memcpy(packed, input, len);
+      first = half, clen = len;
+    } else if ((first = compress_input(formats[i], packed, size, input, half)) == 0) {
+      /* Not built with this format */
+      if (csv_reader_init_compressed(&r, 0, formats[i], 0, 0) == 0)
+        fail_parser("compressed", "missing format was not reported");
+      continue;
+    } else
+      clen = first + compress_input(formats[i], packed + first, size - first, input + half, len - half);
+
+    for (j = 0; j < sizeof sizes / sizeof *sizes; j++) {
+      if (parse_compressed(packed, clen, formats[i], sizes[j], &d2) != CSV_SUCCESS
+          || d1.events != d2.events || d1.hash != d2.hash)
+        fail_parser("compressed", "results differ from csv_parse");
+      if (parse_compressed(packed, clen, CSV_COMPRESS_AUTO, sizes[j], &d2) != CSV_SUCCESS
+          || d1.events != d2.events || d1.hash != d2.hash)
+        fail_parser("compressed", "detected format gives different results");
+    }
+    if (formats[i] == CSV_COMPRESS_NONE)
+      continue;
+
+    /* Input cut short or corrupt is a read error */
+    if (parse_compressed(packed, clen - 10, formats[i], 4096, &d2) != CSV_EREAD)
+      fail_parser("compressed", "truncated input was not reported");
+    packed[first] ^= 0xff;
+    if (parse_compressed(packed, clen, CSV_COMPRESS_AUTO, 4096, &d2) != CSV_EREAD)
+      fail_parser("compressed", "corrupt input was not reported");
+  }
+  free(packed);
+  free(input);
+#endif
+}
+
+void
+test_index (void)
+{
+  /* Rows with quoted terminators and mixed line endings, the last one
+     unterminated */
+  const char *name = "test_csv.tmp", *index_name = "test_csv.idx";
+  struct csv_index x, y;
+  struct csv_parser p;
+  struct first_field f;
+  char input[4096], expected[16];
+  size_t len = 0, i, row, offset, skip, rows = 100;
+  FILE *fp;
+
+  for (i = 0; i < rows; i++)
+    len += sprintf(input + len, i % 4 ? "%lu,\"a\x0a" "b\",c%s" : " %lu ,\"\x0d\x0a\"%s",
+                   (unsigned long)i, i == rows - 1 ? "" : i % 3 ? "\x0d\x0a" : "\x0a");
+
+  csv_init(&p, 0);
+  if (csv_index_init(&x, 3) != 0)
+    fail_parser("index", "failed to initialize index");
+  for (i = 0; i < len; i += 7)
+    if (csv_index_parse(&p, input + i, len - i < 7 ? len - i : 7, &x) != (len - i < 7 ? len - i : 7))
+      fail_parser("index", "unexpected error indexing data");
+  if (csv_index_fini(&p, &x) != 0 || x.rows != rows || x.bytes != len || x.count != (rows - 1) / 3 + 1)
+    fail_parser("index", "unexpected row count");
+
+  for (row = 0; row <= rows; row++) {
+    if (csv_index_lookup(&x, row, &offset, &skip) != 0 || skip >= 3)
+      fail_parser("index", "failed to look up row");
+    f.skip = skip, f.fields = 0, f.value[0] = '\0';
+    csv_parse(&p, input + offset, len - offset, first_cb1, first_cb2, &f);
+    csv_fini(&p, first_cb1, first_cb2, &f);
+    sprintf(expected, "%lu", (unsigned long)row);
+    if (row < rows && strcmp(f.value, expected) != 0)
+      fail_parser("index", "looked up row has the wrong data");
+  }
+  if (csv_index_lookup(&x, rows + 1, &offset, &skip) == 0)
+    fail_parser("index", "row past the end was found");
+
+  /* Indexing a file gives the same offsets, which survive saving */
+  fp = fopen(name, "wb");
+  if (fp == NULL || fwrite(input, 1, len, fp) != len || fclose(fp) != 0)
+    fail_parser("index", "failed to write test file");
+  if (csv_index_save(&x, index_name) != 0 || csv_index_load(&y, index_name) != 0
+      || y.step != x.step || y.rows != x.rows || y.bytes != x.bytes || y.count != x.count
+      || memcmp(y.offsets, x.offsets, x.count * sizeof *x.offsets) != 0)
+    fail_parser("index", "loaded index differs from saved one");
+  csv_index_free(&y);
+  remove(index_name);
+
+#ifdef HAVE_UNISTD_H
+  fp = fopen(name, "rb");
+  csv_index_init(&y, 3);
+  if (fp == NULL || csv_index_fd(&p, fileno(fp), &y) != len || csv_index_fini(&p, &y) != 0
+      || y.rows != x.rows || y.count != x.count || memcmp(y.offsets, x.offsets, x.count * sizeof *x.offsets) != 0)
+    fail_parser("index", "file index differs from buffer index");
+  for (row = 0; row < rows; row += 7) {
+    f.skip = 0, f.fields = 0, f.value[0] = '\0';
+    if (csv_seek_row(&p, fileno(fp), &y, row) != 0)
+      fail_parser("index", "failed to seek to row");
+    csv_parse_fd(&p, fileno(fp), first_cb1, first_cb2, &f);
+    csv_fini(&p, first_cb1, first_cb2, &f);
+    sprintf(expected, "%lu", (unsigned long)row);
+    if (strcmp(f.value, expected) != 0)
+      fail_parser("index", "row sought in file has the wrong data");
+  }
+  fclose(fp);
+  csv_index_free(&y);
+#endif
+
+  remove(name);
+  csv_index_free(&x);
+  csv_free(&p);
+
+  /* A field spanning calls leaves room for the null byte of CSV_APPEND_NULL */
+  memset(input, 'x', 128);
+  csv_init(&p, CSV_APPEND_NULL);
+  csv_index_init(&x, 3);
+  if (csv_index_parse(&p, input, 124, &x) != 124 || csv_index_parse(&p, input + 124, 4, &x) != 4
+      || csv_index_fini(&p, &x) != 0 || x.rows != 1)
+    fail_parser("index", "unexpected error indexing a field spanning calls");
+  csv_index_free(&x);
+  csv_free(&p);
+
+  /* Offsets after a partly skipped row count the rest of that row */
+  csv_init(&p, 0);
+  csv_index_init(&x, 1);
+  rows = 1;
+  if (csv_skip_rows(&p, "a,\"b", 4, &rows) != 4 || rows != 1
+      || csv_index_parse(&p, "\x0a,c\"\x0aR1\x0aR2\x0aR3\x0a", 14, &x) != 14 || csv_index_fini(&p, &x) != 0)
+    fail_parser("index", "unexpected error indexing after skipping");
+  if (csv_index_lookup(&x, 1, &offset, &skip) != 0 || offset != 8 || skip != 0
+      || csv_index_lookup(&x, 2, &offset, &skip) != 0 || offset != 11
+      || csv_index_lookup(&x, 3, &offset, &skip) != 0 || offset != 14)
+    fail_parser("index", "wrong offsets after a partly skipped row");
+  csv_index_free(&x);
+  csv_free(&p);
+}
+
 void
 test_writer (char * test_name, char *input, size_t input_len, char *expected, size_t expected_len)
 {
@@ -174,6 +1461,478 @@ test_writer2 (char * test_name, char *input, size_t input_len, char *expected, s
 }
 
 
+void
+test_write_sizes (void)
+{
+  /* Compare csv_write2 with the output built byte by byte for lengths
+   * around the vector block sizes and for every kind of short buffer */
+  static const size_t lens[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 4079, 4080, 4081, 9000};
+  size_t sizes[6], i, j, k, len, ret, total;
+  char *src, *expected, *dest;
+
+  if ((src = malloc(9000)) == NULL || (expected = malloc(2 * 9000 + 2)) == NULL
+      || (dest = malloc(2 * 9000 + 3)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory in test_write_sizes!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < sizeof lens / sizeof lens[0]; i++) {
+    len = lens[i];
+    total = 0;
+    expected[total++] = '\'';
+    for (j = 0; j < len; j++) {
+      src[j] = (j * 7 + i) % 11 ? 'a' + j % 26 : '\'';
+      if (src[j] == '\'')
+        expected[total++] = '\'';
+      expected[total++] = src[j];
+    }
+    expected[total++] = '\'';
+
+    sizes[0] = 0, sizes[1] = 1, sizes[2] = total / 2;
+    sizes[3] = total - 1, sizes[4] = total, sizes[5] = total + 1;
+    for (k = 0; k < 6; k++) {
+      memset(dest, '#', total + 2);
+      ret = csv_write2(dest, sizes[k], src, len, '\'');
+      if (ret != total)
+        fail_writer("sizes", "actual length doesn't match expected length");
+      j = sizes[k] < total ? sizes[k] : total;
+      if (memcmp(dest, expected, j) != 0 || dest[j] != '#')
+        fail_writer("sizes", "actual data doesn't match expected data");
+    }
+    if (csv_write2(NULL, 0, src, len, '\'') != total)
+      fail_writer("sizes", "wrong length without a destination");
+  }
+
+  free(src);
+  free(expected);
+  free(dest);
+}
+
+static void
+write_records (struct csv_writer *w, const char *big, size_t big_len)
+{
+  /* Write the records used by test_writer_object */
+  csv_writer_field(w, "a", 1);
+  csv_writer_field(w, "b,c", 3);
+  csv_writer_field(w, " d", 2);
+  csv_writer_field(w, "e\"f", 3);
+  csv_writer_field(w, NULL, 0);
+  csv_writer_field(w, "", 0);
+  csv_writer_end_row(w);
+  csv_writer_field(w, "", 0);
+  csv_writer_end_row(w);
+  csv_writer_field(w, "g\x0ah", 3);
+  csv_writer_field(w, big, big_len);
+  csv_writer_end_row(w);
+}
+
+void
+test_writer_object (void)
+{
+  const char expected[] = "a,\"b,c\",\" d\",\"e\"\"f\",,\"\"\x0a\"\"\x0a\"g\x0ah\",";
+  struct event null_results[] = {
+    {CSV_COL, 0, 0, NULL}, {CSV_COL, 0, 0, ""}, {CSV_COL, 0, 1, "x"}, {CSV_ROW, CSV_LF, 0, NULL},
+    {CSV_COL, 0, 0, ""}, {CSV_ROW, CSV_LF, 0, NULL},
+    {CSV_COL, 0, 0, NULL}, {CSV_COL, 0, 0, NULL}, {CSV_ROW, CSV_LF, 0, NULL},
+    {CSV_COL, 0, 1, "y"}, {CSV_COL, 0, 0, ""}, {CSV_ROW, CSV_LF, 0, NULL},
+    {CSV_END, 0, 0, NULL}
+  };
+  const char *name = "test_csv.tmp";
+  struct csv_writer w, m;
+  struct csv_parser p;
+  const char *out;
+  char *big, *file;
+  size_t i, big_len = 200000, len;
+  FILE *fp;
+
+  csv_writer_init(&w, 0);
+  write_records(&w, "i", 1);
+  out = csv_writer_data(&w, &len);
+  if (len != sizeof expected + 1 || memcmp(out, expected, sizeof expected - 1) != 0
+      || memcmp(out + sizeof expected - 1, "i\x0a", 2) != 0)
+    fail_writer("object", "unexpected output with minimal quoting");
+  csv_writer_free(&w);
+
+  csv_writer_init(&w, CSV_QUOTE_ALL | CSV_WRITE_CRLF);
+  csv_writer_set_delim(&w, ';');
+  csv_writer_set_quote(&w, '\'');
+  csv_writer_field(&w, "x", 1);
+  csv_writer_field(&w, "y'z", 3);
+  csv_writer_field(&w, NULL, 0);
+  csv_writer_end_row(&w);
+  out = csv_writer_data(&w, &len);
+  if (csv_writer_error(&w) != CSV_SUCCESS || len != 13 || memcmp(out, "'x';'y''z';\x0d\x0a", 13) != 0)
+    fail_writer("object", "unexpected output with CSV_QUOTE_ALL");
+  csv_writer_free(&w);
+
+  /* Null and empty fields read back as written with CSV_EMPTY_IS_NULL */
+  csv_writer_init(&w, 0);
+  csv_writer_field(&w, NULL, 0);
+  csv_writer_field(&w, "", 0);
+  csv_writer_field(&w, "x", 1);
+  csv_writer_end_row(&w);
+  csv_writer_field(&w, "", 0);
+  csv_writer_end_row(&w);
+  csv_writer_field(&w, NULL, 0);
+  csv_writer_field(&w, NULL, 0);
+  csv_writer_end_row(&w);
+  csv_writer_field(&w, "y", 1);
+  csv_writer_field(&w, "", 0);
+  csv_writer_end_row(&w);
+  out = csv_writer_data(&w, &len);
+
+  event_ptr = null_results;
+  event_idx = 0;
+  csv_init(&p, CSV_EMPTY_IS_NULL);
+  if (csv_parse(&p, out, len, cb1, cb2, "writer_null") != len || csv_fini(&p, cb1, cb2, "writer_null") != 0)
+    fail_writer("object", "written null and empty fields failed to parse");
+  if (event_ptr->event_type != CSV_END)
+    fail_writer("object", "null and empty fields don't read back as written");
+  csv_free(&p);
+  csv_writer_free(&w);
+
+  /* A field larger than the output buffer, every 7th byte a quote */
+  if ((big = malloc(big_len)) == NULL || (file = malloc(2 * big_len + 64)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory in test_writer_object!\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < big_len; i++)
+    big[i] = i % 7 ? 'a' + i % 26 : '"';
+  csv_writer_init(&m, 0);
+  write_records(&m, big, big_len);
+  out = csv_writer_data(&m, &len);
+
+  fp = fopen(name, "wb");
+  if (fp == NULL || csv_writer_init_fp(&w, fp, 0) != 0)
+    fail_writer("object", "failed to open test file");
+  write_records(&w, big, big_len);
+  if (csv_writer_flush(&w) != 0 || fclose(fp) != 0)
+    fail_writer("object", "failed to write test file");
+  csv_writer_free(&w);
+  fp = fopen(name, "rb");
+  if (fp == NULL || fread(file, 1, 2 * big_len + 64, fp) != len || memcmp(file, out, len) != 0)
+    fail_writer("object", "file output differs from memory output");
+  fclose(fp);
+
+#ifdef HAVE_UNISTD_H
+  fp = fopen(name, "wb");
+  if (fp == NULL || csv_writer_init_fd(&w, fileno(fp), 0) != 0)
+    fail_writer("object", "failed to open test file");
+  write_records(&w, big, big_len);
+  if (csv_writer_flush(&w) != 0 || fclose(fp) != 0)
+    fail_writer("object", "failed to write test file");
+  csv_writer_free(&w);
+  fp = fopen(name, "rb");
+  if (fp == NULL || fread(file, 1, 2 * big_len + 64, fp) != len || memcmp(file, out, len) != 0)
+    fail_writer("object", "descriptor output differs from memory output");
+  fclose(fp);
+#endif
+
+  remove(name);
+  csv_writer_free(&m);
+  free(big);
+  free(file);
+}
+
+void
+test_writer_rows (void)
+{
+  /* Rows formatted across threads come out exactly as written one field at
+     a time, to memory and to a descriptor */
+  static const char *pieces[] = {"a", "b,c", " d", "e\"f", "", "g\x0ah", "x;y", "'q'", "plain text", "z "};
+  static const unsigned int threads[] = {1, 2, 4, 7, 0};
+  static const unsigned char options[] = {0, CSV_QUOTE_ALL | CSV_WRITE_CRLF};
+  const char *name = "test_csv.tmp";
+  size_t rows = 20000, cols = 5, i, j, k, len, got_len;
+  const void **fields;
+  size_t *lens;
+  const char *out, *got;
+  struct csv_writer w, m;
+  unsigned long seed = 1;
+  char *file;
+  FILE *fp;
+
+  fields = malloc(rows * cols * sizeof *fields);
+  lens = malloc(rows * cols * sizeof *lens);
+  if (fields == NULL || lens == NULL) {
+    fprintf(stderr, "Failed to allocate memory in test_writer_rows!\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < rows * cols; i++) {
+    seed = seed * 1103515245UL + 12345UL;
+    k = (seed >> 16) % (sizeof pieces / sizeof *pieces + 1);
+    fields[i] = k < sizeof pieces / sizeof *pieces ? pieces[k] : NULL;
+    lens[i] = fields[i] ? strlen(fields[i]) : 0;
+  }
+  /* A lone empty field is quoted, so are the rows of single fields */
+  fields[cols] = "";
+  lens[cols] = 0;
+
+  for (i = 0; i < sizeof options; i++) {
+    for (k = 0; k < 2; k++) {
+      csv_writer_init(&m, options[i]);
+      if (k) {
+        csv_writer_set_delim(&m, ';');
+        csv_writer_set_quote(&m, '\'');
+      }
+      for (j = 0; j < rows * cols; j++) {
+        csv_writer_field(&m, fields[j], lens[j]);
+        if (j % cols == cols - 1)
+          csv_writer_end_row(&m);
+      }
+      out = csv_writer_data(&m, &len);
+
+      for (j = 0; j < sizeof threads / sizeof *threads; j++) {
+        csv_writer_init(&w, options[i]);
+        if (k) {
+          csv_writer_set_delim(&w, ';');
+          csv_writer_set_quote(&w, '\'');
+        }
+        if (csv_writer_rows(&w, fields, j % 2 ? lens : NULL, rows, cols, threads[j]) != 0)
+          fail_writer("rows", "csv_writer_rows failed");
+        got = csv_writer_data(&w, &got_len);
+        if (got_len != len || memcmp(got, out, len) != 0)
+          fail_writer("rows", "output differs from csv_writer_field");
+        csv_writer_free(&w);
+      }
+
+#ifdef HAVE_UNISTD_H
+      if ((file = malloc(len + 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory in test_writer_rows!\n");
+        exit(EXIT_FAILURE);
+      }
+      fp = fopen(name, "wb");
+      if (fp == NULL || csv_writer_init_fd(&w, fileno(fp), options[i]) != 0)
+        fail_writer("rows", "failed to open test file");
+      if (k) {
+        csv_writer_set_delim(&w, ';');
+        csv_writer_set_quote(&w, '\'');
+      }
+      if (csv_writer_rows(&w, fields, lens, rows / 2, cols, 3) != 0
+          || csv_writer_rows(&w, fields + rows / 2 * cols, lens + rows / 2 * cols, rows - rows / 2, cols, 3) != 0
+          || csv_writer_flush(&w) != 0 || fclose(fp) != 0)
+        fail_writer("rows", "failed to write test file");
+      csv_writer_free(&w);
+      fp = fopen(name, "rb");
+      if (fp == NULL || fread(file, 1, len + 1, fp) != len || memcmp(file, out, len) != 0)
+        fail_writer("rows", "descriptor output differs from memory output");
+      fclose(fp);
+      free(file);
+#endif
+      csv_writer_free(&m);
+    }
+  }
+  remove(name);
+
+  /* Rows are not written in the middle of a record */
+  csv_writer_init(&w, 0);
+  csv_writer_field(&w, "a", 1);
+  if (csv_writer_rows(&w, fields, lens, 1, cols, 2) != -1)
+    fail_writer("rows", "rows were written in the middle of a record");
+  csv_writer_end_row(&w);
+  if (csv_writer_rows(&w, fields, lens, 0, cols, 2) != 0 || csv_writer_data(&w, &len) == NULL || len != 2)
+    fail_writer("rows", "an empty block of rows was not a no-op");
+  csv_writer_free(&w);
+
+  free(fields);
+  free(lens);
+}
+
+#ifdef HAVE_UNISTD_H
+static void
+write_file (const char *test, const char *name, const char *data, size_t len)
+{
+  FILE *fp = fopen(name, "wb");
+
+  if (fp == NULL || fwrite(data, 1, len, fp) != len || fclose(fp) != 0)
+    fail_parser((char *)test, "failed to write test file");
+}
+
+static void
+compare_cache (const char *input, size_t len, const struct csv_cache *c)
+{
+  /* The cache holds the fields csv_parse_batch reads, null for null and
+     missing fields alike */
+  struct csv_parser p;
+  struct csv_batch b;
+  const char *f;
+  size_t r, col, n, i;
+
+  csv_init(&p, CSV_EMPTY_IS_NULL);
+  if (csv_batch_init(&b, c->rows + 1, c->cols + 1) != 0)
+    fail_parser("cache", "failed to initialize batch");
+  if (csv_parse_batch(&p, input, len, &b) != len || csv_fini_batch(&p, &b) != 0)
+    fail_parser("cache", "unexpected error parsing data");
+  if (b.rows != c->rows)
+    fail_parser("cache", "cache has the wrong number of rows");
+  for (r = 0; r < b.rows; r++) {
+    if (b.ncols[r] > c->cols)
+      fail_parser("cache", "cache has too few columns");
+    for (col = 0; col <= c->cols; col++) {
+      i = col * b.max_rows + r;
+      f = csv_cache_field(c, r, col, &n);
+      if (b.nulls[i] ? f != NULL || n != 0 : f == NULL || n != b.lengths[i] || memcmp(f, b.values + b.offsets[i], n) != 0)
+        fail_parser("cache", "cached field differs from parsed one");
+    }
+  }
+  csv_batch_free(&b);
+  csv_free(&p);
+}
+
+void
+test_cache (void)
+{
+  /* Unique ids, a long repeated value that is kept in a dictionary, quoted
+     and null fields, short rows and one long row */
+  static const char *kinds[] = {"a value repeated in many of the rows, long enough that the dictionary makes the cache smaller",
+                                "another value repeated in many of the rows, much longer than its code in the dictionary",
+                                "\"quoted, with \x0a\"\"\""};
+  const char *name = "test_csv.tmp", *cache_name = "test_csv.cache";
+  size_t rows = 3000, len = 0, i, longest = 7;
+  struct csv_parser p, q;
+  struct csv_cache c;
+  struct utimbuf times;
+  struct stat st;
+  char *input, stale[64];
+
+  if ((input = malloc(rows * 256)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory in test_cache!\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < rows; i++) {
+    len += sprintf(input + len, "%lu,%s", (unsigned long)i, kinds[i % 3]);
+    if (i % 7)
+      len += sprintf(input + len, ",%s,x%lu", i % 5 ? "" : "\"\"", (unsigned long)(i % 11));
+    if (i == 1234)
+      len += sprintf(input + len, ",,longest");
+    len += sprintf(input + len, i % 2 ? "\x0d\x0a" : "\x0a");
+  }
+  write_file("cache", name, input, len);
+  remove(cache_name);
+
+  /* The first open builds the cache, the next ones load it.  The temporary
+     file of the first build is in the way, left behind by a process that
+     had the same id */
+  sprintf(stale, "%s.%lu.0.tmp", cache_name, (unsigned long)getpid());
+  write_file("cache", stale, "stale", 5);
+  csv_init(&p, CSV_EMPTY_IS_NULL);
+  if (csv_cache_load(&c, &p, name, cache_name, 0) == 0)
+    fail_parser("cache", "missing cache was loaded");
+  if (csv_cache_open(&c, &p, name, cache_name, 0) != 0 || c.rows != rows || c.cols != longest)
+    fail_parser("cache", "failed to build cache");
+  if (stat(stale, &st) == 0)
+    fail_parser("cache", "stale temporary file was left behind");
+  compare_cache(input, len, &c);
+  if (c.size >= len)
+    fail_parser("cache", "repeated values were not kept in a dictionary");
+  if (csv_cache_field(&c, rows, 0, &i) != NULL || csv_cache_field(&c, 0, longest, &i) != NULL || i != 0)
+    fail_parser("cache", "field outside the table was found");
+  csv_cache_free(&c);
+  if (csv_cache_load(&c, &p, name, cache_name, CSV_CACHE_VERIFY) != 0)
+    fail_parser("cache", "failed to load cache");
+  compare_cache(input, len, &c);
+  csv_cache_free(&c);
+
+  /* Other parser settings need a cache of their own */
+  csv_init(&q, 0);
+  if (csv_cache_load(&c, &q, name, cache_name, 0) == 0)
+    fail_parser("cache", "cache was loaded for other options");
+  csv_set_delim(&q, ';');
+  if (csv_cache_load(&c, &q, name, cache_name, 0) == 0)
+    fail_parser("cache", "cache was loaded for another delimiter");
+  csv_set_delim(&q, CSV_COMMA);
+  csv_set_opts(&q, CSV_EMPTY_IS_NULL);
+  if (csv_cache_load(&c, &q, name, cache_name, 0) != 0)
+    fail_parser("cache", "cache was not loaded for the same settings");
+  csv_cache_free(&c);
+  csv_set_space_func(&q, custom_space);
+  if (csv_cache_load(&c, &q, name, cache_name, 0) == 0)
+    fail_parser("cache", "cache was loaded for other space characters");
+  csv_set_space_func(&q, NULL);
+  if (csv_cache_load(&c, &q, name, cache_name, 0) != 0)
+    fail_parser("cache", "cache was not loaded for the default space characters");
+  csv_cache_free(&c);
+  q.is_space = custom_space;
+  if (csv_cache_load(&c, &q, name, cache_name, 0) == 0)
+    fail_parser("cache", "cache was loaded for space characters set in the parser");
+  csv_free(&q);
+
+  /* A source of another size is stale, so is one with the same size and
+     time but other contents when verified */
+  len += sprintf(input + len, "last\x0a");
+  write_file("cache", name, input, len);
+  if (csv_cache_load(&c, &p, name, cache_name, 0) == 0)
+    fail_parser("cache", "cache of a longer source was loaded");
+  if (csv_cache_open(&c, &p, name, cache_name, 0) != 0 || c.rows != rows + 1)
+    fail_parser("cache", "failed to rebuild cache");
+  compare_cache(input, len, &c);
+  csv_cache_free(&c);
+
+  /* A source whose time is not older than the cache may change without
+     changing its time, its contents are compared */
+  times.actime = times.modtime = time(NULL) + 100;
+  if (utime(name, &times) != 0 || csv_cache_build(&p, name, cache_name) != 0)
+    fail_parser("cache", "failed to rebuild cache");
+  input[0] = '9';
+  write_file("cache", name, input, len);
+  if (utime(name, &times) != 0 || csv_cache_load(&c, &p, name, cache_name, 0) == 0)
+    fail_parser("cache", "cache of source changed within its second was loaded");
+  input[0] = '0';
+  write_file("cache", name, input, len);
+  if (utime(name, &times) != 0 || csv_cache_load(&c, &p, name, cache_name, 0) != 0)
+    fail_parser("cache", "cache of unchanged source was not loaded");
+  csv_cache_free(&c);
+
+  if (stat(name, &st) != 0)
+    fail_parser("cache", "failed to stat test file");
+  input[0] = '9';
+  write_file("cache", name, input, len);
+  times.actime = st.st_atime;
+  times.modtime = st.st_mtime;
+  if (utime(name, &times) != 0)
+    fail_parser("cache", "failed to set time of test file");
+  if (csv_cache_load(&c, &p, name, cache_name, CSV_CACHE_VERIFY) == 0)
+    fail_parser("cache", "cache of changed source was loaded");
+
+  /* Back to the cached contents at another time, the hash still matches */
+  input[0] = '0';
+  write_file("cache", name, input, len);
+  times.modtime = st.st_mtime - 100;
+  if (utime(name, &times) != 0 || csv_cache_load(&c, &p, name, cache_name, 0) != 0)
+    fail_parser("cache", "cache of touched source was not loaded");
+  csv_cache_free(&c);
+
+  /* Damaged caches are rejected */
+  if (stat(cache_name, &st) != 0 || truncate(cache_name, st.st_size - 1) != 0
+      || csv_cache_load(&c, &p, name, cache_name, 0) == 0)
+    fail_parser("cache", "truncated cache was loaded");
+  write_file("cache", cache_name, input, len);
+  if (csv_cache_load(&c, &p, name, cache_name, 0) == 0)
+    fail_parser("cache", "invalid cache was loaded");
+  remove(cache_name);
+
+  /* No cache is written for data that doesn't parse */
+  csv_free(&p);
+  csv_init(&p, CSV_STRICT);
+  write_file("cache", name, "a,\"b\"c\x0a", 8);
+  if (csv_cache_open(&c, &p, name, cache_name, 0) == 0 || csv_error(&p) != CSV_EPARSE
+      || stat(cache_name, &st) == 0)
+    fail_parser("cache", "cache was built from invalid data");
+  csv_fini(&p, NULL, NULL, NULL);
+
+  /* Empty sources have empty caches */
+  write_file("cache", name, "", 0);
+  if (csv_cache_open(&c, &p, name, cache_name, 0) != 0 || c.rows != 0 || c.cols != 0)
+    fail_parser("cache", "failed to cache empty source");
+  csv_cache_free(&c);
+
+  csv_free(&p);
+  remove(name);
+  remove(cache_name);
+  free(input);
+}
+#endif
+
 int main (void) {
 
   /* Parser Tests */
@@ -243,9 +2002,17 @@ int main (void) {
   char test17_data[] = " a\0b\0c ";
   char test18_data[] = "12345678901234567890123456789012";
   char test19_data[] = "  , \"\" ,";
+  char test20_data[] = "0123456789012345678901234567890123456789012345678901234567890123456789"
+                       "0123456789012345678901234567890123456789012345678901234567890123456789 a\"b \t,"
+                       "\"0123456789 ,\x0a 0123456789012345678901234567890123456789012345678901234567890123456789"
+                       "0123456789012345678901234567890123456789012345678901234567890123456789\" \x0a";
 
   /* Custom tests */
   char custom01_data[] = "'''a;b''';;' '''' ';''''' ';' ''''';''''''";
+  char custom02_data[] = "__0123456789012345678901234567890123456789012345678901234567890123456789"
+                         "0123456789012345678901234567890123456789012345678901234567890123456789_x y__;'0123456789012345678901234567890123456789012345678901234567890123456789|"
+                         "0123456789012345678901234567890123456789012345678901234567890123456789'_|";
+  char custom03_data[] = "ab_~;0123456789012345678901234567890123456789~_!x#y\x0d\x0a";
 
   /* |1|2|3|4|5| */
   struct event test01_results[] =
@@ -410,6 +2177,14 @@ int main (void) {
       {CSV_COL, 0, 0, NULL},
       {CSV_ROW, -1, 1, NULL}, {CSV_END, 0, 0, NULL} };
 
+  /* Long fields that span several buffer blocks */
+  struct event test20_results[] =
+    { {CSV_COL, 0, 144, "0123456789012345678901234567890123456789012345678901234567890123456789"
+                        "0123456789012345678901234567890123456789012345678901234567890123456789 a\"b"},
+      {CSV_COL, 0, 154, "0123456789 ,\x0a 0123456789012345678901234567890123456789012345678901234567890123456789"
+                        "0123456789012345678901234567890123456789012345678901234567890123456789"},
+      {CSV_ROW, '\x0a', 1, NULL}, {CSV_END, 0, 0, NULL} };
+
   /* |'a;b'|| '' |'' | ''|''| */
   struct event custom01_results[] = 
     { {CSV_COL, 0, 5, "'a;b'"},
@@ -420,23 +2195,49 @@ int main (void) {
       {CSV_COL, 0, 2, "''"},
       {CSV_ROW, -1, 1, NULL}, {CSV_END, 0, 0, NULL} };
 
+  /* Long fields with custom space and terminator functions */
+  struct event custom02_results[] =
+    { {CSV_COL, 0, 144, "0123456789012345678901234567890123456789012345678901234567890123456789"
+                        "0123456789012345678901234567890123456789012345678901234567890123456789_x y"},
+      {CSV_COL, 0, 141, "0123456789012345678901234567890123456789012345678901234567890123456789|"
+                        "0123456789012345678901234567890123456789012345678901234567890123456789"},
+      {CSV_ROW, '|', 1, NULL}, {CSV_END, 0, 0, NULL} };
+
+  /* More bytes end a field than can be scanned for with vector instructions */
+  struct event custom03_results[] =
+    { {CSV_COL, 0, 2, "ab"},
+      {CSV_COL, 0, 40, "0123456789012345678901234567890123456789"},
+      {CSV_ROW, '!', 1, NULL},
+      {CSV_COL, 0, 1, "x"},
+      {CSV_ROW, '#', 1, NULL},
+      {CSV_COL, 0, 1, "y"},
+      {CSV_ROW, '\x0d', 1, NULL}, {CSV_END, 0, 0, NULL} };
+
   DO_TEST(01, 0);
   DO_TEST(01, CSV_STRICT);
   DO_TEST(01, CSV_STRICT | CSV_EMPTY_IS_NULL);
+  DO_TEST(01, CSV_ZERO_COPY);
   DO_TEST(02, 0);
   DO_TEST(02, CSV_STRICT);
   DO_TEST(03, 0);
   DO_TEST(03, CSV_STRICT);
+  DO_TEST(03, CSV_ZERO_COPY);
   DO_TEST(04, 0);
   DO_TEST(04, CSV_STRICT);
+  DO_TEST(04, CSV_ZERO_COPY);
   DO_TEST(05, 0);
   DO_TEST(05, CSV_STRICT);
   DO_TEST(05, CSV_STRICT | CSV_STRICT_FINI);
+  DO_TEST(05, CSV_STRICT | CSV_ZERO_COPY);
   DO_TEST(06, 0);
   DO_TEST(06, CSV_STRICT);
+  DO_TEST(06, CSV_ZERO_COPY);
   DO_TEST(07, 0);
+  DO_TEST(07, CSV_ZERO_COPY);
   DO_TEST(07b, CSV_STRICT);
+  DO_TEST(07b, CSV_STRICT | CSV_ZERO_COPY);
   DO_TEST(08, 0);
+  DO_TEST(08, CSV_ZERO_COPY);
   DO_TEST(09, 0);
   DO_TEST(09, CSV_EMPTY_IS_NULL);
   DO_TEST(10, 0);
@@ -449,19 +2250,53 @@ int main (void) {
   DO_TEST(13, 0);
   DO_TEST(14, 0);
   DO_TEST(14, CSV_STRICT);
+  DO_TEST(14, CSV_ZERO_COPY);
   DO_TEST(15, 0);
   DO_TEST(15, CSV_STRICT);
   DO_TEST(16, 0);
   DO_TEST(16, CSV_STRICT);
   DO_TEST(16b, CSV_STRICT | CSV_STRICT_FINI);
+  DO_TEST(16b, CSV_STRICT | CSV_STRICT_FINI | CSV_ZERO_COPY);
   DO_TEST(16, 0);
   DO_TEST(16, CSV_STRICT);
   DO_TEST(17, 0);
   DO_TEST(17, CSV_STRICT);
   DO_TEST(17, CSV_STRICT | CSV_EMPTY_IS_NULL);
+  DO_TEST(17, CSV_ZERO_COPY | CSV_APPEND_NULL);
   DO_TEST(19, CSV_EMPTY_IS_NULL);
+  DO_TEST(19, CSV_EMPTY_IS_NULL | CSV_ZERO_COPY);
+  DO_TEST(20, 0);
+  DO_TEST(20, CSV_ZERO_COPY);
 
   DO_TEST_CUSTOM(01, 0, ';', '\'', NULL, NULL);
+  DO_TEST_CUSTOM(02, 0, ';', '\'', custom_space, custom_term);
+  DO_TEST_CUSTOM(02, CSV_STRICT, ';', '\'', custom_space, custom_term);
+  DO_TEST_CUSTOM(01, CSV_ZERO_COPY, ';', '\'', NULL, NULL);
+  DO_TEST_CUSTOM(02, CSV_ZERO_COPY, ';', '\'', custom_space, custom_term);
+  DO_TEST_CUSTOM(03, 0, ';', '\'', custom_space_many, custom_term_many);
+  DO_TEST_CUSTOM(03, CSV_STRICT | CSV_ZERO_COPY, ';', '\'', custom_space_many, custom_term_many);
+
+  test_dialect_fields();
+  test_zero_copy();
+  test_allocator();
+  test_batch();
+  test_parallel();
+  test_next();
+  test_projection();
+  test_skip_rows();
+  test_validate();
+  test_count();
+#ifdef LLONG_MAX
+  test_typed();
+#endif
+  test_stats();
+  test_file();
+  test_reader();
+  test_compressed();
+  test_index();
+#ifdef HAVE_UNISTD_H
+  test_cache();
+#endif
 
   /* Writer Tests */
 
@@ -477,6 +2312,10 @@ int main (void) {
   test_writer2("1", "abc", 3, "'abc'", 5, '\'');
   test_writer2("2", "''''''''", 8, "''''''''''''''''''", 18, '\'');
 
+  test_write_sizes();
+  test_writer_object();
+  test_writer_rows();
+
   puts("All tests passed");
   return 0;
 }
@@ -0,0 +1,286 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include "./csv.hpp"
+
+/* Count allocations to check that readers do not allocate per row */
+static unsigned long allocations;
+
+void *
+operator new (std::size_t size)
+{
+  void *p = std::malloc(size ? size : 1);
+
+  if (p == NULL)
+    throw std::bad_alloc();
+  allocations++;
+  return p;
+}
+
+void
+operator delete (void *p) noexcept
+{
+  std::free(p);
+}
+
+void
+operator delete (void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+/* The template parser must deliver exactly what csv_parse does, for every
+   dialect and set of options, however the input is split */
+
+static void
+fail (const char *test, const char *msg)
+{
+  std::fprintf(stderr, "C++ test %s failed: %s\n", test, msg);
+  std::exit(EXIT_FAILURE);
+}
+
+static void
+log_field (std::string &log, const void *s, std::size_t len)
+{
+  char buf[32];
+
+  std::sprintf(buf, s ? "F%lu:" : "N%lu:", (unsigned long)len);
+  log += buf;
+  if (s)
+    log.append(static_cast<const char *>(s), len);
+}
+
+static void
+log_row (std::string &log, int c)
+{
+  char buf[32];
+
+  std::sprintf(buf, "R%d;", c);
+  log += buf;
+}
+
+static void
+log_stop (std::string &log, int status, std::size_t pos)
+{
+  char buf[64];
+
+  std::sprintf(buf, "E%d@%lu;", status, (unsigned long)pos);
+  log += buf;
+}
+
+static void
+c_field (void *s, std::size_t len, void *data)
+{
+  log_field(*static_cast<std::string *>(data), s, len);
+}
+
+static void
+c_row (int c, void *data)
+{
+  log_row(*static_cast<std::string *>(data), c);
+}
+
+static std::string
+generate (unsigned char delim, unsigned char quote, unsigned long seed, std::size_t size)
+{
+  /* Bytes of every class mixed so that all the states and strict errors are
+     reached, with runs of ordinary bytes of all lengths */
+  const char other[] = {'a', 'b', ' ', '\t', '\r', '\n', 'x'};
+  std::string s;
+
+  while (s.size() < size) {
+    seed = seed * 1103515245UL + 12345UL;
+    switch ((seed >> 16) % 8) {
+      case 0: s += (char)delim; break;
+      case 1: s += (char)quote; break;
+      case 2: s.append((seed >> 8) % 40, 'z'); break;
+      default: s += other[(seed >> 8) % sizeof other]; break;
+    }
+  }
+  return s;
+}
+
+template <unsigned char Delim, unsigned char Quote, unsigned char Options>
+static void
+check (const char *name)
+{
+  static const std::size_t chunks[] = {1, 3, 7, 64, 100000};
+  std::size_t i, j, k, pos, n, ret;
+  std::string input, expected, got;
+  struct csv_parser p;
+
+  for (i = 0; i < 20; i++) {
+    input = generate(Delim, Quote, i + 1, i < 10 ? 200 : 5000);
+    if (i % 2 && (Options & CSV_STRICT))
+      input = "\"a\"\"b\",c d , \"e\"  \n\"f\r\ng\"," + input.substr(0, i);
+    for (j = 0; j < sizeof chunks / sizeof *chunks; j++) {
+      expected.clear();
+      got.clear();
+
+      csv_init(&p, Options);
+      csv_set_delim(&p, Delim);
+      csv_set_quote(&p, Quote);
+      for (pos = 0; pos < input.size(); pos += n) {
+        n = input.size() - pos < chunks[j] ? input.size() - pos : chunks[j];
+        ret = csv_parse(&p, input.data() + pos, n, c_field, c_row, &expected);
+        if (ret < n) {
+          log_stop(expected, csv_error(&p), pos + ret);
+          break;
+        }
+      }
+      log_stop(expected, csv_fini(&p, c_field, c_row, &expected), 0);
+      csv_free(&p);
+
+      /* A parser left in a field by an error is not reset by fini */
+      csv::basic_csv_parser<Delim, Quote, Options> pp;
+      for (pos = 0; pos < input.size(); pos += n) {
+        n = input.size() - pos < chunks[j] ? input.size() - pos : chunks[j];
+        ret = pp.parse(input.data() + pos, n,
+                       [&got](void *s, std::size_t len) { log_field(got, s, len); },
+                       [&got](int c) { log_row(got, c); });
+        if (ret < n) {
+          log_stop(got, pp.error(), pos + ret);
+          break;
+        }
+      }
+      log_stop(got, pp.fini([&got](void *s, std::size_t len) { log_field(got, s, len); },
+                            [&got](int c) { log_row(got, c); }), 0);
+      if (got != expected) {
+        for (k = 0; k < got.size() && k < expected.size() && got[k] == expected[k]; k++)
+          ;
+        std::fprintf(stderr, "at %lu: expected \"%.40s\", got \"%.40s\"\n", (unsigned long)k,
+                     expected.c_str() + k, got.c_str() + k);
+        fail(name, "results differ from csv_parse");
+      }
+    }
+  }
+}
+
+static void
+test_template (void)
+{
+  check<CSV_COMMA, CSV_QUOTE, 0>("comma");
+  check<CSV_COMMA, CSV_QUOTE, CSV_STRICT>("strict");
+  check<CSV_COMMA, CSV_QUOTE, CSV_STRICT | CSV_STRICT_FINI>("strict_fini");
+  check<CSV_COMMA, CSV_QUOTE, CSV_REPALL_NL>("repall_nl");
+  check<CSV_COMMA, CSV_QUOTE, CSV_APPEND_NULL | CSV_EMPTY_IS_NULL>("append_null");
+  check<CSV_COMMA, CSV_QUOTE, CSV_ZERO_COPY>("zero_copy");
+  check<CSV_COMMA, CSV_QUOTE, CSV_ZERO_COPY | CSV_STRICT | CSV_EMPTY_IS_NULL>("zero_copy_strict");
+  check<CSV_COMMA, CSV_QUOTE, CSV_DFA | CSV_REPALL_NL>("dfa");
+  check<CSV_TAB, CSV_QUOTE, 0>("tab");
+  check<CSV_TAB, '\'', CSV_STRICT>("tab_strict");
+  check<';', '\'', CSV_ZERO_COPY | CSV_REPALL_NL>("semicolon");
+  check<CSV_SPACE, CSV_QUOTE, CSV_EMPTY_IS_NULL>("space");
+  check<CSV_COMMA, CSV_COMMA, 0>("quote_is_delim");
+}
+
+#if __cplusplus >= 201703L
+template <class Reader>
+static std::string
+read_rows (Reader &r, std::size_t *rows)
+{
+  std::string log;
+
+  *rows = 0;
+  for (auto &row : r) {
+    for (std::string_view f : row)
+      log_field(log, f.data() ? f.data() : "", f.size());
+    if (row.size() && row[row.size() - 1] != *(row.end() - 1))
+      fail("reader", "fields differ by index and iterator");
+    log_row(log, 0);
+    (*rows)++;
+  }
+  return log;
+}
+
+static void
+test_reader (void)
+{
+  /* Rows from memory, a mapped file and a stream match the fields and rows
+     of csv_parse, whatever the chunks */
+  static const std::size_t chunks[] = {1, 7, 64, 0};
+  const char *name = "test_csvpp.tmp";
+  std::string input = generate(CSV_COMMA, CSV_QUOTE, 7, 20000), expected, got, block;
+  std::size_t i, rows, expected_rows = 0;
+  struct csv_parser p;
+  unsigned long before;
+  std::FILE *fp;
+
+  csv_init(&p, 0);
+  csv_parse(&p, input.data(), input.size(),
+            [](void *s, std::size_t len, void *data) {
+              log_field(*static_cast<std::string *>(data), s ? s : (void *)"", len);
+            },
+            [](int, void *data) { log_row(*static_cast<std::string *>(data), 0); }, &expected);
+  csv_fini(&p,
+           [](void *s, std::size_t len, void *data) {
+             log_field(*static_cast<std::string *>(data), s ? s : (void *)"", len);
+           },
+           [](int, void *data) { log_row(*static_cast<std::string *>(data), 0); }, &expected);
+  csv_free(&p);
+  for (i = 0; (i = expected.find("R0;", i)) != std::string::npos; i += 3)
+    expected_rows++;
+
+  fp = std::fopen(name, "wb");
+  if (fp == NULL || std::fwrite(input.data(), 1, input.size(), fp) != input.size() || std::fclose(fp) != 0)
+    fail("reader", "failed to write test file");
+
+  for (i = 0; i < sizeof chunks / sizeof *chunks; i++) {
+    csv::reader mem(std::string_view(input), chunks[i]);
+    if ((got = read_rows(mem, &rows)) != expected || rows != expected_rows || mem.error() != CSV_SUCCESS)
+      fail("reader", "rows from memory differ from csv_parse");
+
+    csv::reader file(std::string(name), chunks[i]);
+    if (read_rows(file, &rows) != expected || file.error() != CSV_SUCCESS)
+      fail("reader", "rows from a file differ from csv_parse");
+
+    fp = std::fopen(name, "rb");
+    csv::reader stream(fp, chunks[i]);
+    if (read_rows(stream, &rows) != expected || stream.error() != CSV_SUCCESS)
+      fail("reader", "rows from a stream differ from csv_parse");
+    std::fclose(fp);
+  }
+  std::remove(name);
+
+  csv::reader missing(name);
+  if (missing.begin() != missing.end() || missing.error() != CSV_EREAD)
+    fail("reader", "missing file was not reported");
+
+  /* Rows end at a parse error */
+  input = "a,b\nc,\"d\"e\nf\n";
+  csv::basic_reader<CSV_COMMA, CSV_QUOTE, CSV_STRICT> strict{std::string_view(input)};
+  if (read_rows(strict, &rows) != "F1:aF1:bR0;" || strict.error() != CSV_EPARSE)
+    fail("reader", "parse error was not reported");
+
+  /* Once the buffers have grown, rows are read without allocating */
+  for (i = 0; i < 1000; i++)
+    block += "abc,\"q\"\"x\",  spaced  ,\"a\nb\",12345\n";
+  input.clear();
+  for (i = 0; i < 20; i++)
+    input += block;
+  csv::reader repeated(std::string_view(input), block.size());
+  before = 0;
+  rows = 0;
+  for (auto &row : repeated) {
+    if (row.size() != 5 || row[1] != "q\"x" || row[2] != "spaced" || row[3] != "a\nb")
+      fail("reader", "wrong fields");
+    if (++rows == 2 * 1000 + 1)
+      before = allocations;
+  }
+  if (rows != 20 * 1000 || allocations != before)
+    fail("reader", "rows were allocated");
+}
+#endif
+
+int
+main (void)
+{
+  test_template();
+#if __cplusplus >= 201703L
+  test_reader();
+#endif
+  std::puts("All C++ tests passed");
+  return 0;
+}